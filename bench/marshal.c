@@ -0,0 +1,284 @@
+/*
+ * Copyright (c) 2024, Janet-pkcs11 Seungki Kim
+ *
+ * Janet-pkcs11 is released under the MIT License, see the LICENSE file.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "main.h"
+#include "types.h"
+#include "attribute.h"
+
+/*
+ * Marshalling microbenchmarks
+ *
+ * Times the conversions between Janet values and PKCS #11 templates and
+ * mechanisms run on every object and key call, with templates of 5, 12 and
+ * 30 attributes of mixed types. Heap allocations are counted by wrapping
+ * malloc, calloc and realloc at link time, so libjanet must be linked
+ * statically. Built and run by:
+ *
+ *   jpm run bench-marshal
+ */
+
+#define ROUNDS 200000
+#define BATCH 1000
+
+static unsigned long long alloc_count;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    alloc_count++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+    alloc_count++;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    alloc_count++;
+    return __real_realloc(ptr, size);
+}
+
+typedef enum value_kind {
+    VALUE_BOOL,
+    VALUE_KEYWORD,
+    VALUE_NUMBER,
+    VALUE_BYTES
+} value_kind_t;
+
+typedef struct attr_spec {
+    const char *name;
+    value_kind_t kind;
+    const char *value;
+} attr_spec_t;
+
+/* Any prefix of this list is a template of mixed value types */
+static const attr_spec_t attr_specs[] = {
+    {"CKA_CLASS",                VALUE_KEYWORD, "CKO_SECRET_KEY"},
+    {"CKA_KEY_TYPE",             VALUE_KEYWORD, "CKK_AES"},
+    {"CKA_TOKEN",                VALUE_BOOL,    "true"},
+    {"CKA_LABEL",                VALUE_BYTES,   "benchmark key"},
+    {"CKA_VALUE_LEN",            VALUE_NUMBER,  "32"},
+    {"CKA_PRIVATE",              VALUE_BOOL,    "true"},
+    {"CKA_ID",                   VALUE_BYTES,   "\x01\x02\x03\x04\x05\x06\x07\x08"},
+    {"CKA_SENSITIVE",            VALUE_BOOL,    "true"},
+    {"CKA_ENCRYPT",              VALUE_BOOL,    "true"},
+    {"CKA_DECRYPT",              VALUE_BOOL,    "true"},
+    {"CKA_KEY_GEN_MECHANISM",    VALUE_KEYWORD, "CKM_AES_KEY_GEN"},
+    {"CKA_SUBJECT",              VALUE_BYTES,   "CN=janet-pkcs11 benchmark"},
+    {"CKA_EXTRACTABLE",          VALUE_BOOL,    "false"},
+    {"CKA_WRAP",                 VALUE_BOOL,    "true"},
+    {"CKA_UNWRAP",               VALUE_BOOL,    "true"},
+    {"CKA_SIGN",                 VALUE_BOOL,    "false"},
+    {"CKA_VERIFY",               VALUE_BOOL,    "false"},
+    {"CKA_APPLICATION",          VALUE_BYTES,   "janet-pkcs11"},
+    {"CKA_MODULUS_BITS",         VALUE_NUMBER,  "2048"},
+    {"CKA_DERIVE",               VALUE_BOOL,    "false"},
+    {"CKA_MODIFIABLE",           VALUE_BOOL,    "true"},
+    {"CKA_COPYABLE",             VALUE_BOOL,    "true"},
+    {"CKA_DESTROYABLE",          VALUE_BOOL,    "true"},
+    {"CKA_VALUE",                VALUE_BYTES,   "0123456789abcdef0123456789abcdef"},
+    {"CKA_SIGN_RECOVER",         VALUE_BOOL,    "false"},
+    {"CKA_VERIFY_RECOVER",       VALUE_BOOL,    "false"},
+    {"CKA_WRAP_WITH_TRUSTED",    VALUE_BOOL,    "false"},
+    {"CKA_CERTIFICATE_CATEGORY", VALUE_NUMBER,  "0"},
+    {"CKA_OBJECT_ID",            VALUE_BYTES,   "\x06\x03\x55\x04\x03"},
+    {"CKA_ALWAYS_AUTHENTICATE",  VALUE_BOOL,    "false"},
+};
+
+#define ATTR_COUNT ((int)(sizeof(attr_specs) / sizeof(attr_specs[0])))
+
+static const int shapes[] = {5, 12, ATTR_COUNT};
+
+#define SHAPE_COUNT ((int)(sizeof(shapes) / sizeof(shapes[0])))
+
+static Janet spec_value(const attr_spec_t *spec)
+{
+    switch (spec->kind) {
+        case VALUE_BOOL:
+            return janet_wrap_boolean(spec->value[0] == 't');
+        case VALUE_KEYWORD:
+            return janet_ckeywordv(spec->value);
+        case VALUE_NUMBER:
+            return janet_wrap_number(strtod(spec->value, NULL));
+        default:
+            return janet_cstringv(spec->value);
+    }
+}
+
+/* Inputs of the cases, rooted for the whole run */
+static JanetStruct structs[SHAPE_COUNT];
+static JanetTuple tuples[SHAPE_COUNT];
+static CK_ATTRIBUTE_PTR templates[SHAPE_COUNT];
+static JanetStruct mechanism_struct;
+static JanetKeyword keywords[ATTR_COUNT];
+static CK_ATTRIBUTE_TYPE types[ATTR_COUNT];
+
+static void free_template(CK_ATTRIBUTE_PTR p_template, int count)
+{
+    for (int i=0; i<count; i++) {
+        janet_sfree(p_template[i].pValue);
+    }
+    janet_sfree(p_template);
+}
+
+/* Moves a template out of scratch memory, which janet_collect may release */
+static CK_ATTRIBUTE_PTR copy_template(CK_ATTRIBUTE_PTR p_template, int count)
+{
+    CK_ATTRIBUTE_PTR copy = malloc(count * sizeof(CK_ATTRIBUTE));
+    for (int i=0; i<count; i++) {
+        copy[i] = p_template[i];
+        copy[i].pValue = malloc(p_template[i].ulValueLen);
+        memcpy(copy[i].pValue, p_template[i].pValue, p_template[i].ulValueLen);
+    }
+    free_template(p_template, count);
+
+    return copy;
+}
+
+static void setup(void)
+{
+    for (int s=0; s<SHAPE_COUNT; s++) {
+        JanetKV *st = janet_struct_begin(shapes[s]);
+        Janet *tup = janet_tuple_begin(shapes[s]);
+        for (int i=0; i<shapes[s]; i++) {
+            janet_struct_put(st, janet_ckeywordv(attr_specs[i].name), spec_value(&attr_specs[i]));
+            tup[i] = janet_ckeywordv(attr_specs[i].name);
+        }
+        structs[s] = janet_struct_end(st);
+        tuples[s] = janet_tuple_end(tup);
+        janet_gcroot(janet_wrap_struct(structs[s]));
+        janet_gcroot(janet_wrap_tuple(tuples[s]));
+        templates[s] = copy_template(janet_struct_to_p11_template(structs[s]), shapes[s]);
+    }
+
+    JanetKV *mech = janet_struct_begin(2);
+    janet_struct_put(mech, janet_ckeywordv("mechanism"), janet_ckeywordv("CKM_AES_CBC_PAD"));
+    janet_struct_put(mech, janet_ckeywordv("parameter"), janet_cstringv("0123456789abcdef"));
+    mechanism_struct = janet_struct_end(mech);
+    janet_gcroot(janet_wrap_struct(mechanism_struct));
+
+    for (int i=0; i<ATTR_COUNT; i++) {
+        keywords[i] = janet_ckeyword(attr_specs[i].name);
+        janet_gcroot(janet_wrap_keyword(keywords[i]));
+        types[i] = get_type_value(keywords[i]);
+    }
+}
+
+typedef void (*case_fn)(int shape, int round);
+
+static volatile unsigned long sink;
+
+static void struct_to_template(int shape, int round)
+{
+    CK_ATTRIBUTE_PTR p_template = janet_struct_to_p11_template(structs[shape]);
+    free_template(p_template, shapes[shape]);
+}
+
+static void tuple_to_template(int shape, int round)
+{
+    CK_ATTRIBUTE_PTR p_template = create_new_p11_template_from_janet_tuple(tuples[shape]);
+    janet_sfree(p_template);
+}
+
+static void template_to_struct(int shape, int round)
+{
+    Janet st = p11_template_to_janet(templates[shape], shapes[shape],
+                                     P11_RESULT_STRUCT, janet_wrap_nil());
+    sink += (unsigned long)janet_struct_length(janet_unwrap_struct(st));
+}
+
+static void struct_to_mechanism(int shape, int round)
+{
+    CK_MECHANISM_PTR p_mechanism = janet_struct_to_p11_mechanism(mechanism_struct);
+    janet_sfree(p_mechanism->pParameter);
+    janet_sfree(p_mechanism);
+}
+
+static void type_value(int shape, int round)
+{
+    sink += get_type_value(keywords[round % ATTR_COUNT]);
+}
+
+static void type_to_string(int shape, int round)
+{
+    sink += (unsigned long)p11_attr_type_to_string(types[round % ATTR_COUNT])[4];
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/* Runs `fn` ROUNDS times, collecting garbage between batches outside the timing */
+static void run(const char *name, case_fn fn, int shape)
+{
+    double elapsed = 0;
+    unsigned long long allocs = 0;
+
+    for (int i=0; i<BATCH; i++) {
+        fn(shape, i);
+    }
+    janet_collect();
+
+    for (int done=0; done<ROUNDS; done += BATCH) {
+        unsigned long long allocs_before = alloc_count;
+        double start = now_ns();
+        for (int i=0; i<BATCH; i++) {
+            fn(shape, done + i);
+        }
+        elapsed += now_ns() - start;
+        allocs += alloc_count - allocs_before;
+        janet_collect();
+    }
+
+    printf("%-40s %4d %10.1f ns/op %8.2f allocs/op\n", name,
+           shape < 0 ? 1 : shapes[shape], elapsed / ROUNDS, (double)allocs / ROUNDS);
+}
+
+int main(void)
+{
+    janet_init();
+    init_type_table();
+    setup();
+
+    printf("%-40s %4s %16s %18s\n", "case", "n", "time", "allocations");
+    for (int s=0; s<SHAPE_COUNT; s++) {
+        run("janet_struct_to_p11_template", struct_to_template, s);
+    }
+    for (int s=0; s<SHAPE_COUNT; s++) {
+        run("create_new_p11_template_from_janet_tuple", tuple_to_template, s);
+    }
+    for (int s=0; s<SHAPE_COUNT; s++) {
+        run("p11_template_to_janet", template_to_struct, s);
+    }
+    run("janet_struct_to_p11_mechanism", struct_to_mechanism, -1);
+    run("get_type_value", type_value, -1);
+    run("p11_attr_type_to_string", type_to_string, -1);
+
+    for (int s=0; s<SHAPE_COUNT; s++) {
+        for (int i=0; i<shapes[s]; i++) {
+            free(templates[s][i].pValue);
+        }
+        free(templates[s]);
+    }
+    janet_deinit();
+
+    return 0;
+}
@@ -0,0 +1,1547 @@
+/*
+ * Copyright (c) 2024, Janet-pkcs11 Seungki Kim
+ *
+ * Janet-pkcs11 is released under the MIT License, see the LICENSE file.
+ */
+
+/* nanosleep() is not part of C99 */
+#define _DEFAULT_SOURCE
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "pkcs11_header/pkcs11.h"
+
+/*
+ * Mock PKCS #11 provider
+ *
+ * A small in-memory provider for benchmarks and tests of the wrapper. It has
+ * one slot with one token, accepts any PIN and any mechanism, and does
+ * deterministic stand-in crypto, so the cost measured through it is the
+ * cost of the wrapper:
+ *
+ *   encrypt, decrypt - XOR with a keystream derived from the key, the output
+ *                      is as long as the input
+ *   digest           - 32 bytes from a 64-bit FNV-1a state
+ *   sign, verify     - the digest seeded with the key, 32 bytes
+ *
+ * The following environment variables are read by C_Initialize:
+ *
+ *   P11MOCK_LATENCY_US - microseconds added to every call
+ *   P11MOCK_JITTER_US  - up to that many more microseconds, at random
+ *   P11MOCK_ERROR_RATE - probability of a call failing with CKR_DEVICE_ERROR
+ *   P11MOCK_SEED       - seed of the jitter and error draws
+ *
+ * Injected latency and errors apply to every call but C_Initialize,
+ * C_Finalize, C_GetInfo and C_GetFunctionList. A failed call changes no
+ * state.
+ */
+
+#define MOCK_SLOT_ID 1
+#define MOCK_MAX_SESSIONS 1024
+#define MOCK_MAX_OBJECTS 4096
+#define MOCK_MAX_ATTRS 16
+#define MOCK_OUTPUT_LEN 32
+
+#define MOCK_STRING(dst, src) mock_pad((dst), sizeof(dst), (src))
+
+typedef enum mock_op_type {
+    MOCK_OP_ENCRYPT,
+    MOCK_OP_DECRYPT,
+    MOCK_OP_DIGEST,
+    MOCK_OP_SIGN,
+    MOCK_OP_VERIFY,
+    MOCK_OP_COUNT
+} mock_op_type_t;
+
+typedef struct mock_op {
+    bool is_active;
+    uint64_t key;
+    uint64_t state;     /* hash state, or keystream position */
+} mock_op_t;
+
+typedef struct mock_session {
+    bool is_open;
+    CK_FLAGS flags;
+    mock_op_t ops[MOCK_OP_COUNT];
+    bool is_finding;
+    CK_ATTRIBUTE_PTR find_template;
+    CK_ULONG find_count;
+    CK_ULONG find_next;
+} mock_session_t;
+
+typedef struct mock_object {
+    bool is_used;
+    CK_ULONG count;
+    CK_ATTRIBUTE attrs[MOCK_MAX_ATTRS];
+} mock_object_t;
+
+typedef struct mock_config {
+    uint64_t latency_us;
+    uint64_t jitter_us;
+    double error_rate;
+} mock_config_t;
+
+static pthread_mutex_t mock_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool mock_initialized = false;
+static bool mock_logged_in = false;
+static mock_config_t mock_config;
+static uint64_t mock_rand_state;
+static CK_UTF8CHAR mock_label[32];
+static mock_session_t mock_sessions[MOCK_MAX_SESSIONS];
+static mock_object_t mock_objects[MOCK_MAX_OBJECTS];
+
+static const CK_MECHANISM_TYPE mock_mechanisms[] = {
+    CKM_AES_KEY_GEN,
+    CKM_AES_CTR,
+    CKM_GENERIC_SECRET_KEY_GEN,
+    CKM_SHA256,
+    CKM_SHA256_HMAC,
+};
+
+static CK_FUNCTION_LIST mock_function_list;
+
+/* Helpers */
+
+static uint64_t mock_mix(uint64_t x)
+{
+    /* splitmix64 */
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+static uint64_t mock_rand(void)
+{
+    pthread_mutex_lock(&mock_lock);
+    mock_rand_state = mock_mix(mock_rand_state);
+    uint64_t r = mock_rand_state;
+    pthread_mutex_unlock(&mock_lock);
+
+    return r;
+}
+
+static void mock_pad(CK_UTF8CHAR *dst, size_t size, const char *src)
+{
+    size_t len = strlen(src);
+    memset(dst, ' ', size);
+    memcpy(dst, src, len < size ? len : size);
+}
+
+static uint64_t mock_env(const char *name, uint64_t fallback)
+{
+    const char *value = getenv(name);
+    return value != NULL ? strtoull(value, NULL, 10) : fallback;
+}
+
+static void mock_sleep(uint64_t us)
+{
+    struct timespec ts;
+    ts.tv_sec = (time_t)(us / 1000000);
+    ts.tv_nsec = (long)(us % 1000000) * 1000;
+
+    while (nanosleep(&ts, &ts) != 0) {
+    }
+}
+
+/* Injects the configured latency and errors, done outside of the lock */
+static CK_RV mock_enter(void)
+{
+    if (!__atomic_load_n(&mock_initialized, __ATOMIC_ACQUIRE)) {
+        return CKR_CRYPTOKI_NOT_INITIALIZED;
+    }
+
+    uint64_t us = mock_config.latency_us;
+    if (mock_config.jitter_us) {
+        us += mock_rand() % (mock_config.jitter_us + 1);
+    }
+    if (us) {
+        mock_sleep(us);
+    }
+
+    if (mock_config.error_rate > 0 &&
+        (double)(mock_rand() >> 11) / (double)(1ULL << 53) < mock_config.error_rate) {
+        return CKR_DEVICE_ERROR;
+    }
+
+    return CKR_OK;
+}
+
+#define MOCK_ENTER()                    \
+    do {                                \
+        CK_RV enter_rv = mock_enter();  \
+        if (enter_rv != CKR_OK) {       \
+            return enter_rv;            \
+        }                               \
+    } while (0)
+
+/* Sessions and objects, called with the lock held */
+
+static mock_session_t *mock_session(CK_SESSION_HANDLE handle)
+{
+    if (handle == CK_INVALID_HANDLE || handle > MOCK_MAX_SESSIONS ||
+        !mock_sessions[handle - 1].is_open) {
+        return NULL;
+    }
+
+    return &mock_sessions[handle - 1];
+}
+
+static mock_object_t *mock_object(CK_OBJECT_HANDLE handle)
+{
+    if (handle == CK_INVALID_HANDLE || handle > MOCK_MAX_OBJECTS ||
+        !mock_objects[handle - 1].is_used) {
+        return NULL;
+    }
+
+    return &mock_objects[handle - 1];
+}
+
+static CK_ATTRIBUTE_PTR mock_find_attr(mock_object_t *obj, CK_ATTRIBUTE_TYPE type)
+{
+    for (CK_ULONG i=0; i<obj->count; i++) {
+        if (obj->attrs[i].type == type) {
+            return &obj->attrs[i];
+        }
+    }
+
+    return NULL;
+}
+
+static CK_RV mock_set_attr(mock_object_t *obj, const CK_ATTRIBUTE *attr)
+{
+    CK_ATTRIBUTE_PTR dst = mock_find_attr(obj, attr->type);
+    if (dst == NULL) {
+        if (obj->count == MOCK_MAX_ATTRS) {
+            return CKR_TEMPLATE_INCONSISTENT;
+        }
+        dst = &obj->attrs[obj->count++];
+        dst->type = attr->type;
+        dst->pValue = NULL;
+        dst->ulValueLen = 0;
+    }
+
+    void *value = NULL;
+    if (attr->ulValueLen) {
+        if (attr->pValue == NULL || (value = malloc(attr->ulValueLen)) == NULL) {
+            return attr->pValue == NULL ? CKR_ATTRIBUTE_VALUE_INVALID : CKR_HOST_MEMORY;
+        }
+        memcpy(value, attr->pValue, attr->ulValueLen);
+    }
+
+    free(dst->pValue);
+    dst->pValue = value;
+    dst->ulValueLen = attr->ulValueLen;
+    return CKR_OK;
+}
+
+static void mock_free_object(mock_object_t *obj)
+{
+    for (CK_ULONG i=0; i<obj->count; i++) {
+        free(obj->attrs[i].pValue);
+    }
+    memset(obj, 0, sizeof(*obj));
+}
+
+static CK_RV mock_new_object(const CK_ATTRIBUTE *tpl, CK_ULONG count,
+                             CK_OBJECT_CLASS class, CK_OBJECT_HANDLE_PTR handle)
+{
+    for (CK_ULONG h=1; h<=MOCK_MAX_OBJECTS; h++) {
+        mock_object_t *obj = &mock_objects[h - 1];
+        if (obj->is_used) {
+            continue;
+        }
+
+        obj->is_used = true;
+        CK_ATTRIBUTE class_attr = {CKA_CLASS, &class, sizeof(class)};
+        CK_RV rv = mock_set_attr(obj, &class_attr);
+        for (CK_ULONG i=0; rv == CKR_OK && i<count; i++) {
+            rv = mock_set_attr(obj, &tpl[i]);
+        }
+        if (rv != CKR_OK) {
+            mock_free_object(obj);
+            return rv;
+        }
+
+        *handle = h;
+        return CKR_OK;
+    }
+
+    return CKR_DEVICE_MEMORY;
+}
+
+static bool mock_match(mock_object_t *obj, const CK_ATTRIBUTE *tpl, CK_ULONG count)
+{
+    for (CK_ULONG i=0; i<count; i++) {
+        CK_ATTRIBUTE_PTR attr = mock_find_attr(obj, tpl[i].type);
+        if (attr == NULL || attr->ulValueLen != tpl[i].ulValueLen ||
+            (attr->ulValueLen && memcmp(attr->pValue, tpl[i].pValue, attr->ulValueLen) != 0)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void mock_end_find(mock_session_t *s)
+{
+    if (s->find_template != NULL) {
+        for (CK_ULONG i=0; i<s->find_count; i++) {
+            free(s->find_template[i].pValue);
+        }
+        free(s->find_template);
+    }
+    s->find_template = NULL;
+    s->find_count = 0;
+    s->find_next = 0;
+    s->is_finding = false;
+}
+
+static void mock_close_session(mock_session_t *s)
+{
+    mock_end_find(s);
+    memset(s, 0, sizeof(*s));
+}
+
+/* Crypto stand-ins */
+
+static uint64_t mock_hash_init(CK_MECHANISM_TYPE mechanism, uint64_t key)
+{
+    return 0xCBF29CE484222325ULL ^ mock_mix(mechanism) ^ key;
+}
+
+static uint64_t mock_hash_update(uint64_t state, const CK_BYTE *data, CK_ULONG len)
+{
+    for (CK_ULONG i=0; i<len; i++) {
+        state ^= data[i];
+        state *= 0x100000001B3ULL;
+    }
+
+    return state;
+}
+
+static void mock_hash_final(uint64_t state, CK_BYTE_PTR out)
+{
+    for (int i=0; i<MOCK_OUTPUT_LEN / 8; i++) {
+        uint64_t v = mock_mix(state + (uint64_t)i);
+        memcpy(out + i * 8, &v, 8);
+    }
+}
+
+static void mock_keystream(mock_op_t *op, const CK_BYTE *in, CK_ULONG len, CK_BYTE_PTR out)
+{
+    for (CK_ULONG i=0; i<len; i++) {
+        uint64_t pos = op->state++;
+        uint64_t block = mock_mix(op->key ^ (pos >> 3));
+        out[i] = in[i] ^ (CK_BYTE)(block >> ((pos & 7) * 8));
+    }
+}
+
+/*
+ * Checks the output buffer of a call returning `len` bytes. Returns CKR_OK
+ * if the output can be written, and sets `*done` when the call is over
+ * without writing, i.e. a length query.
+ */
+static CK_RV mock_output(CK_BYTE_PTR out, CK_ULONG_PTR out_len, CK_ULONG len, bool *done)
+{
+    *done = false;
+    if (out_len == NULL) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    if (out == NULL) {
+        *out_len = len;
+        *done = true;
+        return CKR_OK;
+    }
+
+    if (*out_len < len) {
+        *out_len = len;
+        return CKR_BUFFER_TOO_SMALL;
+    }
+
+    *out_len = len;
+    return CKR_OK;
+}
+
+/* Locks and returns the session with an active `op`, or an error in `*rv` */
+static mock_session_t *mock_lock_op(CK_SESSION_HANDLE handle, mock_op_type_t op, CK_RV *rv)
+{
+    pthread_mutex_lock(&mock_lock);
+    mock_session_t *s = mock_session(handle);
+    if (s == NULL) {
+        *rv = CKR_SESSION_HANDLE_INVALID;
+    } else if (!s->ops[op].is_active) {
+        *rv = CKR_OPERATION_NOT_INITIALIZED;
+    } else {
+        *rv = CKR_OK;
+        return s;
+    }
+
+    pthread_mutex_unlock(&mock_lock);
+    return NULL;
+}
+
+static CK_RV mock_op_init(CK_SESSION_HANDLE handle, mock_op_type_t op,
+                          CK_MECHANISM_PTR mechanism, CK_OBJECT_HANDLE key)
+{
+    MOCK_ENTER();
+    if (mechanism == NULL) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    CK_RV rv = CKR_OK;
+    pthread_mutex_lock(&mock_lock);
+    mock_session_t *s = mock_session(handle);
+    if (s == NULL) {
+        rv = CKR_SESSION_HANDLE_INVALID;
+    } else if (s->ops[op].is_active) {
+        rv = CKR_OPERATION_ACTIVE;
+    } else if (op != MOCK_OP_DIGEST && mock_object(key) == NULL) {
+        rv = CKR_KEY_HANDLE_INVALID;
+    } else {
+        uint64_t k = op == MOCK_OP_DIGEST ? 0 : mock_mix(key);
+        s->ops[op].is_active = true;
+        s->ops[op].key = k;
+        s->ops[op].state = (op == MOCK_OP_ENCRYPT || op == MOCK_OP_DECRYPT) ?
+            0 : mock_hash_init(mechanism->mechanism, k);
+    }
+    pthread_mutex_unlock(&mock_lock);
+
+    return rv;
+}
+
+/* Runs an update of the XOR cipher, `in` and `out` may be the same */
+static CK_RV mock_crypt_update(CK_SESSION_HANDLE handle, mock_op_type_t op,
+                               CK_BYTE_PTR in, CK_ULONG in_len,
+                               CK_BYTE_PTR out, CK_ULONG_PTR out_len, bool is_final)
+{
+    MOCK_ENTER();
+
+    CK_RV rv;
+    mock_session_t *s = mock_lock_op(handle, op, &rv);
+    if (s == NULL) {
+        return rv;
+    }
+
+    bool done;
+    rv = mock_output(out, out_len, in_len, &done);
+    if (rv == CKR_OK && !done) {
+        mock_keystream(&s->ops[op], in, in_len, out);
+        if (is_final) {
+            s->ops[op].is_active = false;
+        }
+    }
+    pthread_mutex_unlock(&mock_lock);
+
+    return rv;
+}
+
+static CK_RV mock_hash_part(CK_SESSION_HANDLE handle, mock_op_type_t op,
+                            CK_BYTE_PTR in, CK_ULONG in_len)
+{
+    CK_RV rv;
+    mock_session_t *s = mock_lock_op(handle, op, &rv);
+    if (s == NULL) {
+        return rv;
+    }
+
+    s->ops[op].state = mock_hash_update(s->ops[op].state, in, in_len);
+    pthread_mutex_unlock(&mock_lock);
+
+    return CKR_OK;
+}
+
+/*
+ * Runs an update of both `crypt_op` and `hash_op` under one lock, hashing
+ * the output of the cipher if `hash_output` is set, or its input otherwise.
+ * Neither operation is touched unless both are active.
+ */
+static CK_RV mock_dual_update(CK_SESSION_HANDLE handle, mock_op_type_t crypt_op,
+                              mock_op_type_t hash_op, bool hash_output,
+                              CK_BYTE_PTR in, CK_ULONG in_len,
+                              CK_BYTE_PTR out, CK_ULONG_PTR out_len)
+{
+    MOCK_ENTER();
+
+    CK_RV rv;
+    mock_session_t *s = mock_lock_op(handle, crypt_op, &rv);
+    if (s == NULL) {
+        return rv;
+    }
+
+    bool done = false;
+    if (!s->ops[hash_op].is_active) {
+        rv = CKR_OPERATION_NOT_INITIALIZED;
+    } else {
+        rv = mock_output(out, out_len, in_len, &done);
+    }
+    if (rv == CKR_OK && !done) {
+        /* Hashes the input first, as `in` and `out` may be the same */
+        if (!hash_output) {
+            s->ops[hash_op].state = mock_hash_update(s->ops[hash_op].state, in, in_len);
+        }
+        mock_keystream(&s->ops[crypt_op], in, in_len, out);
+        if (hash_output) {
+            s->ops[hash_op].state = mock_hash_update(s->ops[hash_op].state, out, in_len);
+        }
+    }
+    pthread_mutex_unlock(&mock_lock);
+
+    return rv;
+}
+
+/* Finishes a digest or signature, after hashing `in` if given */
+static CK_RV mock_hash_finish(CK_SESSION_HANDLE handle, mock_op_type_t op,
+                              CK_BYTE_PTR in, CK_ULONG in_len,
+                              CK_BYTE_PTR out, CK_ULONG_PTR out_len)
+{
+    MOCK_ENTER();
+
+    CK_RV rv;
+    mock_session_t *s = mock_lock_op(handle, op, &rv);
+    if (s == NULL) {
+        return rv;
+    }
+
+    bool done;
+    rv = mock_output(out, out_len, MOCK_OUTPUT_LEN, &done);
+    if (rv == CKR_OK && !done) {
+        mock_hash_final(mock_hash_update(s->ops[op].state, in, in_len), out);
+        s->ops[op].is_active = false;
+    }
+    pthread_mutex_unlock(&mock_lock);
+
+    return rv;
+}
+
+static CK_RV mock_verify_finish(CK_SESSION_HANDLE handle, CK_BYTE_PTR in, CK_ULONG in_len,
+                                CK_BYTE_PTR sig, CK_ULONG sig_len)
+{
+    MOCK_ENTER();
+
+    CK_RV rv;
+    mock_session_t *s = mock_lock_op(handle, MOCK_OP_VERIFY, &rv);
+    if (s == NULL) {
+        return rv;
+    }
+
+    CK_BYTE expected[MOCK_OUTPUT_LEN];
+    mock_hash_final(mock_hash_update(s->ops[MOCK_OP_VERIFY].state, in, in_len), expected);
+    s->ops[MOCK_OP_VERIFY].is_active = false;
+    pthread_mutex_unlock(&mock_lock);
+
+    if (sig_len != MOCK_OUTPUT_LEN) {
+        return CKR_SIGNATURE_LEN_RANGE;
+    }
+
+    return memcmp(expected, sig, MOCK_OUTPUT_LEN) == 0 ? CKR_OK : CKR_SIGNATURE_INVALID;
+}
+
+/* General purpose functions */
+
+static CK_RV mock_Initialize(void *init_args)
+{
+    pthread_mutex_lock(&mock_lock);
+    if (mock_initialized) {
+        pthread_mutex_unlock(&mock_lock);
+        return CKR_CRYPTOKI_ALREADY_INITIALIZED;
+    }
+
+    mock_config.latency_us = mock_env("P11MOCK_LATENCY_US", 0);
+    mock_config.jitter_us = mock_env("P11MOCK_JITTER_US", 0);
+    const char *rate = getenv("P11MOCK_ERROR_RATE");
+    mock_config.error_rate = rate != NULL ? strtod(rate, NULL) : 0.0;
+    mock_rand_state = mock_env("P11MOCK_SEED", 1);
+
+    mock_logged_in = false;
+    MOCK_STRING(mock_label, "janet-pkcs11-mock");
+
+    __atomic_store_n(&mock_initialized, true, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&mock_lock);
+
+    return CKR_OK;
+}
+
+static CK_RV mock_Finalize(void *reserved)
+{
+    if (reserved != NULL) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    pthread_mutex_lock(&mock_lock);
+    if (!mock_initialized) {
+        pthread_mutex_unlock(&mock_lock);
+        return CKR_CRYPTOKI_NOT_INITIALIZED;
+    }
+
+    for (int i=0; i<MOCK_MAX_SESSIONS; i++) {
+        mock_close_session(&mock_sessions[i]);
+    }
+    for (int i=0; i<MOCK_MAX_OBJECTS; i++) {
+        mock_free_object(&mock_objects[i]);
+    }
+    __atomic_store_n(&mock_initialized, false, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&mock_lock);
+
+    return CKR_OK;
+}
+
+static CK_RV mock_GetInfo(CK_INFO *info)
+{
+    if (!__atomic_load_n(&mock_initialized, __ATOMIC_ACQUIRE)) {
+        return CKR_CRYPTOKI_NOT_INITIALIZED;
+    }
+    if (info == NULL) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    memset(info, 0, sizeof(*info));
+    info->cryptokiVersion.major = 2;
+    info->cryptokiVersion.minor = 40;
+    MOCK_STRING(info->manufacturerID, "janet-pkcs11");
+    MOCK_STRING(info->libraryDescription, "Mock provider");
+    info->libraryVersion.major = 1;
+
+    return CKR_OK;
+}
+
+CK_RV C_GetFunctionList(CK_FUNCTION_LIST **list)
+{
+    if (list == NULL) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    *list = &mock_function_list;
+    return CKR_OK;
+}
+
+/* Slot and token management functions */
+
+static CK_RV mock_GetSlotList(CK_BBOOL present, CK_SLOT_ID *slots, CK_ULONG *count)
+{
+    MOCK_ENTER();
+    if (count == NULL) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    if (slots != NULL) {
+        if (*count < 1) {
+            *count = 1;
+            return CKR_BUFFER_TOO_SMALL;
+        }
+        slots[0] = MOCK_SLOT_ID;
+    }
+    *count = 1;
+
+    return CKR_OK;
+}
+
+static CK_RV mock_GetSlotInfo(CK_SLOT_ID slot, CK_SLOT_INFO *info)
+{
+    MOCK_ENTER();
+    if (slot != MOCK_SLOT_ID) {
+        return CKR_SLOT_ID_INVALID;
+    }
+    if (info == NULL) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    memset(info, 0, sizeof(*info));
+    MOCK_STRING(info->slotDescription, "Mock slot");
+    MOCK_STRING(info->manufacturerID, "janet-pkcs11");
+    info->flags = CKF_TOKEN_PRESENT;
+
+    return CKR_OK;
+}
+
+static CK_RV mock_GetTokenInfo(CK_SLOT_ID slot, CK_TOKEN_INFO *info)
+{
+    MOCK_ENTER();
+    if (slot != MOCK_SLOT_ID) {
+        return CKR_SLOT_ID_INVALID;
+    }
+    if (info == NULL) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    memset(info, 0, sizeof(*info));
+    pthread_mutex_lock(&mock_lock);
+    memcpy(info->label, mock_label, sizeof(info->label));
+    pthread_mutex_unlock(&mock_lock);
+    MOCK_STRING(info->manufacturerID, "janet-pkcs11");
+    MOCK_STRING(info->model, "mock");
+    MOCK_STRING(info->serialNumber, "0000000000000001");
+    info->flags = CKF_TOKEN_INITIALIZED | CKF_USER_PIN_INITIALIZED | CKF_RNG;
+    info->ulMaxSessionCount = MOCK_MAX_SESSIONS;
+    info->ulMaxRwSessionCount = MOCK_MAX_SESSIONS;
+    info->ulMaxPinLen = 255;
+    info->ulMinPinLen = 1;
+    info->ulTotalPublicMemory = CK_UNAVAILABLE_INFORMATION;
+    info->ulFreePublicMemory = CK_UNAVAILABLE_INFORMATION;
+    info->ulTotalPrivateMemory = CK_UNAVAILABLE_INFORMATION;
+    info->ulFreePrivateMemory = CK_UNAVAILABLE_INFORMATION;
+
+    return CKR_OK;
+}
+
+static CK_RV mock_GetMechanismList(CK_SLOT_ID slot, CK_MECHANISM_TYPE *list, CK_ULONG *count)
+{
+    MOCK_ENTER();
+    CK_ULONG n = sizeof(mock_mechanisms) / sizeof(mock_mechanisms[0]);
+    if (slot != MOCK_SLOT_ID) {
+        return CKR_SLOT_ID_INVALID;
+    }
+    if (count == NULL) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    if (list != NULL) {
+        if (*count < n) {
+            *count = n;
+            return CKR_BUFFER_TOO_SMALL;
+        }
+        memcpy(list, mock_mechanisms, sizeof(mock_mechanisms));
+    }
+    *count = n;
+
+    return CKR_OK;
+}
+
+static CK_RV mock_GetMechanismInfo(CK_SLOT_ID slot, CK_MECHANISM_TYPE type,
+                                   CK_MECHANISM_INFO *info)
+{
+    MOCK_ENTER();
+    if (slot != MOCK_SLOT_ID) {
+        return CKR_SLOT_ID_INVALID;
+    }
+    if (info == NULL) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    info->ulMinKeySize = 0;
+    info->ulMaxKeySize = 0;
+    info->flags = CKF_ENCRYPT | CKF_DECRYPT | CKF_DIGEST | CKF_SIGN | CKF_VERIFY |
+        CKF_GENERATE;
+
+    return CKR_OK;
+}
+
+static CK_RV mock_InitToken(CK_SLOT_ID slot, CK_UTF8CHAR *pin, CK_ULONG pin_len,
+                            CK_UTF8CHAR *label)
+{
+    MOCK_ENTER();
+    if (slot != MOCK_SLOT_ID) {
+        return CKR_SLOT_ID_INVALID;
+    }
+    if (label == NULL) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    pthread_mutex_lock(&mock_lock);
+    memcpy(mock_label, label, sizeof(mock_label));
+    pthread_mutex_unlock(&mock_lock);
+
+    return CKR_OK;
+}
+
+static CK_RV mock_session_call(CK_SESSION_HANDLE handle)
+{
+    MOCK_ENTER();
+
+    pthread_mutex_lock(&mock_lock);
+    CK_RV rv = mock_session(handle) != NULL ? CKR_OK : CKR_SESSION_HANDLE_INVALID;
+    pthread_mutex_unlock(&mock_lock);
+
+    return rv;
+}
+
+static CK_RV mock_InitPIN(CK_SESSION_HANDLE s, CK_UTF8CHAR *pin, CK_ULONG pin_len)
+{
+    return mock_session_call(s);
+}
+
+static CK_RV mock_SetPIN(CK_SESSION_HANDLE s, CK_UTF8CHAR *old_pin, CK_ULONG old_len,
+                         CK_UTF8CHAR *new_pin, CK_ULONG new_len)
+{
+    return mock_session_call(s);
+}
+
+/* Session management functions */
+
+static CK_RV mock_OpenSession(CK_SLOT_ID slot, CK_FLAGS flags, void *app, CK_NOTIFY notify,
+                              CK_SESSION_HANDLE *session)
+{
+    MOCK_ENTER();
+    if (slot != MOCK_SLOT_ID) {
+        return CKR_SLOT_ID_INVALID;
+    }
+    if (!(flags & CKF_SERIAL_SESSION)) {
+        return CKR_SESSION_PARALLEL_NOT_SUPPORTED;
+    }
+    if (session == NULL) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    CK_RV rv = CKR_SESSION_COUNT;
+    pthread_mutex_lock(&mock_lock);
+    for (CK_ULONG h=1; h<=MOCK_MAX_SESSIONS; h++) {
+        mock_session_t *s = &mock_sessions[h - 1];
+        if (!s->is_open) {
+            memset(s, 0, sizeof(*s));
+            s->is_open = true;
+            s->flags = flags;
+            *session = h;
+            rv = CKR_OK;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mock_lock);
+
+    return rv;
+}
+
+static CK_RV mock_CloseSession(CK_SESSION_HANDLE handle)
+{
+    MOCK_ENTER();
+
+    CK_RV rv = CKR_OK;
+    pthread_mutex_lock(&mock_lock);
+    mock_session_t *s = mock_session(handle);
+    if (s == NULL) {
+        rv = CKR_SESSION_HANDLE_INVALID;
+    } else {
+        mock_close_session(s);
+
+        /* The login ends with the last session of the application */
+        bool any_open = false;
+        for (int i=0; !any_open && i<MOCK_MAX_SESSIONS; i++) {
+            any_open = mock_sessions[i].is_open;
+        }
+        if (!any_open) {
+            mock_logged_in = false;
+        }
+    }
+    pthread_mutex_unlock(&mock_lock);
+
+    return rv;
+}
+
+static CK_RV mock_CloseAllSessions(CK_SLOT_ID slot)
+{
+    MOCK_ENTER();
+    if (slot != MOCK_SLOT_ID) {
+        return CKR_SLOT_ID_INVALID;
+    }
+
+    pthread_mutex_lock(&mock_lock);
+    for (int i=0; i<MOCK_MAX_SESSIONS; i++) {
+        mock_close_session(&mock_sessions[i]);
+    }
+    mock_logged_in = false;
+    pthread_mutex_unlock(&mock_lock);
+
+    return CKR_OK;
+}
+
+static CK_RV mock_GetSessionInfo(CK_SESSION_HANDLE handle, CK_SESSION_INFO *info)
+{
+    MOCK_ENTER();
+    if (info == NULL) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    CK_RV rv = CKR_OK;
+    pthread_mutex_lock(&mock_lock);
+    mock_session_t *s = mock_session(handle);
+    if (s == NULL) {
+        rv = CKR_SESSION_HANDLE_INVALID;
+    } else {
+        bool rw = (s->flags & CKF_RW_SESSION) != 0;
+        info->slotID = MOCK_SLOT_ID;
+        info->flags = s->flags;
+        info->ulDeviceError = 0;
+        if (mock_logged_in) {
+            info->state = rw ? CKS_RW_USER_FUNCTIONS : CKS_RO_USER_FUNCTIONS;
+        } else {
+            info->state = rw ? CKS_RW_PUBLIC_SESSION : CKS_RO_PUBLIC_SESSION;
+        }
+    }
+    pthread_mutex_unlock(&mock_lock);
+
+    return rv;
+}
+
+static CK_RV mock_GetOperationState(CK_SESSION_HANDLE s, CK_BYTE *state, CK_ULONG *state_len)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+static CK_RV mock_SetOperationState(CK_SESSION_HANDLE s, CK_BYTE *state, CK_ULONG state_len,
+                                    CK_OBJECT_HANDLE enc_key, CK_OBJECT_HANDLE auth_key)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+static CK_RV mock_Login(CK_SESSION_HANDLE handle, CK_USER_TYPE user, CK_UTF8CHAR *pin,
+                        CK_ULONG pin_len)
+{
+    MOCK_ENTER();
+
+    CK_RV rv = CKR_OK;
+    pthread_mutex_lock(&mock_lock);
+    if (mock_session(handle) == NULL) {
+        rv = CKR_SESSION_HANDLE_INVALID;
+    } else if (mock_logged_in) {
+        rv = CKR_USER_ALREADY_LOGGED_IN;
+    } else {
+        mock_logged_in = true;
+    }
+    pthread_mutex_unlock(&mock_lock);
+
+    return rv;
+}
+
+static CK_RV mock_Logout(CK_SESSION_HANDLE handle)
+{
+    MOCK_ENTER();
+
+    CK_RV rv = CKR_OK;
+    pthread_mutex_lock(&mock_lock);
+    if (mock_session(handle) == NULL) {
+        rv = CKR_SESSION_HANDLE_INVALID;
+    } else if (!mock_logged_in) {
+        rv = CKR_USER_NOT_LOGGED_IN;
+    } else {
+        mock_logged_in = false;
+    }
+    pthread_mutex_unlock(&mock_lock);
+
+    return rv;
+}
+
+/* Object management functions */
+
+static CK_RV mock_create(CK_SESSION_HANDLE handle, const CK_ATTRIBUTE *tpl, CK_ULONG count,
+                         CK_OBJECT_CLASS class, CK_OBJECT_HANDLE *object)
+{
+    MOCK_ENTER();
+    if (object == NULL || (count && tpl == NULL)) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    CK_RV rv;
+    pthread_mutex_lock(&mock_lock);
+    if (mock_session(handle) == NULL) {
+        rv = CKR_SESSION_HANDLE_INVALID;
+    } else {
+        rv = mock_new_object(tpl, count, class, object);
+    }
+    pthread_mutex_unlock(&mock_lock);
+
+    return rv;
+}
+
+static CK_RV mock_CreateObject(CK_SESSION_HANDLE s, CK_ATTRIBUTE *tpl, CK_ULONG count,
+                               CK_OBJECT_HANDLE *object)
+{
+    return mock_create(s, tpl, count, CKO_DATA, object);
+}
+
+static CK_RV mock_CopyObject(CK_SESSION_HANDLE handle, CK_OBJECT_HANDLE object,
+                             CK_ATTRIBUTE *tpl, CK_ULONG count, CK_OBJECT_HANDLE *new_object)
+{
+    MOCK_ENTER();
+    if (new_object == NULL || (count && tpl == NULL)) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    CK_RV rv;
+    pthread_mutex_lock(&mock_lock);
+    mock_object_t *src = mock_object(object);
+    if (mock_session(handle) == NULL) {
+        rv = CKR_SESSION_HANDLE_INVALID;
+    } else if (src == NULL) {
+        rv = CKR_OBJECT_HANDLE_INVALID;
+    } else {
+        CK_OBJECT_CLASS class = CKO_DATA;
+        CK_OBJECT_HANDLE copy;
+        rv = mock_new_object(src->attrs, src->count, class, &copy);
+        if (rv == CKR_OK) {
+            for (CK_ULONG i=0; rv == CKR_OK && i<count; i++) {
+                rv = mock_set_attr(mock_object(copy), &tpl[i]);
+            }
+            if (rv == CKR_OK) {
+                *new_object = copy;
+            } else {
+                mock_free_object(mock_object(copy));
+            }
+        }
+    }
+    pthread_mutex_unlock(&mock_lock);
+
+    return rv;
+}
+
+static CK_RV mock_DestroyObject(CK_SESSION_HANDLE handle, CK_OBJECT_HANDLE object)
+{
+    MOCK_ENTER();
+
+    CK_RV rv = CKR_OK;
+    pthread_mutex_lock(&mock_lock);
+    mock_object_t *obj = mock_object(object);
+    if (mock_session(handle) == NULL) {
+        rv = CKR_SESSION_HANDLE_INVALID;
+    } else if (obj == NULL) {
+        rv = CKR_OBJECT_HANDLE_INVALID;
+    } else {
+        mock_free_object(obj);
+    }
+    pthread_mutex_unlock(&mock_lock);
+
+    return rv;
+}
+
+static CK_RV mock_GetObjectSize(CK_SESSION_HANDLE handle, CK_OBJECT_HANDLE object,
+                                CK_ULONG *size)
+{
+    MOCK_ENTER();
+    if (size == NULL) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    CK_RV rv = CKR_OK;
+    pthread_mutex_lock(&mock_lock);
+    mock_object_t *obj = mock_object(object);
+    if (mock_session(handle) == NULL) {
+        rv = CKR_SESSION_HANDLE_INVALID;
+    } else if (obj == NULL) {
+        rv = CKR_OBJECT_HANDLE_INVALID;
+    } else {
+        *size = 0;
+        for (CK_ULONG i=0; i<obj->count; i++) {
+            *size += obj->attrs[i].ulValueLen;
+        }
+    }
+    pthread_mutex_unlock(&mock_lock);
+
+    return rv;
+}
+
+static CK_RV mock_GetAttributeValue(CK_SESSION_HANDLE handle, CK_OBJECT_HANDLE object,
+                                    CK_ATTRIBUTE *tpl, CK_ULONG count)
+{
+    MOCK_ENTER();
+    if (count && tpl == NULL) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    CK_RV rv = CKR_OK;
+    pthread_mutex_lock(&mock_lock);
+    mock_object_t *obj = mock_object(object);
+    if (mock_session(handle) == NULL) {
+        rv = CKR_SESSION_HANDLE_INVALID;
+    } else if (obj == NULL) {
+        rv = CKR_OBJECT_HANDLE_INVALID;
+    } else {
+        for (CK_ULONG i=0; i<count; i++) {
+            CK_ATTRIBUTE_PTR attr = mock_find_attr(obj, tpl[i].type);
+            if (attr == NULL) {
+                tpl[i].ulValueLen = CK_UNAVAILABLE_INFORMATION;
+                rv = CKR_ATTRIBUTE_TYPE_INVALID;
+            } else if (tpl[i].pValue == NULL) {
+                tpl[i].ulValueLen = attr->ulValueLen;
+            } else if (tpl[i].ulValueLen < attr->ulValueLen) {
+                tpl[i].ulValueLen = CK_UNAVAILABLE_INFORMATION;
+                rv = CKR_BUFFER_TOO_SMALL;
+            } else {
+                if (attr->ulValueLen) {
+                    memcpy(tpl[i].pValue, attr->pValue, attr->ulValueLen);
+                }
+                tpl[i].ulValueLen = attr->ulValueLen;
+            }
+        }
+    }
+    pthread_mutex_unlock(&mock_lock);
+
+    return rv;
+}
+
+static CK_RV mock_SetAttributeValue(CK_SESSION_HANDLE handle, CK_OBJECT_HANDLE object,
+                                    CK_ATTRIBUTE *tpl, CK_ULONG count)
+{
+    MOCK_ENTER();
+    if (count && tpl == NULL) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    CK_RV rv = CKR_OK;
+    pthread_mutex_lock(&mock_lock);
+    mock_object_t *obj = mock_object(object);
+    if (mock_session(handle) == NULL) {
+        rv = CKR_SESSION_HANDLE_INVALID;
+    } else if (obj == NULL) {
+        rv = CKR_OBJECT_HANDLE_INVALID;
+    } else {
+        for (CK_ULONG i=0; rv == CKR_OK && i<count; i++) {
+            rv = mock_set_attr(obj, &tpl[i]);
+        }
+    }
+    pthread_mutex_unlock(&mock_lock);
+
+    return rv;
+}
+
+static CK_RV mock_FindObjectsInit(CK_SESSION_HANDLE handle, CK_ATTRIBUTE *tpl, CK_ULONG count)
+{
+    MOCK_ENTER();
+    if (count && tpl == NULL) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    CK_RV rv = CKR_OK;
+    pthread_mutex_lock(&mock_lock);
+    mock_session_t *s = mock_session(handle);
+    if (s == NULL) {
+        rv = CKR_SESSION_HANDLE_INVALID;
+    } else if (s->is_finding) {
+        rv = CKR_OPERATION_ACTIVE;
+    } else if (count && (s->find_template = calloc(count, sizeof(CK_ATTRIBUTE))) == NULL) {
+        rv = CKR_HOST_MEMORY;
+    } else {
+        s->is_finding = true;
+        s->find_count = count;
+        for (CK_ULONG i=0; i<count; i++) {
+            s->find_template[i] = tpl[i];
+            s->find_template[i].pValue = NULL;
+            if (tpl[i].ulValueLen) {
+                s->find_template[i].pValue = malloc(tpl[i].ulValueLen);
+                if (s->find_template[i].pValue == NULL) {
+                    mock_end_find(s);
+                    rv = CKR_HOST_MEMORY;
+                    break;
+                }
+                memcpy(s->find_template[i].pValue, tpl[i].pValue, tpl[i].ulValueLen);
+            }
+        }
+    }
+    pthread_mutex_unlock(&mock_lock);
+
+    return rv;
+}
+
+static CK_RV mock_FindObjects(CK_SESSION_HANDLE handle, CK_OBJECT_HANDLE *objects,
+                              CK_ULONG max, CK_ULONG *count)
+{
+    MOCK_ENTER();
+    if (count == NULL || (max && objects == NULL)) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    CK_RV rv = CKR_OK;
+    pthread_mutex_lock(&mock_lock);
+    mock_session_t *s = mock_session(handle);
+    if (s == NULL) {
+        rv = CKR_SESSION_HANDLE_INVALID;
+    } else if (!s->is_finding) {
+        rv = CKR_OPERATION_NOT_INITIALIZED;
+    } else {
+        *count = 0;
+        while (*count < max && s->find_next < MOCK_MAX_OBJECTS) {
+            mock_object_t *obj = &mock_objects[s->find_next++];
+            if (obj->is_used && mock_match(obj, s->find_template, s->find_count)) {
+                objects[(*count)++] = s->find_next;
+            }
+        }
+    }
+    pthread_mutex_unlock(&mock_lock);
+
+    return rv;
+}
+
+static CK_RV mock_FindObjectsFinal(CK_SESSION_HANDLE handle)
+{
+    MOCK_ENTER();
+
+    CK_RV rv = CKR_OK;
+    pthread_mutex_lock(&mock_lock);
+    mock_session_t *s = mock_session(handle);
+    if (s == NULL) {
+        rv = CKR_SESSION_HANDLE_INVALID;
+    } else if (!s->is_finding) {
+        rv = CKR_OPERATION_NOT_INITIALIZED;
+    } else {
+        mock_end_find(s);
+    }
+    pthread_mutex_unlock(&mock_lock);
+
+    return rv;
+}
+
+/* Encryption and decryption functions */
+
+static CK_RV mock_EncryptInit(CK_SESSION_HANDLE s, CK_MECHANISM *mech, CK_OBJECT_HANDLE key)
+{
+    return mock_op_init(s, MOCK_OP_ENCRYPT, mech, key);
+}
+
+static CK_RV mock_Encrypt(CK_SESSION_HANDLE s, CK_BYTE *in, CK_ULONG in_len,
+                          CK_BYTE *out, CK_ULONG *out_len)
+{
+    return mock_crypt_update(s, MOCK_OP_ENCRYPT, in, in_len, out, out_len, true);
+}
+
+static CK_RV mock_EncryptUpdate(CK_SESSION_HANDLE s, CK_BYTE *in, CK_ULONG in_len,
+                                CK_BYTE *out, CK_ULONG *out_len)
+{
+    return mock_crypt_update(s, MOCK_OP_ENCRYPT, in, in_len, out, out_len, false);
+}
+
+static CK_RV mock_EncryptFinal(CK_SESSION_HANDLE s, CK_BYTE *out, CK_ULONG *out_len)
+{
+    return mock_crypt_update(s, MOCK_OP_ENCRYPT, NULL, 0, out, out_len, true);
+}
+
+static CK_RV mock_DecryptInit(CK_SESSION_HANDLE s, CK_MECHANISM *mech, CK_OBJECT_HANDLE key)
+{
+    return mock_op_init(s, MOCK_OP_DECRYPT, mech, key);
+}
+
+static CK_RV mock_Decrypt(CK_SESSION_HANDLE s, CK_BYTE *in, CK_ULONG in_len,
+                          CK_BYTE *out, CK_ULONG *out_len)
+{
+    return mock_crypt_update(s, MOCK_OP_DECRYPT, in, in_len, out, out_len, true);
+}
+
+static CK_RV mock_DecryptUpdate(CK_SESSION_HANDLE s, CK_BYTE *in, CK_ULONG in_len,
+                                CK_BYTE *out, CK_ULONG *out_len)
+{
+    return mock_crypt_update(s, MOCK_OP_DECRYPT, in, in_len, out, out_len, false);
+}
+
+static CK_RV mock_DecryptFinal(CK_SESSION_HANDLE s, CK_BYTE *out, CK_ULONG *out_len)
+{
+    return mock_crypt_update(s, MOCK_OP_DECRYPT, NULL, 0, out, out_len, true);
+}
+
+/* Message digesting functions */
+
+static CK_RV mock_DigestInit(CK_SESSION_HANDLE s, CK_MECHANISM *mech)
+{
+    return mock_op_init(s, MOCK_OP_DIGEST, mech, CK_INVALID_HANDLE);
+}
+
+static CK_RV mock_Digest(CK_SESSION_HANDLE s, CK_BYTE *in, CK_ULONG in_len,
+                         CK_BYTE *out, CK_ULONG *out_len)
+{
+    return mock_hash_finish(s, MOCK_OP_DIGEST, in, in_len, out, out_len);
+}
+
+static CK_RV mock_DigestUpdate(CK_SESSION_HANDLE s, CK_BYTE *in, CK_ULONG in_len)
+{
+    MOCK_ENTER();
+    return mock_hash_part(s, MOCK_OP_DIGEST, in, in_len);
+}
+
+static CK_RV mock_DigestKey(CK_SESSION_HANDLE s, CK_OBJECT_HANDLE key)
+{
+    MOCK_ENTER();
+
+    uint64_t k = mock_mix(key);
+    pthread_mutex_lock(&mock_lock);
+    bool valid = mock_object(key) != NULL;
+    pthread_mutex_unlock(&mock_lock);
+
+    if (!valid) {
+        return CKR_KEY_HANDLE_INVALID;
+    }
+    return mock_hash_part(s, MOCK_OP_DIGEST, (CK_BYTE_PTR)&k, sizeof(k));
+}
+
+static CK_RV mock_DigestFinal(CK_SESSION_HANDLE s, CK_BYTE *out, CK_ULONG *out_len)
+{
+    return mock_hash_finish(s, MOCK_OP_DIGEST, NULL, 0, out, out_len);
+}
+
+/* Signing and MACing functions */
+
+static CK_RV mock_SignInit(CK_SESSION_HANDLE s, CK_MECHANISM *mech, CK_OBJECT_HANDLE key)
+{
+    return mock_op_init(s, MOCK_OP_SIGN, mech, key);
+}
+
+static CK_RV mock_Sign(CK_SESSION_HANDLE s, CK_BYTE *in, CK_ULONG in_len,
+                       CK_BYTE *out, CK_ULONG *out_len)
+{
+    return mock_hash_finish(s, MOCK_OP_SIGN, in, in_len, out, out_len);
+}
+
+static CK_RV mock_SignUpdate(CK_SESSION_HANDLE s, CK_BYTE *in, CK_ULONG in_len)
+{
+    MOCK_ENTER();
+    return mock_hash_part(s, MOCK_OP_SIGN, in, in_len);
+}
+
+static CK_RV mock_SignFinal(CK_SESSION_HANDLE s, CK_BYTE *out, CK_ULONG *out_len)
+{
+    return mock_hash_finish(s, MOCK_OP_SIGN, NULL, 0, out, out_len);
+}
+
+static CK_RV mock_SignRecoverInit(CK_SESSION_HANDLE s, CK_MECHANISM *mech,
+                                  CK_OBJECT_HANDLE key)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+static CK_RV mock_SignRecover(CK_SESSION_HANDLE s, CK_BYTE *in, CK_ULONG in_len,
+                              CK_BYTE *out, CK_ULONG *out_len)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+/* Functions for verifying signatures and MACs */
+
+static CK_RV mock_VerifyInit(CK_SESSION_HANDLE s, CK_MECHANISM *mech, CK_OBJECT_HANDLE key)
+{
+    return mock_op_init(s, MOCK_OP_VERIFY, mech, key);
+}
+
+static CK_RV mock_Verify(CK_SESSION_HANDLE s, CK_BYTE *in, CK_ULONG in_len,
+                         CK_BYTE *sig, CK_ULONG sig_len)
+{
+    return mock_verify_finish(s, in, in_len, sig, sig_len);
+}
+
+static CK_RV mock_VerifyUpdate(CK_SESSION_HANDLE s, CK_BYTE *in, CK_ULONG in_len)
+{
+    MOCK_ENTER();
+    return mock_hash_part(s, MOCK_OP_VERIFY, in, in_len);
+}
+
+static CK_RV mock_VerifyFinal(CK_SESSION_HANDLE s, CK_BYTE *sig, CK_ULONG sig_len)
+{
+    return mock_verify_finish(s, NULL, 0, sig, sig_len);
+}
+
+static CK_RV mock_VerifyRecoverInit(CK_SESSION_HANDLE s, CK_MECHANISM *mech,
+                                    CK_OBJECT_HANDLE key)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+static CK_RV mock_VerifyRecover(CK_SESSION_HANDLE s, CK_BYTE *in, CK_ULONG in_len,
+                                CK_BYTE *out, CK_ULONG *out_len)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+/* Dual-purpose cryptographic functions */
+
+static CK_RV mock_DigestEncryptUpdate(CK_SESSION_HANDLE s, CK_BYTE *in, CK_ULONG in_len,
+                                      CK_BYTE *out, CK_ULONG *out_len)
+{
+    return mock_dual_update(s, MOCK_OP_ENCRYPT, MOCK_OP_DIGEST, false,
+                            in, in_len, out, out_len);
+}
+
+static CK_RV mock_DecryptDigestUpdate(CK_SESSION_HANDLE s, CK_BYTE *in, CK_ULONG in_len,
+                                      CK_BYTE *out, CK_ULONG *out_len)
+{
+    return mock_dual_update(s, MOCK_OP_DECRYPT, MOCK_OP_DIGEST, true,
+                            in, in_len, out, out_len);
+}
+
+static CK_RV mock_SignEncryptUpdate(CK_SESSION_HANDLE s, CK_BYTE *in, CK_ULONG in_len,
+                                    CK_BYTE *out, CK_ULONG *out_len)
+{
+    return mock_dual_update(s, MOCK_OP_ENCRYPT, MOCK_OP_SIGN, false,
+                            in, in_len, out, out_len);
+}
+
+static CK_RV mock_DecryptVerifyUpdate(CK_SESSION_HANDLE s, CK_BYTE *in, CK_ULONG in_len,
+                                      CK_BYTE *out, CK_ULONG *out_len)
+{
+    return mock_dual_update(s, MOCK_OP_DECRYPT, MOCK_OP_VERIFY, true,
+                            in, in_len, out, out_len);
+}
+
+/* Key management functions */
+
+static CK_RV mock_GenerateKey(CK_SESSION_HANDLE s, CK_MECHANISM *mech, CK_ATTRIBUTE *tpl,
+                              CK_ULONG count, CK_OBJECT_HANDLE *key)
+{
+    if (mech == NULL) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    return mock_create(s, tpl, count, CKO_SECRET_KEY, key);
+}
+
+static CK_RV mock_GenerateKeyPair(CK_SESSION_HANDLE s, CK_MECHANISM *mech,
+                                  CK_ATTRIBUTE *pub_tpl, CK_ULONG pub_count,
+                                  CK_ATTRIBUTE *priv_tpl, CK_ULONG priv_count,
+                                  CK_OBJECT_HANDLE *pub_key, CK_OBJECT_HANDLE *priv_key)
+{
+    MOCK_ENTER();
+    if (mech == NULL || pub_key == NULL || priv_key == NULL ||
+        (pub_count && pub_tpl == NULL) || (priv_count && priv_tpl == NULL)) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    CK_RV rv;
+    pthread_mutex_lock(&mock_lock);
+    if (mock_session(s) == NULL) {
+        rv = CKR_SESSION_HANDLE_INVALID;
+    } else {
+        CK_OBJECT_HANDLE pub;
+        rv = mock_new_object(pub_tpl, pub_count, CKO_PUBLIC_KEY, &pub);
+        if (rv == CKR_OK) {
+            rv = mock_new_object(priv_tpl, priv_count, CKO_PRIVATE_KEY, priv_key);
+            if (rv == CKR_OK) {
+                *pub_key = pub;
+            } else {
+                mock_free_object(mock_object(pub));
+            }
+        }
+    }
+    pthread_mutex_unlock(&mock_lock);
+
+    return rv;
+}
+
+static CK_RV mock_WrapKey(CK_SESSION_HANDLE s, CK_MECHANISM *mech,
+                          CK_OBJECT_HANDLE wrapping_key, CK_OBJECT_HANDLE key,
+                          CK_BYTE *out, CK_ULONG *out_len)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+static CK_RV mock_UnwrapKey(CK_SESSION_HANDLE s, CK_MECHANISM *mech,
+                            CK_OBJECT_HANDLE unwrapping_key, CK_BYTE *in, CK_ULONG in_len,
+                            CK_ATTRIBUTE *tpl, CK_ULONG count, CK_OBJECT_HANDLE *key)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+static CK_RV mock_DeriveKey(CK_SESSION_HANDLE s, CK_MECHANISM *mech, CK_OBJECT_HANDLE base_key,
+                            CK_ATTRIBUTE *tpl, CK_ULONG count, CK_OBJECT_HANDLE *key)
+{
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+/* Random number generation functions */
+
+static CK_RV mock_SeedRandom(CK_SESSION_HANDLE s, CK_BYTE *seed, CK_ULONG seed_len)
+{
+    return mock_session_call(s);
+}
+
+static CK_RV mock_GenerateRandom(CK_SESSION_HANDLE s, CK_BYTE *out, CK_ULONG out_len)
+{
+    CK_RV rv = mock_session_call(s);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    if (out_len && out == NULL) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    for (CK_ULONG i=0; i<out_len; i += 8) {
+        uint64_t v = mock_rand();
+        memcpy(out + i, &v, out_len - i < 8 ? out_len - i : 8);
+    }
+    return CKR_OK;
+}
+
+/* Parallel function management functions */
+
+static CK_RV mock_GetFunctionStatus(CK_SESSION_HANDLE s)
+{
+    return CKR_FUNCTION_NOT_PARALLEL;
+}
+
+static CK_RV mock_CancelFunction(CK_SESSION_HANDLE s)
+{
+    return CKR_FUNCTION_NOT_PARALLEL;
+}
+
+static CK_RV mock_WaitForSlotEvent(CK_FLAGS flags, CK_SLOT_ID *slot, void *reserved)
+{
+    MOCK_ENTER();
+    return (flags & CKF_DONT_BLOCK) ? CKR_NO_EVENT : CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+static CK_FUNCTION_LIST mock_function_list = {
+    {2, 40},
+    mock_Initialize,
+    mock_Finalize,
+    mock_GetInfo,
+    C_GetFunctionList,
+    mock_GetSlotList,
+    mock_GetSlotInfo,
+    mock_GetTokenInfo,
+    mock_GetMechanismList,
+    mock_GetMechanismInfo,
+    mock_InitToken,
+    mock_InitPIN,
+    mock_SetPIN,
+    mock_OpenSession,
+    mock_CloseSession,
+    mock_CloseAllSessions,
+    mock_GetSessionInfo,
+    mock_GetOperationState,
+    mock_SetOperationState,
+    mock_Login,
+    mock_Logout,
+    mock_CreateObject,
+    mock_CopyObject,
+    mock_DestroyObject,
+    mock_GetObjectSize,
+    mock_GetAttributeValue,
+    mock_SetAttributeValue,
+    mock_FindObjectsInit,
+    mock_FindObjects,
+    mock_FindObjectsFinal,
+    mock_EncryptInit,
+    mock_Encrypt,
+    mock_EncryptUpdate,
+    mock_EncryptFinal,
+    mock_DecryptInit,
+    mock_Decrypt,
+    mock_DecryptUpdate,
+    mock_DecryptFinal,
+    mock_DigestInit,
+    mock_Digest,
+    mock_DigestUpdate,
+    mock_DigestKey,
+    mock_DigestFinal,
+    mock_SignInit,
+    mock_Sign,
+    mock_SignUpdate,
+    mock_SignFinal,
+    mock_SignRecoverInit,
+    mock_SignRecover,
+    mock_VerifyInit,
+    mock_Verify,
+    mock_VerifyUpdate,
+    mock_VerifyFinal,
+    mock_VerifyRecoverInit,
+    mock_VerifyRecover,
+    mock_DigestEncryptUpdate,
+    mock_DecryptDigestUpdate,
+    mock_SignEncryptUpdate,
+    mock_DecryptVerifyUpdate,
+    mock_GenerateKey,
+    mock_GenerateKeyPair,
+    mock_WrapKey,
+    mock_UnwrapKey,
+    mock_DeriveKey,
+    mock_SeedRandom,
+    mock_GenerateRandom,
+    mock_GetFunctionStatus,
+    mock_CancelFunction,
+    mock_WaitForSlotEvent,
+};
@@ -0,0 +1,523 @@
+/*
+ * Copyright (c) 2024, Janet-pkcs11 Seungki Kim
+ *
+ * Janet-pkcs11 is released under the MIT License, see the LICENSE file.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include "main.h"
+#include "error.h"
+#include "attribute.h"
+#include "output.h"
+#include "object_index.h"
+
+#define ASYNC_DEFAULT_WORKERS 4
+
+/*
+ * Asynchronous PKCS#11 calls
+ *
+ * A job copies its inputs into native memory, is queued to a pool of
+ * worker threads and the calling fiber is suspended. The worker runs the
+ * provider call and posts the job back to the event loop of the calling
+ * thread, where the result is converted to Janet values and the fiber is
+ * resumed.
+ */
+
+typedef enum async_op {
+    ASYNC_ENCRYPT,
+    ASYNC_DECRYPT,
+    ASYNC_DIGEST,
+    ASYNC_SIGN,
+    ASYNC_VERIFY,
+    ASYNC_GENERATE_KEY,
+    ASYNC_GENERATE_KEY_PAIR,
+    ASYNC_GENERATE_RANDOM
+} async_op_t;
+
+typedef struct async_job {
+    struct async_job *next;
+    async_op_t op;
+    const char *desc;
+
+    JanetVM *vm;
+    JanetFiber *fiber;
+
+    session_obj_t *obj;
+    CK_FUNCTION_LIST_PTR func_list;
+    CK_SESSION_HANDLE session;
+
+    /* Inputs */
+    CK_BYTE_PTR data;
+    CK_ULONG data_len;
+    CK_BYTE_PTR sig;
+    CK_ULONG sig_len;
+    CK_MECHANISM mechanism;
+    CK_ATTRIBUTE_PTR template1;
+    CK_ULONG count1;
+    CK_ATTRIBUTE_PTR template2;
+    CK_ULONG count2;
+
+    /* Outputs */
+    CK_RV rv;
+    CK_BYTE_PTR out;
+    CK_ULONG out_len;
+    CK_OBJECT_HANDLE handle1;
+    CK_OBJECT_HANDLE handle2;
+} async_job_t;
+
+typedef struct async_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    async_job_t *head;
+    async_job_t *tail;
+    int workers;
+} async_pool_t;
+
+static async_pool_t async_pool = {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    NULL,
+    NULL,
+    0
+};
+
+static void *copy_bytes(const void *src, size_t len) {
+    void *dst = malloc(len ? len : 1);
+    if (dst == NULL) {
+        janet_panic("Out of memory");
+    }
+
+    if (len) {
+        memcpy(dst, src, len);
+    }
+
+    return dst;
+}
+
+/* Copies a template and all of its values into one native block. */
+static CK_ATTRIBUTE_PTR copy_template(CK_ATTRIBUTE_PTR src, CK_ULONG count) {
+    size_t size = count * sizeof(CK_ATTRIBUTE);
+    for (CK_ULONG i=0; i<count; i++) {
+        size += src[i].ulValueLen;
+    }
+
+    CK_ATTRIBUTE_PTR dst = copy_bytes(src, size);
+    CK_BYTE_PTR value = (CK_BYTE_PTR)(dst + count);
+    for (CK_ULONG i=0; i<count; i++) {
+        memcpy(value, src[i].pValue, src[i].ulValueLen);
+        dst[i].pValue = value;
+        value += src[i].ulValueLen;
+    }
+
+    return dst;
+}
+
+static void free_job(async_job_t *job) {
+    free(job->data);
+    free(job->sig);
+    free(job->mechanism.pParameter);
+    free(job->template1);
+    free(job->template2);
+    free(job->out);
+    free(job);
+}
+
+static async_job_t *new_job(session_obj_t *obj, async_op_t op, const char *desc) {
+    if (!obj->is_threaded) {
+        janet_panic("async functions require a p11-obj created with "
+                    ":os-locking or :custom-locking");
+    }
+
+    async_job_t *job = calloc(1, sizeof(async_job_t));
+    if (job == NULL) {
+        janet_panic("Out of memory");
+    }
+
+    job->op = op;
+    job->desc = desc;
+    job->obj = obj;
+    job->func_list = obj->func_list;
+    job->session = obj->session;
+
+    return job;
+}
+
+/*
+ * `out_len` holds the guess made by p11_output_guess on submit. The length
+ * is only queried if the guess was too small, see output.c.
+ */
+static void run_data_out(async_job_t *job, p11_data_out_fn fn) {
+    CK_ULONG capacity = job->out_len ? job->out_len : 1;
+
+    job->out = malloc(capacity);
+    if (job->out == NULL) {
+        job->rv = CKR_HOST_MEMORY;
+        return;
+    }
+
+    job->out_len = capacity;
+    job->rv = fn(job->session, job->data, job->data_len, job->out, &job->out_len);
+    p11_output_count(job->rv == CKR_BUFFER_TOO_SMALL);
+    if (job->rv != CKR_BUFFER_TOO_SMALL) {
+        return;
+    }
+
+    if (job->out_len <= capacity) {
+        job->out_len = 0;
+        job->rv = fn(job->session, job->data, job->data_len, NULL_PTR, &job->out_len);
+        if (job->rv != CKR_OK) {
+            return;
+        }
+    }
+
+    free(job->out);
+    job->out = malloc(job->out_len ? job->out_len : 1);
+    if (job->out == NULL) {
+        job->rv = CKR_HOST_MEMORY;
+        return;
+    }
+
+    job->rv = fn(job->session, job->data, job->data_len, job->out, &job->out_len);
+}
+
+static p11_output_op_t output_op(async_op_t op) {
+    switch (op) {
+        case ASYNC_ENCRYPT:
+            return P11_OUTPUT_ENCRYPT;
+        case ASYNC_DECRYPT:
+            return P11_OUTPUT_DECRYPT;
+        case ASYNC_DIGEST:
+            return P11_OUTPUT_DIGEST;
+        default:
+            return P11_OUTPUT_SIGN;
+    }
+}
+
+/* Runs on a worker thread. Must not touch any Janet value. */
+static void run_job(async_job_t *job) {
+    CK_FUNCTION_LIST_PTR f = job->func_list;
+
+    switch (job->op) {
+        case ASYNC_ENCRYPT:
+            run_data_out(job, f->C_Encrypt);
+            break;
+        case ASYNC_DECRYPT:
+            run_data_out(job, f->C_Decrypt);
+            break;
+        case ASYNC_DIGEST:
+            run_data_out(job, f->C_Digest);
+            break;
+        case ASYNC_SIGN:
+            run_data_out(job, f->C_Sign);
+            break;
+        case ASYNC_VERIFY:
+            job->rv = f->C_Verify(job->session,
+                                  job->data, job->data_len,
+                                  job->sig, job->sig_len);
+            break;
+        case ASYNC_GENERATE_KEY:
+            job->rv = f->C_GenerateKey(job->session, &job->mechanism,
+                                       job->template1, job->count1,
+                                       &job->handle1);
+            break;
+        case ASYNC_GENERATE_KEY_PAIR:
+            job->rv = f->C_GenerateKeyPair(job->session, &job->mechanism,
+                                           job->template1, job->count1,
+                                           job->template2, job->count2,
+                                           &job->handle1, &job->handle2);
+            break;
+        case ASYNC_GENERATE_RANDOM:
+            job->rv = f->C_GenerateRandom(job->session, job->out, job->out_len);
+            break;
+    }
+}
+
+/* Runs on the event loop of the thread that submitted the job. */
+static void job_done(JanetEVGenericMessage msg) {
+    async_job_t *job = (async_job_t *)msg.argp;
+    JanetFiber *fiber = job->fiber;
+
+    if (janet_fiber_can_resume(fiber)) {
+        if (job->op == ASYNC_VERIFY &&
+            (job->rv == CKR_OK || job->rv == CKR_SIGNATURE_INVALID)) {
+            janet_schedule(fiber, janet_wrap_boolean(job->rv == CKR_OK));
+        } else if (job->rv != CKR_OK) {
+            janet_cancel(fiber, janet_wrap_string(janet_formatc("%s, rv:%s",
+                                                                job->desc,
+                                                                get_pkcs11_error(job->rv))));
+        } else if (job->op == ASYNC_GENERATE_KEY) {
+            p11_index_add(job->obj, job->handle1);
+            janet_schedule(fiber, janet_wrap_number((double)job->handle1));
+        } else if (job->op == ASYNC_GENERATE_KEY_PAIR) {
+            p11_index_add(job->obj, job->handle1);
+            p11_index_add(job->obj, job->handle2);
+            Janet *tup = janet_tuple_begin(2);
+            tup[0] = janet_wrap_number(job->handle1);
+            tup[1] = janet_wrap_number(job->handle2);
+            janet_schedule(fiber, janet_wrap_tuple(janet_tuple_end(tup)));
+        } else {
+            if (job->op != ASYNC_GENERATE_RANDOM) {
+                p11_output_hint_update(job->obj, output_op(job->op), job->out_len);
+            }
+            janet_schedule(fiber, janet_stringv(job->out, job->out_len));
+        }
+    }
+
+    janet_gcunroot(janet_wrap_fiber(fiber));
+    free_job(job);
+}
+
+static void *worker_main(void *arg) {
+    (void)arg;
+
+    for (;;) {
+        pthread_mutex_lock(&async_pool.lock);
+        while (async_pool.head == NULL) {
+            pthread_cond_wait(&async_pool.cond, &async_pool.lock);
+        }
+        async_job_t *job = async_pool.head;
+        async_pool.head = job->next;
+        if (async_pool.head == NULL) {
+            async_pool.tail = NULL;
+        }
+        pthread_mutex_unlock(&async_pool.lock);
+
+        run_job(job);
+
+        JanetEVGenericMessage msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.argp = job;
+        janet_ev_post_event(job->vm, job_done, msg);
+    }
+
+    return NULL;
+}
+
+/* Must be called with the pool lock held. */
+static int grow_pool(int workers) {
+    while (async_pool.workers < workers) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, worker_main, NULL) != 0) {
+            return -1;
+        }
+        pthread_detach(thread);
+        async_pool.workers++;
+    }
+
+    return 0;
+}
+
+/* Queues the job and suspends the current fiber until job_done resumes it. */
+static JANET_NO_RETURN void submit_job(async_job_t *job) {
+    job->vm = janet_local_vm();
+    job->fiber = janet_root_fiber();
+    job->next = NULL;
+
+    pthread_mutex_lock(&async_pool.lock);
+    if (grow_pool(async_pool.workers ? async_pool.workers : ASYNC_DEFAULT_WORKERS)) {
+        pthread_mutex_unlock(&async_pool.lock);
+        free_job(job);
+        janet_panic("Failed to start async worker threads");
+    }
+
+    if (async_pool.tail) {
+        async_pool.tail->next = job;
+    } else {
+        async_pool.head = job;
+    }
+    async_pool.tail = job;
+    pthread_cond_signal(&async_pool.cond);
+    pthread_mutex_unlock(&async_pool.lock);
+
+    /* Keep the event loop alive until the worker posts the result back */
+    janet_gcroot(janet_wrap_fiber(job->fiber));
+    janet_ev_inc_refcount();
+    janet_await();
+}
+
+static Janet data_out_async(int32_t argc, Janet *argv, async_op_t op, const char *desc) {
+    janet_fixarity(argc, 2);
+
+    session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
+    JanetByteView data = janet_getbytes(argv, 1);
+
+    async_job_t *job = new_job(obj, op, desc);
+    job->data = copy_bytes(data.bytes, data.len);
+    job->data_len = (CK_ULONG)data.len;
+    job->out_len = p11_output_guess(obj, output_op(op), job->data_len);
+
+    submit_job(job);
+}
+
+JANET_FN(p11_encrypt_async,
+         "(encrypt-async session-obj data)",
+         "Same as `encrypt`, but the call is run on a worker thread while "
+         "other fibers keep running. Requires a `p11-obj` created with "
+         "locking.")
+{
+    return data_out_async(argc, argv, ASYNC_ENCRYPT, "C_Encrypt");
+}
+
+JANET_FN(p11_decrypt_async,
+         "(decrypt-async session-obj data)",
+         "Same as `decrypt`, but the call is run on a worker thread while "
+         "other fibers keep running. Requires a `p11-obj` created with "
+         "locking.")
+{
+    return data_out_async(argc, argv, ASYNC_DECRYPT, "C_Decrypt");
+}
+
+JANET_FN(p11_digest_async,
+         "(digest-async session-obj data)",
+         "Same as `digest`, but the call is run on a worker thread while "
+         "other fibers keep running. Requires a `p11-obj` created with "
+         "locking.")
+{
+    return data_out_async(argc, argv, ASYNC_DIGEST, "C_Digest");
+}
+
+JANET_FN(p11_sign_async,
+         "(sign-async session-obj data)",
+         "Same as `sign`, but the call is run on a worker thread while "
+         "other fibers keep running. Requires a `p11-obj` created with "
+         "locking.")
+{
+    return data_out_async(argc, argv, ASYNC_SIGN, "C_Sign");
+}
+
+JANET_FN(p11_verify_async,
+         "(verify-async session-obj data signature)",
+         "Same as `verify`, but the call is run on a worker thread while "
+         "other fibers keep running. Requires a `p11-obj` created with "
+         "locking.")
+{
+    janet_fixarity(argc, 3);
+
+    session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
+    JanetByteView data = janet_getbytes(argv, 1);
+    JanetByteView sig = janet_getbytes(argv, 2);
+
+    async_job_t *job = new_job(obj, ASYNC_VERIFY, "C_Verify");
+    job->data = copy_bytes(data.bytes, data.len);
+    job->data_len = (CK_ULONG)data.len;
+    job->sig = copy_bytes(sig.bytes, sig.len);
+    job->sig_len = (CK_ULONG)sig.len;
+
+    submit_job(job);
+}
+
+JANET_FN(p11_generate_key_async,
+         "(generate-key-async session-obj mechanism &opt template)",
+         "Same as `generate-key`, but the call is run on a worker thread while "
+         "other fibers keep running. Requires a `p11-obj` created with "
+         "locking.")
+{
+    janet_arity(argc, 2, 3);
+
+    session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
+    CK_MECHANISM_PTR p_mechanism = janet_get_p11_mechanism(argv, 1);
+
+    CK_ULONG count = 0;
+    CK_ATTRIBUTE_PTR p_template = NULL_PTR;
+    if (argc == 3) {
+        p_template = janet_get_p11_template(argv, 2, &count);
+    }
+
+    async_job_t *job = new_job(obj, ASYNC_GENERATE_KEY, "C_GenerateKey");
+    job->mechanism.mechanism = p_mechanism->mechanism;
+    job->mechanism.pParameter = copy_bytes(p_mechanism->pParameter, p_mechanism->ulParameterLen);
+    job->mechanism.ulParameterLen = p_mechanism->ulParameterLen;
+    job->template1 = copy_template(p_template, count);
+    job->count1 = count;
+
+    submit_job(job);
+}
+
+JANET_FN(p11_generate_key_pair_async,
+         "(generate-key-pair-async session-obj mechanism pubkey-template privkey-template)",
+         "Same as `generate-key-pair`, but the call is run on a worker thread "
+         "while other fibers keep running. Requires a `p11-obj` created with "
+         "locking.")
+{
+    janet_fixarity(argc, 4);
+
+    session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
+
+    CK_MECHANISM_PTR p_mechanism = janet_get_p11_mechanism(argv, 1);
+    CK_ULONG pub_template_count;
+    CK_ULONG priv_template_count;
+    CK_ATTRIBUTE_PTR p_pub_template = janet_get_p11_template(argv, 2, &pub_template_count);
+    CK_ATTRIBUTE_PTR p_priv_template = janet_get_p11_template(argv, 3, &priv_template_count);
+
+    async_job_t *job = new_job(obj, ASYNC_GENERATE_KEY_PAIR, "C_GenerateKeyPair");
+    job->mechanism.mechanism = p_mechanism->mechanism;
+    job->mechanism.pParameter = copy_bytes(p_mechanism->pParameter, p_mechanism->ulParameterLen);
+    job->mechanism.ulParameterLen = p_mechanism->ulParameterLen;
+    job->template1 = copy_template(p_pub_template, pub_template_count);
+    job->count1 = pub_template_count;
+    job->template2 = copy_template(p_priv_template, priv_template_count);
+    job->count2 = priv_template_count;
+
+    submit_job(job);
+}
+
+JANET_FN(p11_generate_random_async,
+         "(generate-random-async session-obj length)",
+         "Same as `generate-random`, but the call is run on a worker thread "
+         "while other fibers keep running. Requires a `p11-obj` created with "
+         "locking.")
+{
+    janet_fixarity(argc, 2);
+
+    session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
+    CK_ULONG length = (CK_ULONG)janet_getnat(argv, 1);
+
+    async_job_t *job = new_job(obj, ASYNC_GENERATE_RANDOM, "C_GenerateRandom");
+    job->out = malloc(length ? length : 1);
+    job->out_len = length;
+    if (job->out == NULL) {
+        free_job(job);
+        janet_panic("Out of memory");
+    }
+
+    submit_job(job);
+}
+
+JANET_FN(cfun_async_workers,
+         "(async-workers &opt count)",
+         "Returns the number of worker threads used by the async functions. "
+         "If `count` is given, the pool is grown to `count` workers first. "
+         "The pool is started with 4 workers on the first async call.")
+{
+    janet_arity(argc, 0, 1);
+
+    int32_t count = argc == 1 ? janet_getnat(argv, 0) : 0;
+
+    pthread_mutex_lock(&async_pool.lock);
+    int rc = grow_pool(count);
+    int workers = async_pool.workers;
+    pthread_mutex_unlock(&async_pool.lock);
+
+    if (rc) {
+        janet_panic("Failed to start async worker threads");
+    }
+
+    return janet_wrap_number(workers);
+}
+
+void submod_async(JanetTable *env) {
+    JanetRegExt cfuns[] = {
+        JANET_REG("encrypt-async", p11_encrypt_async),
+        JANET_REG("decrypt-async", p11_decrypt_async),
+        JANET_REG("digest-async", p11_digest_async),
+        JANET_REG("sign-async", p11_sign_async),
+        JANET_REG("verify-async", p11_verify_async),
+        JANET_REG("generate-key-async", p11_generate_key_async),
+        JANET_REG("generate-key-pair-async", p11_generate_key_pair_async),
+        JANET_REG("generate-random-async", p11_generate_random_async),
+        JANET_REG("async-workers", cfun_async_workers),
+        JANET_REG_END
+    };
+    janet_cfuns_ext(env, "pkcs11", cfuns);
+}
@@ -6,104 +6,140 @@
 
 #include "main.h"
 #include "types.h"
+#include "attribute.h"
 
-static void set_attribute(CK_ATTRIBUTE *attribute, const JanetKV *kv)
+/*
+ * Encodes the value of a template entry. Numbers, keywords and booleans are
+ * written to `scalar`, byte sequences are returned as they are.
+ */
+JanetByteView p11_attribute_value_bytes(Janet val, p11_attr_scalar_t *scalar)
 {
-    Janet key = kv->key;
-    Janet val = kv->value;
+    JanetByteView view;
 
-    CK_ATTRIBUTE_TYPE attr_type = get_type_value(janet_unwrap_keyword(key));
-
-    attribute->type = attr_type;
     JanetType val_type = janet_type(val);
     switch(val_type) {
         case JANET_KEYWORD: {
-            CK_ULONG *value = janet_smalloc(sizeof(CK_ULONG));
-            *value = get_type_value(janet_unwrap_keyword(val));
-
-            attribute->pValue = (void*)value;
-            attribute->ulValueLen = sizeof(CK_ULONG);
+            scalar->ulong_value = get_type_value(janet_unwrap_keyword(val));
+            view.bytes = (const uint8_t *)&scalar->ulong_value;
+            view.len = sizeof(CK_ULONG);
             break;
         }
         case JANET_NUMBER: {
-            CK_ULONG *value = janet_smalloc(sizeof(CK_ULONG));
-            *value = (CK_ULONG)janet_unwrap_number(val);
-
-            attribute->pValue = (void*)value;
-            attribute->ulValueLen = sizeof(CK_ULONG);
+            scalar->ulong_value = (CK_ULONG)janet_unwrap_number(val);
+            view.bytes = (const uint8_t *)&scalar->ulong_value;
+            view.len = sizeof(CK_ULONG);
             break;
         }
         case JANET_BOOLEAN: {
-            CK_BBOOL *value = janet_smalloc(sizeof(CK_BBOOL));
-            *value = (CK_BBOOL)janet_unwrap_boolean(val);
-
-            attribute->pValue = (void*)value;
-            attribute->ulValueLen = sizeof(CK_BBOOL);
+            scalar->bbool_value = (CK_BBOOL)janet_unwrap_boolean(val);
+            view.bytes = (const uint8_t *)&scalar->bbool_value;
+            view.len = sizeof(CK_BBOOL);
             break;
         }
         case JANET_BUFFER:
         case JANET_STRING: {
-            JanetByteView param = janet_getbytes(&val, 0);
-            CK_BYTE_PTR *value = janet_smalloc(param.len);
-            memcpy(value, param.bytes, param.len);
-
-            attribute->pValue = (void*)value;
-            attribute->ulValueLen = param.len;
+            view = janet_getbytes(&val, 0);
             break;
         }
         default:
             janet_panic("Invalid template value type.");
             break;
     }
+
+    return view;
 }
 
-JanetStruct p11_template_to_janet_struct(CK_ATTRIBUTE_PTR p_template, int count)
+static void set_attribute(CK_ATTRIBUTE *attribute, const JanetKV *kv)
 {
-    JanetTable *ret = janet_table(count);
-    for (int i=0; i<count; i++) {
-        p11_attr_type_t attr_type = get_attribute_type(p_template[i].type);
-        switch (attr_type) {
-            case P11_ATTR_BOOL: {
-                bool value = (*((CK_BBOOL*)p_template[i].pValue)) == 0 ? 0 : 1;
-                janet_table_put(ret,
-                                janet_ckeywordv(p11_attr_type_to_string(p_template[i].type)),
-                                janet_wrap_boolean(value));
-                break;
-            }
-            case P11_ATTR_ULONG: {
-                CK_ULONG value = *(CK_ULONG_PTR)p_template[i].pValue;
-                janet_table_put(ret,
-                                janet_ckeywordv(p11_attr_type_to_string(p_template[i].type)),
-                                janet_wrap_number((double)value));
-                break;
+    p11_attr_scalar_t scalar;
+    JanetByteView view = p11_attribute_value_bytes(kv->value, &scalar);
+    CK_BYTE_PTR value = janet_smalloc(view.len);
+    memcpy(value, view.bytes, view.len);
+
+    attribute->type = get_type_value(janet_unwrap_keyword(kv->key));
+    attribute->pValue = (void*)value;
+    attribute->ulValueLen = view.len;
+}
+
+static Janet p11_attribute_to_janet(CK_ATTRIBUTE_PTR attribute)
+{
+    p11_attr_type_t attr_type = get_attribute_type(attribute->type);
+    switch (attr_type) {
+        case P11_ATTR_BOOL: {
+            bool value = (*((CK_BBOOL*)attribute->pValue)) == 0 ? 0 : 1;
+            return janet_wrap_boolean(value);
+        }
+        case P11_ATTR_ULONG: {
+            CK_ULONG value = *(CK_ULONG_PTR)attribute->pValue;
+            return janet_wrap_number((double)value);
+        }
+        case P11_ATTR_DATE: {
+            CK_DATE_PTR p_date = attribute->pValue;
+            if (attribute->ulValueLen != sizeof(CK_DATE)) {
+                /* Empty date */
+                return janet_cstringv("");
             }
-            case P11_ATTR_DATE: {
-                CK_DATE_PTR p_date = p_template[i].pValue;
-                JanetTable *date = janet_table(3);
-                janet_table_put(date, janet_ckeywordv("year"), janet_stringv(p_date->year, 4));
-                janet_table_put(date, janet_ckeywordv("month"), janet_stringv(p_date->month, 2));
-                janet_table_put(date, janet_ckeywordv("day"), janet_stringv(p_date->day, 2));
-
-                janet_table_put(ret,
-                                janet_ckeywordv(p11_attr_type_to_string(p_template[i].type)),
-                                janet_wrap_struct(janet_table_to_struct(date)));
-                break;
+            const JanetKeyword *date_kw = p11_date_keywords();
+            JanetKV *date = janet_struct_begin(3);
+            janet_struct_put(date, janet_wrap_keyword(date_kw[0]), janet_stringv(p_date->year, 4));
+            janet_struct_put(date, janet_wrap_keyword(date_kw[1]), janet_stringv(p_date->month, 2));
+            janet_struct_put(date, janet_wrap_keyword(date_kw[2]), janet_stringv(p_date->day, 2));
+            return janet_wrap_struct(janet_struct_end(date));
+        }
+        case P11_ATTR_BYTES:
+        case P11_ATTR_STRING: {
+            return janet_stringv((const uint8_t *)attribute->pValue, attribute->ulValueLen);
+        }
+        default: {
+            janet_panicf("0x%d Attribute type is not found", attr_type);
+        }
+    }
+}
+
+static Janet attribute_value(CK_ATTRIBUTE_PTR attribute, Janet unavailable)
+{
+    if (attribute->ulValueLen == CK_UNAVAILABLE_INFORMATION) {
+        return unavailable;
+    }
+
+    return p11_attribute_to_janet(attribute);
+}
+
+/*
+ * Converts the attributes of `p_template` into a struct or a table keyed by
+ * the attribute keywords, or into a tuple of the values in template order.
+ * Attributes the token could not return are set to `unavailable`.
+ */
+Janet p11_template_to_janet(CK_ATTRIBUTE_PTR p_template, int count,
+                            p11_result_kind_t kind, Janet unavailable)
+{
+    switch (kind) {
+        case P11_RESULT_TABLE: {
+            JanetTable *table = janet_table(count);
+            for (int i=0; i<count; i++) {
+                janet_table_put(table,
+                                p11_attr_type_keyword(p_template[i].type),
+                                attribute_value(&p_template[i], unavailable));
             }
-            case P11_ATTR_BYTES:
-            case P11_ATTR_STRING: {
-                janet_table_put(ret,
-                                janet_ckeywordv(p11_attr_type_to_string(p_template[i].type)),
-                                janet_stringv((const uint8_t *)p_template[i].pValue, p_template[i].ulValueLen));
-                break;
+            return janet_wrap_table(table);
+        }
+        case P11_RESULT_TUPLE: {
+            Janet *tup = janet_tuple_begin(count);
+            for (int i=0; i<count; i++) {
+                tup[i] = attribute_value(&p_template[i], unavailable);
             }
-            default: {
-                janet_panicf("0x%d Attribute type is not found", attr_type);
+            return janet_wrap_tuple(janet_tuple_end(tup));
+        }
+        default: {
+            JanetKV *st = janet_struct_begin(count);
+            for (int i=0; i<count; i++) {
+                janet_struct_put(st,
+                                 p11_attr_type_keyword(p_template[i].type),
+                                 attribute_value(&p_template[i], unavailable));
             }
+            return janet_wrap_struct(janet_struct_end(st));
         }
-
     }
-
-    return janet_table_to_struct(ret);
 }
 
 CK_ATTRIBUTE_PTR janet_struct_to_p11_template(JanetStruct st)
@@ -142,12 +178,10 @@ CK_ATTRIBUTE_PTR create_new_p11_template_from_janet_tuple(JanetTuple tup)
 
 CK_MECHANISM_PTR janet_struct_to_p11_mechanism(JanetStruct st)
 {
-    int32_t count = janet_struct_length(st);
     int32_t capacity = janet_struct_capacity(st);
-    CK_MECHANISM_PTR p_mechanism = janet_smalloc(count * sizeof(CK_MECHANISM));
-    int index = 0;
+    CK_MECHANISM_PTR p_mechanism = janet_smalloc(sizeof(CK_MECHANISM));
 
-    memset(p_mechanism, 0, count * sizeof(CK_MECHANISM));
+    memset(p_mechanism, 0, sizeof(CK_MECHANISM));
 
     for (int i=0; i<capacity; i++) {
         const JanetKV *kv = st + i;
@@ -168,8 +202,6 @@ CK_MECHANISM_PTR janet_struct_to_p11_mechanism(JanetStruct st)
             p_mechanism->pParameter = value;
             p_mechanism->ulParameterLen = param.len;
         }
-
-        index++;
     }
 
     return p_mechanism;
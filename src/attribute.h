@@ -10,10 +10,26 @@
 #include "janet.h"
 #include "pkcs11_header/pkcs11.h"
 
-JanetStruct p11_template_to_janet_struct(CK_ATTRIBUTE_PTR p_template, int count);
+typedef union p11_attr_scalar {
+    CK_ULONG ulong_value;
+    CK_BBOOL bbool_value;
+} p11_attr_scalar_t;
+
+JanetByteView p11_attribute_value_bytes(Janet val, p11_attr_scalar_t *scalar);
+
+typedef enum p11_result_kind {
+    P11_RESULT_STRUCT,
+    P11_RESULT_TABLE,
+    P11_RESULT_TUPLE
+} p11_result_kind_t;
+
+Janet p11_template_to_janet(CK_ATTRIBUTE_PTR p_template, int count,
+                            p11_result_kind_t kind, Janet unavailable);
 CK_ATTRIBUTE_PTR janet_struct_to_p11_template(JanetStruct st);
 CK_ATTRIBUTE_PTR create_new_p11_template_from_janet_tuple(JanetTuple tup);
+CK_ATTRIBUTE_PTR janet_get_p11_template(const Janet *argv, int32_t n, CK_ULONG *count);
 
 CK_MECHANISM_PTR janet_struct_to_p11_mechanism(JanetStruct st);
+CK_MECHANISM_PTR janet_get_p11_mechanism(const Janet *argv, int32_t n);
 
 #endif /* ATTRIBUTE_H */
@@ -7,6 +7,7 @@
 #include "main.h"
 #include "error.h"
 #include "attribute.h"
+#include "output.h"
 
 JANET_FN(p11_decrypt_init,
          "(decrypt-init session-obj mechanism key-handle)",
@@ -16,101 +17,133 @@ JANET_FN(p11_decrypt_init,
     janet_fixarity(argc, 3);
 
     session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
-    JanetStruct mechanism = janet_getstruct(argv, 1);
     CK_OBJECT_HANDLE key_handle = janet_getnumber(argv, 2);
 
-    CK_MECHANISM_PTR p_mechanism = janet_struct_to_p11_mechanism(mechanism);
+    CK_MECHANISM_PTR p_mechanism = janet_get_p11_mechanism(argv, 1);
 
     CK_RV rv;
     rv = obj->func_list->C_DecryptInit(obj->session, p_mechanism, key_handle);
     PKCS11_ASSERT(rv, "C_DecryptInit");
 
+    p11_output_hint_init(obj, P11_OUTPUT_DECRYPT, p_mechanism->mechanism, key_handle);
+
     return janet_wrap_abstract(obj);
 }
 
 JANET_FN(p11_decrypt,
-         "(decrypt session-obj data)",
+         "(decrypt session-obj data &opt buffer mode)",
          "Decrypts encrypted data in a single part. Returns an decrypted data "
-         "in string, if successful.")
+         "in string, if successful. "
+         "With `buffer`, the output is appended to it, or replaces its "
+         "content if `mode` is `:overwrite`, and `buffer` is returned.")
 {
-    janet_fixarity(argc, 2);
+    janet_arity(argc, 2, 4);
 
     session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
     JanetByteView data = janet_getbytes(argv, 1);
 
-    CK_BYTE_PTR dec_data = NULL_PTR;
-    CK_ULONG dec_data_len = 0;
+    p11_output_t out = p11_output_buffer(argc, argv, 2);
 
     CK_RV rv;
-    rv = obj->func_list->C_Decrypt(obj->session,
-                                   (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len,
-                                   dec_data, &dec_data_len);
+    rv = p11_output_data(obj, P11_OUTPUT_DECRYPT, obj->func_list->C_Decrypt,
+                         (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len, &out);
     PKCS11_ASSERT(rv, "C_Decrypt");
 
-    dec_data = janet_smalloc(dec_data_len);
-    rv = obj->func_list->C_Decrypt(obj->session, (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len,
-                                   dec_data, &dec_data_len);
-    PKCS11_ASSERT(rv, "C_Decrypt");
+    return p11_output_wrap(argc, argv, 2, &out);
+}
+
+JANET_FN(p11_decrypt_once,
+         "(decrypt-once session-obj mechanism key-handle data &opt buffer mode)",
+         "Decrypts single-part data with `key-handle`, running `decrypt-init` and "
+         "`decrypt` in one call. `mechanism` is a struct or a `mechanism-obj`. "
+         "Returns a recovered data in string, if successful. "
+         "With `buffer`, the output is appended to it, or replaces its "
+         "content if `mode` is `:overwrite`, and `buffer` is returned.")
+{
+    janet_arity(argc, 4, 6);
+
+    session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
+
+    return p11_output_once(obj, argc, argv, P11_OUTPUT_DECRYPT,
+                           obj->func_list->C_DecryptInit, "C_DecryptInit",
+                           obj->func_list->C_Decrypt, "C_Decrypt");
+}
+
+JANET_FN(p11_decrypt_batch,
+         "(decrypt-batch session-obj mechanism key-handle payloads &opt parameters)",
+         "Decrypts every payload of `payloads` with `key-handle` in a single "
+         "call, running `decrypt-init` and `decrypt` for each payload. `parameters`, "
+         "if given, holds the mechanism parameter of each payload, e.g. its "
+         "IV, or nil to use the parameter of `mechanism`. Returns a tuple of "
+         "[buffer offsets]. The decrypted payloads are packed into `buffer`, "
+         "payload `i` being the bytes from `(offsets i)` to "
+         "`(offsets (+ i 1))`.")
+{
+    janet_arity(argc, 4, 5);
+
+    session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
 
-    return janet_wrap_string(janet_string(dec_data, dec_data_len));
+    return p11_output_batch(obj, argc, argv, P11_OUTPUT_DECRYPT,
+                            obj->func_list->C_DecryptInit, "C_DecryptInit",
+                            obj->func_list->C_Decrypt, "C_Decrypt");
 }
 
 JANET_FN(p11_decrypt_update,
-         "(decrypt-update session-obj data)",
+         "(decrypt-update session-obj data &opt buffer mode)",
          "Continues a multiple-part decryption operation, processing another "
-         "encrypted `data` part. Return the decrypted data part in string, "
-         "if successful.")
+         "encrypted `data` part. `data` may also be an array or tuple of "
+         "parts, processed in order in one call. Return the decrypted data "
+         "part in string, concatenated for all parts, if successful. "
+         "With `buffer`, the output is appended to it, or replaces its "
+         "content if `mode` is `:overwrite`, and `buffer` is returned.")
 {
-    janet_fixarity(argc, 2);
+    janet_arity(argc, 2, 4);
 
     session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
-    JanetByteView data = janet_getbytes(argv, 1);
+    p11_output_t out = p11_output_buffer(argc, argv, 2);
 
-    CK_BYTE_PTR dec_data = NULL_PTR;
-    CK_ULONG dec_data_len = 0;
+    if (janet_checktypes(argv[1], JANET_TFLAG_INDEXED)) {
+        p11_output_update(obj, P11_OUTPUT_DECRYPT, argv, 1,
+                          obj->func_list->C_DecryptUpdate, "C_DecryptUpdate", &out);
+        return p11_output_wrap(argc, argv, 2, &out);
+    }
 
-    CK_RV rv;
-    rv = obj->func_list->C_DecryptUpdate(obj->session,
-                                         (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len,
-                                         dec_data, &dec_data_len);
-    PKCS11_ASSERT(rv, "C_DecryptUpdate");
+    JanetByteView data = janet_getbytes(argv, 1);
 
-    dec_data = janet_smalloc(dec_data_len);
-    rv = obj->func_list->C_DecryptUpdate(obj->session,
-                                         (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len,
-                                         dec_data, &dec_data_len);
+    CK_RV rv;
+    rv = p11_output_data(obj, P11_OUTPUT_DECRYPT, obj->func_list->C_DecryptUpdate,
+                         (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len, &out);
     PKCS11_ASSERT(rv, "C_DecryptUpdate");
 
-    return janet_wrap_string(janet_string(dec_data, dec_data_len));
+    return p11_output_wrap(argc, argv, 2, &out);
 }
 
 JANET_FN(p11_decrypt_final,
-         "(decrypt-final session-obj)",
+         "(decrypt-final session-obj &opt buffer mode)",
          "Finishes a multiple-part decryption operation. "
-         "Return the last recovered data part in string, if successful.")
+         "Return the last recovered data part in string, if successful. "
+         "With `buffer`, the output is appended to it, or replaces its "
+         "content if `mode` is `:overwrite`, and `buffer` is returned.")
 {
-    janet_fixarity(argc, 1);
+    janet_arity(argc, 1, 3);
 
     session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
 
-    CK_BYTE_PTR dec_data = NULL_PTR;
-    CK_ULONG dec_data_len = 0;
+    p11_output_t out = p11_output_buffer(argc, argv, 1);
 
     CK_RV rv;
-    rv = obj->func_list->C_DecryptFinal(obj->session, dec_data, &dec_data_len);
-    PKCS11_ASSERT(rv, "C_DecryptFinal");
-
-    dec_data = janet_smalloc(dec_data_len);
-    rv = obj->func_list->C_DecryptFinal(obj->session, dec_data, &dec_data_len);
+    rv = p11_output_final(obj, P11_OUTPUT_DECRYPT, obj->func_list->C_DecryptFinal, &out);
     PKCS11_ASSERT(rv, "C_DecryptFinal");
 
-    return janet_wrap_string(janet_string(dec_data, dec_data_len));
+    return p11_output_wrap(argc, argv, 1, &out);
 }
 
 void submod_decrypt(JanetTable *env) {
     JanetRegExt cfuns[] = {
         JANET_REG("decrypt-init", p11_decrypt_init),
         JANET_REG("decrypt", p11_decrypt),
+        JANET_REG("decrypt-once", p11_decrypt_once),
+        JANET_REG("decrypt-batch", p11_decrypt_batch),
         JANET_REG("decrypt-update", p11_decrypt_update),
         JANET_REG("decrypt-final", p11_decrypt_final),
         JANET_REG_END
@@ -7,6 +7,8 @@
 #include "main.h"
 #include "error.h"
 #include "attribute.h"
+#include "output.h"
+#include "mapped_file.h"
 
 JANET_FN(p11_digest_init,
          "(digest-init session-obj mechanism)",
@@ -16,52 +18,119 @@ JANET_FN(p11_digest_init,
     janet_fixarity(argc, 2);
 
     session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
-    JanetStruct mechanism = janet_getstruct(argv, 1);
 
-    CK_MECHANISM_PTR p_mechanism = janet_struct_to_p11_mechanism(mechanism);
+    CK_MECHANISM_PTR p_mechanism = janet_get_p11_mechanism(argv, 1);
 
     CK_RV rv;
     rv = obj->func_list->C_DigestInit(obj->session, p_mechanism);
     PKCS11_ASSERT(rv, "C_DigestInit");
 
+    p11_output_hint_init(obj, P11_OUTPUT_DIGEST, p_mechanism->mechanism, CK_INVALID_HANDLE);
+
     return janet_wrap_abstract(obj);
 }
 
 JANET_FN(p11_digest,
-         "(digest session-obj data)",
+         "(digest session-obj data &opt buffer mode)",
          "Digests data in a single part. Returns an message digest in string, "
-         "if successful.")
+         "if successful. "
+         "With `buffer`, the output is appended to it, or replaces its "
+         "content if `mode` is `:overwrite`, and `buffer` is returned.")
 {
-    janet_fixarity(argc, 2);
+    janet_arity(argc, 2, 4);
 
     session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
     JanetByteView data = janet_getbytes(argv, 1);
 
-    CK_BYTE_PTR digest_data = NULL_PTR;
-    CK_ULONG digest_data_len = 0;
+    p11_output_t out = p11_output_buffer(argc, argv, 2);
 
     CK_RV rv;
-    rv = obj->func_list->C_Digest(obj->session,
-                                  (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len,
-                                  digest_data, &digest_data_len);
+    rv = p11_output_data(obj, P11_OUTPUT_DIGEST, obj->func_list->C_Digest,
+                         (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len, &out);
     PKCS11_ASSERT(rv, "C_Digest");
 
-    digest_data = janet_smalloc(digest_data_len);
-    rv = obj->func_list->C_Digest(obj->session, (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len,
-                                  digest_data, &digest_data_len);
+    return p11_output_wrap(argc, argv, 2, &out);
+}
+
+JANET_FN(p11_digest_once,
+         "(digest-once session-obj mechanism data &opt buffer mode)",
+         "Digests single-part data, running `digest-init` and `digest` in "
+         "one call. `mechanism` is a struct or a `mechanism-obj`. Returns the "
+         "message digest in string, if successful. "
+         "With `buffer`, the output is appended to it, or replaces its "
+         "content if `mode` is `:overwrite`, and `buffer` is returned.")
+{
+    janet_arity(argc, 3, 5);
+
+    session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
+    CK_MECHANISM_PTR p_mechanism = janet_get_p11_mechanism(argv, 1);
+    JanetByteView data = janet_getbytes(argv, 2);
+    p11_output_t out = p11_output_buffer(argc, argv, 3);
+
+    CK_RV rv;
+    rv = obj->func_list->C_DigestInit(obj->session, p_mechanism);
+    PKCS11_ASSERT(rv, "C_DigestInit");
+
+    p11_output_hint_init(obj, P11_OUTPUT_DIGEST, p_mechanism->mechanism, CK_INVALID_HANDLE);
+
+    rv = p11_output_data(obj, P11_OUTPUT_DIGEST, obj->func_list->C_Digest,
+                         (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len, &out);
     PKCS11_ASSERT(rv, "C_Digest");
 
-    return janet_wrap_string(janet_string(digest_data, digest_data_len));
+    return p11_output_wrap(argc, argv, 3, &out);
+}
+
+JANET_FN(p11_digest_file,
+         "(digest-file session-obj mechanism path)",
+         "Digests the file at `path` with `mechanism`. The file is mapped into "
+         "memory and fed to `C_DigestUpdate` in large chunks, without being "
+         "read into Janet buffers. Returns the message digest in string, if "
+         "successful.")
+{
+    janet_fixarity(argc, 3);
+
+    session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
+    CK_MECHANISM_PTR p_mechanism = janet_get_p11_mechanism(argv, 1);
+
+    mapped_file_t file;
+    p11_mapped_file_open(&file, argv, 2);
+
+    const char *desc = "C_DigestInit";
+    CK_RV rv;
+    rv = obj->func_list->C_DigestInit(obj->session, p_mechanism);
+    if (rv == CKR_OK) {
+        desc = "C_DigestUpdate";
+        rv = p11_mapped_file_feed(&file, obj->session, obj->func_list->C_DigestUpdate);
+    }
+    p11_mapped_file_close(&file);
+    PKCS11_ASSERT(rv, desc);
+
+    p11_output_hint_init(obj, P11_OUTPUT_DIGEST, p_mechanism->mechanism, CK_INVALID_HANDLE);
+
+    p11_output_t out = {janet_buffer(0), 0};
+
+    rv = p11_output_final(obj, P11_OUTPUT_DIGEST, obj->func_list->C_DigestFinal, &out);
+    PKCS11_ASSERT(rv, "C_DigestFinal");
+
+    return janet_stringv(out.buffer->data, out.count);
 }
 
 JANET_FN(p11_digest_update,
          "(digest-update session-obj data)",
          "Continues a multiple-part message-digesting operation, processing "
-         "another `data` part. Returns a `session-obj`, if successful.")
+         "another `data` part. `data` may also be an array or tuple of parts, "
+         "e.g. `[header body trailer]`, processed in order in one call. "
+         "Returns a `session-obj`, if successful.")
 {
     janet_fixarity(argc, 2);
 
     session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
+
+    if (janet_checktypes(argv[1], JANET_TFLAG_INDEXED)) {
+        p11_update_data(obj, argv, 1, obj->func_list->C_DigestUpdate, "C_DigestUpdate");
+        return janet_wrap_abstract(obj);
+    }
+
     JanetByteView data = janet_getbytes(argv, 1);
 
     CK_RV rv;
@@ -90,32 +159,31 @@ JANET_FN(p11_digest_key,
 }
 
 JANET_FN(p11_digest_final,
-         "(digest-final session-obj)",
+         "(digest-final session-obj &opt buffer mode)",
          "Finishes a multiple-part message-digesting operation. "
-         "Return the message digest in string, if successful.")
+         "Return the message digest in string, if successful. "
+         "With `buffer`, the output is appended to it, or replaces its "
+         "content if `mode` is `:overwrite`, and `buffer` is returned.")
 {
-    janet_fixarity(argc, 1);
+    janet_arity(argc, 1, 3);
 
     session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
 
-    CK_BYTE_PTR digest_data = NULL_PTR;
-    CK_ULONG digest_data_len = 0;
+    p11_output_t out = p11_output_buffer(argc, argv, 1);
 
     CK_RV rv;
-    rv = obj->func_list->C_DigestFinal(obj->session, digest_data, &digest_data_len);
-    PKCS11_ASSERT(rv, "C_DigestFinal");
-
-    digest_data = janet_smalloc(digest_data_len);
-    rv = obj->func_list->C_DigestFinal(obj->session, digest_data, &digest_data_len);
+    rv = p11_output_final(obj, P11_OUTPUT_DIGEST, obj->func_list->C_DigestFinal, &out);
     PKCS11_ASSERT(rv, "C_DigestFinal");
 
-    return janet_wrap_string(janet_string(digest_data, digest_data_len));
+    return p11_output_wrap(argc, argv, 1, &out);
 }
 
 void submod_digest(JanetTable *env) {
     JanetRegExt cfuns[] = {
         JANET_REG("digest-init", p11_digest_init),
         JANET_REG("digest", p11_digest),
+        JANET_REG("digest-once", p11_digest_once),
+        JANET_REG("digest-file", p11_digest_file),
         JANET_REG("digest-update", p11_digest_update),
         JANET_REG("digest-key", p11_digest_key),
         JANET_REG("digest-final", p11_digest_final),
@@ -7,120 +7,97 @@
 #include "main.h"
 #include "error.h"
 #include "attribute.h"
+#include "output.h"
 
 JANET_FN(p11_digest_encrypt_update,
-         "(digest-encrypt-update session-obj data)",
+         "(digest-encrypt-update session-obj data &opt buffer mode)",
          "Continues multiple-part digest and encryption operations, processing "
-         "another data part. Returns an encrypted data in string, if successful.")
+         "another data part. Returns an encrypted data in string, if successful. "
+         "With `buffer`, the output is appended to it, or replaces its "
+         "content if `mode` is `:overwrite`, and `buffer` is returned.")
 {
-    janet_fixarity(argc, 2);
+    janet_arity(argc, 2, 4);
 
     session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
     JanetByteView data = janet_getbytes(argv, 1);
 
-    CK_BYTE_PTR enc_data = NULL_PTR;
-    CK_ULONG enc_data_len = 0;
+    p11_output_t out = p11_output_buffer(argc, argv, 2);
 
     CK_RV rv;
-    rv = obj->func_list->C_DigestEncryptUpdate(obj->session,
-                                               (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len,
-                                               enc_data, &enc_data_len);
+    rv = p11_output_data(obj, P11_OUTPUT_ENCRYPT, obj->func_list->C_DigestEncryptUpdate,
+                         (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len, &out);
     PKCS11_ASSERT(rv, "C_DigestEncryptUpdate");
 
-    enc_data = janet_smalloc(enc_data_len);
-    rv = obj->func_list->C_DigestEncryptUpdate(obj->session,
-                                               (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len,
-                                               enc_data, &enc_data_len);
-    PKCS11_ASSERT(rv, "C_DigestEncryptUpdate");
-
-    return janet_wrap_string(janet_string(enc_data, enc_data_len));
+    return p11_output_wrap(argc, argv, 2, &out);
 }
 
 JANET_FN(p11_decrypt_digest_update,
-         "(decrypt-digest-update session-obj data)",
+         "(decrypt-digest-update session-obj data &opt buffer mode)",
          "continues a multiple-part combined decryption and digest operation, "
          "processing another data part. Returns a recovered data in string, if "
-         "successful.")
+         "successful. "
+         "With `buffer`, the output is appended to it, or replaces its "
+         "content if `mode` is `:overwrite`, and `buffer` is returned.")
 {
-    janet_fixarity(argc, 2);
+    janet_arity(argc, 2, 4);
 
     session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
     JanetByteView data = janet_getbytes(argv, 1);
 
-    CK_BYTE_PTR dec_data = NULL_PTR;
-    CK_ULONG dec_data_len = 0;
+    p11_output_t out = p11_output_buffer(argc, argv, 2);
 
     CK_RV rv;
-    rv = obj->func_list->C_DecryptDigestUpdate(obj->session,
-                                               (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len,
-                                               dec_data, &dec_data_len);
-    PKCS11_ASSERT(rv, "C_DecryptDigestUpdate");
-
-    dec_data = janet_smalloc(dec_data_len);
-    rv = obj->func_list->C_DecryptDigestUpdate(obj->session,
-                                               (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len,
-                                               dec_data, &dec_data_len);
+    rv = p11_output_data(obj, P11_OUTPUT_DECRYPT, obj->func_list->C_DecryptDigestUpdate,
+                         (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len, &out);
     PKCS11_ASSERT(rv, "C_DecryptDigestUpdate");
 
-    return janet_wrap_string(janet_string(dec_data, dec_data_len));
+    return p11_output_wrap(argc, argv, 2, &out);
 }
 
 JANET_FN(p11_sign_encrypt_update,
-         "(sign-encrypt-update session-obj data)",
+         "(sign-encrypt-update session-obj data &opt buffer mode)",
          "Continues multiple-part combined signature and encryption operations, "
          "processing another data part. Returns an encrypted data in string, "
-         "if successful.")
+         "if successful. "
+         "With `buffer`, the output is appended to it, or replaces its "
+         "content if `mode` is `:overwrite`, and `buffer` is returned.")
 {
-    janet_fixarity(argc, 2);
+    janet_arity(argc, 2, 4);
 
     session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
     JanetByteView data = janet_getbytes(argv, 1);
 
-    CK_BYTE_PTR enc_data = NULL_PTR;
-    CK_ULONG enc_data_len = 0;
+    p11_output_t out = p11_output_buffer(argc, argv, 2);
 
     CK_RV rv;
-    rv = obj->func_list->C_SignEncryptUpdate(obj->session,
-                                             (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len,
-                                             enc_data, &enc_data_len);
+    rv = p11_output_data(obj, P11_OUTPUT_ENCRYPT, obj->func_list->C_SignEncryptUpdate,
+                         (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len, &out);
     PKCS11_ASSERT(rv, "C_SignEncryptUpdate");
 
-    enc_data = janet_smalloc(enc_data_len);
-    rv = obj->func_list->C_SignEncryptUpdate(obj->session,
-                                             (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len,
-                                             enc_data, &enc_data_len);
-    PKCS11_ASSERT(rv, "C_SignEncryptUpdate");
-
-    return janet_wrap_string(janet_string(enc_data, enc_data_len));
+    return p11_output_wrap(argc, argv, 2, &out);
 }
 
 JANET_FN(p11_decrypt_verify_update,
-         "(decrypt-verify-update session-obj data)",
+         "(decrypt-verify-update session-obj data &opt buffer mode)",
          "continues a multiple-part combined decryption and verification "
          "operation, processing another data part. Returns a recovered data "
-         "in string, if successful.")
+         "in string, if successful. "
+         "With `buffer`, the output is appended to it, or replaces its "
+         "content if `mode` is `:overwrite`, and `buffer` is returned.")
 {
-    janet_fixarity(argc, 2);
+    janet_arity(argc, 2, 4);
 
     session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
     JanetByteView data = janet_getbytes(argv, 1);
 
-    CK_BYTE_PTR dec_data = NULL_PTR;
-    CK_ULONG dec_data_len = 0;
+    p11_output_t out = p11_output_buffer(argc, argv, 2);
 
     CK_RV rv;
-    rv = obj->func_list->C_DecryptVerifyUpdate(obj->session,
-                                               (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len,
-                                               dec_data, &dec_data_len);
-    PKCS11_ASSERT(rv, "C_DecryptVerifyUpdate");
-
-    dec_data = janet_smalloc(dec_data_len);
-    rv = obj->func_list->C_DecryptVerifyUpdate(obj->session,
-                                               (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len,
-                                               dec_data, &dec_data_len);
+    rv = p11_output_data(obj, P11_OUTPUT_DECRYPT, obj->func_list->C_DecryptVerifyUpdate,
+                         (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len, &out);
     PKCS11_ASSERT(rv, "C_DecryptVerifyUpdate");
 
-    return janet_wrap_string(janet_string(dec_data, dec_data_len));
+    return p11_output_wrap(argc, argv, 2, &out);
 }
 
 void submod_dual(JanetTable *env) {
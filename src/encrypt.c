@@ -7,6 +7,7 @@
 #include "main.h"
 #include "error.h"
 #include "attribute.h"
+#include "output.h"
 
 JANET_FN(p11_encrypt_init,
          "(encrypt-init session-obj mechanism key-handle)",
@@ -16,101 +17,133 @@ JANET_FN(p11_encrypt_init,
     janet_fixarity(argc, 3);
 
     session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
-    JanetStruct mechanism = janet_getstruct(argv, 1);
     CK_OBJECT_HANDLE key_handle = janet_getnumber(argv, 2);
 
-    CK_MECHANISM_PTR p_mechanism = janet_struct_to_p11_mechanism(mechanism);
+    CK_MECHANISM_PTR p_mechanism = janet_get_p11_mechanism(argv, 1);
 
     CK_RV rv;
     rv = obj->func_list->C_EncryptInit(obj->session, p_mechanism, key_handle);
     PKCS11_ASSERT(rv, "C_EncryptInit");
 
+    p11_output_hint_init(obj, P11_OUTPUT_ENCRYPT, p_mechanism->mechanism, key_handle);
+
     return janet_wrap_abstract(obj);
 }
 
 JANET_FN(p11_encrypt,
-         "(encrypt session-obj data)",
+         "(encrypt session-obj data &opt buffer mode)",
          "Encrypts single-part data. Returns an encrypted data in string, "
-         "if successful.")
+         "if successful. "
+         "With `buffer`, the output is appended to it, or replaces its "
+         "content if `mode` is `:overwrite`, and `buffer` is returned.")
 {
-    janet_fixarity(argc, 2);
+    janet_arity(argc, 2, 4);
 
     session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
     JanetByteView data = janet_getbytes(argv, 1);
 
-    CK_BYTE_PTR enc_data = NULL_PTR;
-    CK_ULONG enc_data_len = 0;
+    p11_output_t out = p11_output_buffer(argc, argv, 2);
 
     CK_RV rv;
-    rv = obj->func_list->C_Encrypt(obj->session,
-                                   (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len,
-                                   enc_data, &enc_data_len);
+    rv = p11_output_data(obj, P11_OUTPUT_ENCRYPT, obj->func_list->C_Encrypt,
+                         (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len, &out);
     PKCS11_ASSERT(rv, "C_Encrypt");
 
-    enc_data = janet_smalloc(enc_data_len);
-    rv = obj->func_list->C_Encrypt(obj->session,
-                                   (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len,
-                                   enc_data, &enc_data_len);
-    PKCS11_ASSERT(rv, "C_Encrypt");
+    return p11_output_wrap(argc, argv, 2, &out);
+}
+
+JANET_FN(p11_encrypt_once,
+         "(encrypt-once session-obj mechanism key-handle data &opt buffer mode)",
+         "Encrypts single-part data with `key-handle`, running `encrypt-init` and "
+         "`encrypt` in one call. `mechanism` is a struct or a `mechanism-obj`. "
+         "Returns an encrypted data in string, if successful. "
+         "With `buffer`, the output is appended to it, or replaces its "
+         "content if `mode` is `:overwrite`, and `buffer` is returned.")
+{
+    janet_arity(argc, 4, 6);
+
+    session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
+
+    return p11_output_once(obj, argc, argv, P11_OUTPUT_ENCRYPT,
+                           obj->func_list->C_EncryptInit, "C_EncryptInit",
+                           obj->func_list->C_Encrypt, "C_Encrypt");
+}
+
+JANET_FN(p11_encrypt_batch,
+         "(encrypt-batch session-obj mechanism key-handle payloads &opt parameters)",
+         "Encrypts every payload of `payloads` with `key-handle` in a single "
+         "call, running `encrypt-init` and `encrypt` for each payload. `parameters`, "
+         "if given, holds the mechanism parameter of each payload, e.g. its "
+         "IV, or nil to use the parameter of `mechanism`. Returns a tuple of "
+         "[buffer offsets]. The encrypted payloads are packed into `buffer`, "
+         "payload `i` being the bytes from `(offsets i)` to "
+         "`(offsets (+ i 1))`.")
+{
+    janet_arity(argc, 4, 5);
+
+    session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
 
-    return janet_wrap_string(janet_string(enc_data, enc_data_len));
+    return p11_output_batch(obj, argc, argv, P11_OUTPUT_ENCRYPT,
+                            obj->func_list->C_EncryptInit, "C_EncryptInit",
+                            obj->func_list->C_Encrypt, "C_Encrypt");
 }
 
 JANET_FN(p11_encrypt_update,
-         "(encrypt-update session-obj data)",
+         "(encrypt-update session-obj data &opt buffer mode)",
          "Continues a multiple-part encryption operation, processing another "
-         "`data` part. Return the encrypted data part in string, if successful.")
+         "`data` part. `data` may also be an array or tuple of parts, "
+         "processed in order in one call. Return the encrypted data part in "
+         "string, concatenated for all parts, if successful. "
+         "With `buffer`, the output is appended to it, or replaces its "
+         "content if `mode` is `:overwrite`, and `buffer` is returned.")
 {
-    janet_fixarity(argc, 2);
+    janet_arity(argc, 2, 4);
 
     session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
-    JanetByteView data = janet_getbytes(argv, 1);
+    p11_output_t out = p11_output_buffer(argc, argv, 2);
 
-    CK_BYTE_PTR enc_data = NULL_PTR;
-    CK_ULONG enc_data_len = 0;
+    if (janet_checktypes(argv[1], JANET_TFLAG_INDEXED)) {
+        p11_output_update(obj, P11_OUTPUT_ENCRYPT, argv, 1,
+                          obj->func_list->C_EncryptUpdate, "C_EncryptUpdate", &out);
+        return p11_output_wrap(argc, argv, 2, &out);
+    }
 
-    CK_RV rv;
-    rv = obj->func_list->C_EncryptUpdate(obj->session,
-                                         (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len,
-                                         enc_data, &enc_data_len);
-    PKCS11_ASSERT(rv, "C_EncryptUpdate");
+    JanetByteView data = janet_getbytes(argv, 1);
 
-    enc_data = janet_smalloc(enc_data_len);
-    rv = obj->func_list->C_EncryptUpdate(obj->session,
-                                         (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len,
-                                         enc_data, &enc_data_len);
+    CK_RV rv;
+    rv = p11_output_data(obj, P11_OUTPUT_ENCRYPT, obj->func_list->C_EncryptUpdate,
+                         (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len, &out);
     PKCS11_ASSERT(rv, "C_EncryptUpdate");
 
-    return janet_wrap_string(janet_string(enc_data, enc_data_len));
+    return p11_output_wrap(argc, argv, 2, &out);
 }
 
 JANET_FN(p11_encrypt_final,
-         "(encrypt-final session-obj)",
+         "(encrypt-final session-obj &opt buffer mode)",
          "Finishes a multiple-part encryption operation. "
-         "Return the last encrypted data part in string, if successful.")
+         "Return the last encrypted data part in string, if successful. "
+         "With `buffer`, the output is appended to it, or replaces its "
+         "content if `mode` is `:overwrite`, and `buffer` is returned.")
 {
-    janet_fixarity(argc, 1);
+    janet_arity(argc, 1, 3);
 
     session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
 
-    CK_BYTE_PTR enc_data = NULL_PTR;
-    CK_ULONG enc_data_len = 0;
+    p11_output_t out = p11_output_buffer(argc, argv, 1);
 
     CK_RV rv;
-    rv = obj->func_list->C_EncryptFinal(obj->session, enc_data, &enc_data_len);
-    PKCS11_ASSERT(rv, "C_EncryptFinal");
-
-    enc_data = janet_smalloc(enc_data_len);
-    rv = obj->func_list->C_EncryptFinal(obj->session, enc_data, &enc_data_len);
+    rv = p11_output_final(obj, P11_OUTPUT_ENCRYPT, obj->func_list->C_EncryptFinal, &out);
     PKCS11_ASSERT(rv, "C_EncryptFinal");
 
-    return janet_wrap_string(janet_string(enc_data, enc_data_len));
+    return p11_output_wrap(argc, argv, 1, &out);
 }
 
 void submod_encrypt(JanetTable *env) {
     JanetRegExt cfuns[] = {
         JANET_REG("encrypt-init", p11_encrypt_init),
         JANET_REG("encrypt", p11_encrypt),
+        JANET_REG("encrypt-once", p11_encrypt_once),
+        JANET_REG("encrypt-batch", p11_encrypt_batch),
         JANET_REG("encrypt-update", p11_encrypt_update),
         JANET_REG("encrypt-final", p11_encrypt_final),
         JANET_REG_END
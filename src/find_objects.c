@@ -0,0 +1,241 @@
+/*
+ * Copyright (c) 2024, Janet-pkcs11 Seungki Kim
+ *
+ * Janet-pkcs11 is released under the MIT License, see the LICENSE file.
+ */
+
+#include "main.h"
+#include "error.h"
+#include "attribute.h"
+
+/*
+ * A find-objects sequence drives C_FindObjectsInit, C_FindObjects and
+ * C_FindObjectsFinal for the caller. Handles are fetched in batches into one
+ * buffer held by the abstract, starting with FIND_BATCH_MIN handles and
+ * doubling up to FIND_BATCH_MAX, so scanning any number of objects uses
+ * constant memory. Only the current batch is kept, the sequence can be
+ * iterated once.
+ */
+#define FIND_BATCH_MIN 16
+#define FIND_BATCH_MAX 1024
+
+typedef struct find_objects_obj {
+    Janet session;
+    CK_SESSION_HANDLE handle;
+    CK_FUNCTION_LIST_PTR func_list;
+    bool is_search_active;
+    CK_ULONG batch_size;
+    CK_ULONG start;     /* index of handles[0] in the sequence */
+    CK_ULONG count;     /* handles in the current batch */
+    CK_OBJECT_HANDLE handles[FIND_BATCH_MAX];
+} find_objects_obj_t;
+
+/* Abstract Object functions */
+static int find_objects_gc_fn(void *data, size_t len);
+static int find_objects_gcmark_fn(void *data, size_t len);
+static int find_objects_get_fn(void *data, Janet key, Janet *out);
+static Janet find_objects_next_fn(void *data, Janet key);
+
+static JanetAbstractType find_objects_obj_type = {
+    "find-objects-seq",
+    find_objects_gc_fn,
+    find_objects_gcmark_fn,
+    find_objects_get_fn,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    find_objects_next_fn,
+    JANET_ATEND_NEXT
+};
+
+static JanetMethod find_objects_methods[] = {
+    {"close", p11_find_objects_seq_close},
+    {NULL, NULL},
+};
+
+static CK_RV find_objects_final(find_objects_obj_t *obj) {
+    if (!obj->is_search_active) {
+        return CKR_OK;
+    }
+
+    obj->is_search_active = false;
+
+    /*
+     * Closing the session ended the search, and the provider may have given
+     * its handle to a new session since.
+     */
+    session_obj_t *session = janet_unwrap_abstract(obj->session);
+    if (!session->is_session_open) {
+        return CKR_OK;
+    }
+
+    return obj->func_list->C_FindObjectsFinal(obj->handle);
+}
+
+/* Replaces the current batch with the next handles of the search */
+static void find_objects_fetch(find_objects_obj_t *obj) {
+    CK_ULONG requested = obj->batch_size;
+    CK_ULONG count = 0;
+
+    obj->start += obj->count;
+    obj->count = 0;
+
+    CK_RV rv;
+    rv = obj->func_list->C_FindObjects(obj->handle, obj->handles, requested, &count);
+    if (rv != CKR_OK) {
+        find_objects_final(obj);
+        PKCS11_ASSERT(rv, "C_FindObjects");
+    }
+
+    obj->count = count;
+
+    if (count < requested) {
+        /* The search is over, release the operation right away */
+        rv = find_objects_final(obj);
+        PKCS11_ASSERT(rv, "C_FindObjectsFinal");
+    } else if (obj->batch_size < FIND_BATCH_MAX) {
+        obj->batch_size *= 2;
+    }
+}
+
+static int find_objects_gc_fn(void *data, size_t len) {
+    find_objects_obj_t *obj = (find_objects_obj_t *)data;
+
+    /*
+     * The session is still valid here even if it is garbage as well: it was
+     * allocated before this sequence, and the collector frees the newest
+     * blocks first.
+     */
+    find_objects_final(obj);
+
+    return 0;
+}
+
+static int find_objects_gcmark_fn(void *data, size_t len) {
+    find_objects_obj_t *obj = (find_objects_obj_t *)data;
+    janet_mark(obj->session);
+
+    return 0;
+}
+
+static int find_objects_get_fn(void *data, Janet key, Janet *out) {
+    find_objects_obj_t *obj = (find_objects_obj_t *)data;
+
+    if (janet_checktype(key, JANET_KEYWORD)) {
+        return janet_getmethod(janet_unwrap_keyword(key), find_objects_methods, out);
+    }
+
+    if (!janet_checkint(key) || janet_unwrap_integer(key) < 0) {
+        return 0;
+    }
+
+    CK_ULONG index = (CK_ULONG)janet_unwrap_integer(key);
+    if (index < obj->start || index >= obj->start + obj->count) {
+        return 0;
+    }
+
+    *out = janet_wrap_number((double)obj->handles[index - obj->start]);
+    return 1;
+}
+
+static Janet find_objects_next_fn(void *data, Janet key) {
+    find_objects_obj_t *obj = (find_objects_obj_t *)data;
+    CK_ULONG index = 0;
+
+    if (janet_checktype(key, JANET_NIL)) {
+        if (obj->start != 0) {
+            janet_panic("find-objects-seq can only be iterated once");
+        }
+    } else {
+        if (!janet_checkint(key) || janet_unwrap_integer(key) < 0) {
+            janet_panicf("expected index, got %v", key);
+        }
+        index = (CK_ULONG)janet_unwrap_integer(key) + 1;
+    }
+
+    if (index >= obj->start + obj->count) {
+        if (!obj->is_search_active) {
+            return janet_wrap_nil();
+        }
+
+        find_objects_fetch(obj);
+        if (obj->count == 0) {
+            return janet_wrap_nil();
+        }
+        index = obj->start;
+    }
+
+    return janet_wrap_number((double)index);
+}
+
+JanetAbstractType *get_find_objects_obj_type(void) {
+    return &find_objects_obj_type;
+}
+
+JANET_FN(p11_find_objects_seq,
+         "(find-objects-seq session-obj &opt template)",
+         "Starts a search for token and session objects that match a "
+         "`template`, or all objects if `template` is not provided. Returns a "
+         "`find-objects-seq` yielding the `obj-handle` of every match to "
+         "`each`, `map` or `seq`. Handles are fetched in growing batches as "
+         "the sequence is consumed. The search is finished when the sequence "
+         "is exhausted, closed with `find-objects-seq-close`, or garbage "
+         "collected, so `(with [objs (find-objects-seq session)] ...)` ends "
+         "it even if the loop is left early.")
+{
+    janet_arity(argc, 1, 2);
+
+    session_obj_t *session = janet_getabstract(argv, 0, get_session_obj_type());
+
+    CK_ULONG count = 0;
+    CK_ATTRIBUTE_PTR p_template = NULL_PTR;
+
+    if (argc == 2) {
+        p_template = janet_get_p11_template(argv, 1, &count);
+    }
+
+    CK_RV rv;
+    rv = session->func_list->C_FindObjectsInit(session->session, p_template, count);
+    PKCS11_ASSERT(rv, "C_FindObjectsInit");
+
+    find_objects_obj_t *obj = janet_abstract(get_find_objects_obj_type(),
+                                             sizeof(find_objects_obj_t));
+    obj->session = argv[0];
+    obj->handle = session->session;
+    obj->func_list = session->func_list;
+    obj->is_search_active = true;
+    obj->batch_size = FIND_BATCH_MIN;
+    obj->start = 0;
+    obj->count = 0;
+
+    return janet_wrap_abstract(obj);
+}
+
+JANET_FN(p11_find_objects_seq_close,
+         "(find-objects-seq-close find-objects-seq)",
+         "Finishes the search of a `find-objects-seq` that was not consumed "
+         "to the end. Does nothing if the search is already over.")
+{
+    janet_fixarity(argc, 1);
+
+    find_objects_obj_t *obj = janet_getabstract(argv, 0, get_find_objects_obj_type());
+
+    CK_RV rv;
+    rv = find_objects_final(obj);
+    PKCS11_ASSERT(rv, "C_FindObjectsFinal");
+
+    return janet_wrap_nil();
+}
+
+void submod_find_objects(JanetTable *env) {
+    JanetRegExt cfuns[] = {
+        JANET_REG("find-objects-seq", p11_find_objects_seq),
+        JANET_REG("find-objects-seq-close", p11_find_objects_seq_close),
+        JANET_REG_END
+    };
+    janet_cfuns_ext(env, "pkcs11", cfuns);
+    janet_register_abstract_type(get_find_objects_obj_type());
+}
@@ -8,6 +8,8 @@
 #include "error.h"
 #include "attribute.h"
 #include "types.h"
+#include "output.h"
+#include "object_index.h"
 
 JANET_FN(p11_generate_key,
          "(generate-key session-obj mechanism &opt template)",
@@ -17,24 +19,23 @@ JANET_FN(p11_generate_key,
     janet_arity(argc, 2, 3);
 
     session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
-    JanetStruct mechanism = janet_getstruct(argv, 1);
 
-    CK_MECHANISM_PTR p_mechanism = janet_struct_to_p11_mechanism(mechanism);
+    CK_MECHANISM_PTR p_mechanism = janet_get_p11_mechanism(argv, 1);
 
     CK_ULONG count = 0;
     CK_ATTRIBUTE_PTR p_template = NULL_PTR;
     CK_OBJECT_HANDLE key_handle;
 
     if (argc == 3) {
-        JanetStruct template = janet_getstruct(argv, 2);
-        count = (CK_ULONG)janet_struct_length(template);
-        p_template = janet_struct_to_p11_template(template);
+        p_template = janet_get_p11_template(argv, 2, &count);
     }
 
     CK_RV rv;
     rv = obj->func_list->C_GenerateKey(obj->session, p_mechanism, p_template, count, &key_handle);
     PKCS11_ASSERT(rv, "C_GenerateKey");
 
+    p11_index_add(obj, key_handle);
+
     return janet_wrap_number((double)key_handle);
 }
 
@@ -46,16 +47,12 @@ JANET_FN(p11_generate_key_pair,
     janet_fixarity(argc, 4);
 
     session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
-    JanetStruct mechanism = janet_getstruct(argv, 1);
-    JanetStruct pub_template = janet_getstruct(argv, 2);
-    JanetStruct priv_template = janet_getstruct(argv, 3);
-
-    CK_MECHANISM_PTR p_mechanism = janet_struct_to_p11_mechanism(mechanism);
-    CK_ULONG pub_template_count = (CK_ULONG)janet_struct_length(pub_template);
-    CK_ULONG priv_template_count = (CK_ULONG)janet_struct_length(priv_template);
 
-    CK_ATTRIBUTE_PTR p_pub_template = janet_struct_to_p11_template(pub_template);
-    CK_ATTRIBUTE_PTR p_priv_template = janet_struct_to_p11_template(priv_template);
+    CK_MECHANISM_PTR p_mechanism = janet_get_p11_mechanism(argv, 1);
+    CK_ULONG pub_template_count;
+    CK_ULONG priv_template_count;
+    CK_ATTRIBUTE_PTR p_pub_template = janet_get_p11_template(argv, 2, &pub_template_count);
+    CK_ATTRIBUTE_PTR p_priv_template = janet_get_p11_template(argv, 3, &priv_template_count);
 
     CK_OBJECT_HANDLE pub_handle;
     CK_OBJECT_HANDLE priv_handle;
@@ -68,6 +65,9 @@ JANET_FN(p11_generate_key_pair,
                                            &pub_handle, &priv_handle);
     PKCS11_ASSERT(rv, "C_GenerateKeyPair");
 
+    p11_index_add(obj, pub_handle);
+    p11_index_add(obj, priv_handle);
+
     Janet *tup = janet_tuple_begin(2);
     tup[0] = janet_wrap_number(pub_handle);
     tup[1] = janet_wrap_number(priv_handle);
@@ -75,36 +75,45 @@ JANET_FN(p11_generate_key_pair,
     return janet_wrap_tuple(janet_tuple_end(tup));
 }
 
+typedef struct wrap_ctx {
+    CK_MECHANISM_PTR mechanism;
+    CK_OBJECT_HANDLE wrapping_key;
+    CK_OBJECT_HANDLE key;
+} wrap_ctx_t;
+
+static CK_RV wrap_out(session_obj_t *obj, const void *ctx,
+                      CK_BYTE_PTR out, CK_ULONG_PTR out_len)
+{
+    const wrap_ctx_t *c = ctx;
+    return obj->func_list->C_WrapKey(obj->session, c->mechanism,
+                                     c->wrapping_key, c->key, out, out_len);
+}
+
 JANET_FN(p11_wrap_key,
-         "(wrap-key session-obj mechanism wrapping-key-handle key-handle)",
+         "(wrap-key session-obj mechanism wrapping-key-handle key-handle &opt buffer mode)",
          "Wraps (i.e., encrypts) a private or secret key."
-         "Returns a wrapped key in string, if successful.")
+         "Returns a wrapped key in string, if successful. "
+         "With `buffer`, the output is appended to it, or replaces its "
+         "content if `mode` is `:overwrite`, and `buffer` is returned.")
 {
-    janet_fixarity(argc, 4);
+    janet_arity(argc, 4, 6);
 
     session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
-    JanetStruct mechanism = janet_getstruct(argv, 1);
     CK_OBJECT_HANDLE wrapping_key_handle = (CK_OBJECT_HANDLE)janet_getnumber(argv, 2);
     CK_OBJECT_HANDLE key_handle = (CK_OBJECT_HANDLE)janet_getnumber(argv, 3);
 
-    CK_MECHANISM_PTR p_mechanism = janet_struct_to_p11_mechanism(mechanism);
-    CK_BYTE_PTR wrapped_key = NULL_PTR;
-    CK_ULONG wrapped_key_len = 0;
-
-    CK_RV rv;
-    rv = obj->func_list->C_WrapKey(obj->session, p_mechanism,
-                                   wrapping_key_handle, key_handle,
-                                   wrapped_key, &wrapped_key_len);
-    PKCS11_ASSERT(rv, "C_WrapKey");
+    CK_MECHANISM_PTR p_mechanism = janet_get_p11_mechanism(argv, 1);
+    wrap_ctx_t ctx = {p_mechanism, wrapping_key_handle, key_handle};
+    p11_output_t out = p11_output_buffer(argc, argv, 4);
 
-    wrapped_key = janet_smalloc(wrapped_key_len);
+    p11_output_hint_init(obj, P11_OUTPUT_WRAP, p_mechanism->mechanism, wrapping_key_handle);
+    CK_ULONG guess = p11_output_guess(obj, P11_OUTPUT_WRAP, 0);
 
-    rv = obj->func_list->C_WrapKey(obj->session, p_mechanism,
-                                   wrapping_key_handle, key_handle,
-                                   wrapped_key, &wrapped_key_len);
+    CK_RV rv;
+    rv = p11_output_call(obj, P11_OUTPUT_WRAP, guess, wrap_out, &ctx, &out);
     PKCS11_ASSERT(rv, "C_WrapKey");
 
-    return janet_wrap_string(janet_string(wrapped_key, wrapped_key_len));
+    return p11_output_wrap(argc, argv, 4, &out);
 }
 
 JANET_FN(p11_unwrap_key,
@@ -115,14 +124,12 @@ JANET_FN(p11_unwrap_key,
     janet_fixarity(argc, 5);
 
     session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
-    JanetStruct mechanism = janet_getstruct(argv, 1);
     CK_OBJECT_HANDLE unwrapping_key_handle = (CK_OBJECT_HANDLE)janet_getnumber(argv, 2);
     JanetByteView wrapped_key = janet_getbytes(argv, 3);
-    JanetStruct template = janet_getstruct(argv, 4);
 
-    CK_MECHANISM_PTR p_mechanism = janet_struct_to_p11_mechanism(mechanism);
-    CK_ATTRIBUTE_PTR p_template = janet_struct_to_p11_template(template);
-    CK_ULONG count = (CK_ULONG)janet_struct_length(template);
+    CK_MECHANISM_PTR p_mechanism = janet_get_p11_mechanism(argv, 1);
+    CK_ULONG count;
+    CK_ATTRIBUTE_PTR p_template = janet_get_p11_template(argv, 4, &count);
     CK_OBJECT_HANDLE key_handle = 0;
 
     CK_RV rv;
@@ -134,6 +141,8 @@ JANET_FN(p11_unwrap_key,
                                      &key_handle);
     PKCS11_ASSERT(rv, "C_UnwrapKey");
 
+    p11_index_add(obj, key_handle);
+
     return janet_wrap_number((double)key_handle);
 }
 
@@ -145,13 +154,11 @@ JANET_FN(p11_derive_key,
     janet_fixarity(argc, 4);
 
     session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
-    JanetStruct mechanism = janet_getstruct(argv, 1);
     CK_OBJECT_HANDLE base_key_handle = (CK_OBJECT_HANDLE)janet_getnumber(argv, 2);
-    JanetStruct template = janet_getstruct(argv, 3);
 
-    CK_MECHANISM_PTR p_mechanism = janet_struct_to_p11_mechanism(mechanism);
-    CK_ATTRIBUTE_PTR p_template = janet_struct_to_p11_template(template);
-    CK_ULONG count = (CK_ULONG)janet_struct_length(template);
+    CK_MECHANISM_PTR p_mechanism = janet_get_p11_mechanism(argv, 1);
+    CK_ULONG count;
+    CK_ATTRIBUTE_PTR p_template = janet_get_p11_template(argv, 3, &count);
     CK_OBJECT_HANDLE key_handle = 0;
 
     CK_RV rv;
@@ -161,6 +168,8 @@ JANET_FN(p11_derive_key,
                                      &key_handle);
     PKCS11_ASSERT(rv, "C_DeriveKey");
 
+    p11_index_add(obj, key_handle);
+
     return janet_wrap_number((double)key_handle);
 }
 
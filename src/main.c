@@ -5,8 +5,14 @@
  */
 
 #include <dlfcn.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include "main.h"
 #include "error.h"
+#include "utils.h"
+#include "types.h"
+#include "stats.h"
+#include "object_index.h"
 
 /* Abstract Object functions */
 static Janet cfun_pkcs11_close(int32_t argc, Janet *argv);
@@ -24,6 +30,9 @@ static JanetAbstractType p11_obj_type = {
 static JanetMethod pkcs11_methods[] = {
     {"close", cfun_pkcs11_close},
     {"get-info", p11_get_info},
+    {"stats", p11_stats},
+    {"trace-dump", p11_trace_dump},
+    {"trace-clear", p11_trace_clear},
     {"get-slot-list", p11_get_slot_list},
     {"get-slot-info", p11_get_slot_info},
     {"get-token-info", p11_get_token_info},
@@ -39,6 +48,8 @@ static JanetMethod pkcs11_methods[] = {
 static void pkcs11_close(p11_obj_t *obj) {
     if (obj->is_p11_open) {
         obj->func_list->C_Finalize(NULL_PTR);
+        p11_index_invalidate_all(obj->func_list);
+        p11_stats_detach(obj);
         dlclose(obj->lib_handle);
         obj->is_p11_open = false;
     }
@@ -74,14 +85,106 @@ JanetAbstractType *get_p11_obj_type(void) {
     return &p11_obj_type;
 }
 
+/* Mutex callbacks passed to C_Initialize with `:custom-locking` */
+static CK_RV p11_create_mutex(void **mutex) {
+    pthread_mutex_t *m = malloc(sizeof(pthread_mutex_t));
+    if (m == NULL) {
+        return CKR_HOST_MEMORY;
+    }
+
+    if (pthread_mutex_init(m, NULL) != 0) {
+        free(m);
+        return CKR_GENERAL_ERROR;
+    }
+
+    *mutex = m;
+    return CKR_OK;
+}
+
+static CK_RV p11_destroy_mutex(void *mutex) {
+    if (mutex == NULL) {
+        return CKR_MUTEX_BAD;
+    }
+
+    pthread_mutex_destroy((pthread_mutex_t *)mutex);
+    free(mutex);
+    return CKR_OK;
+}
+
+static CK_RV p11_lock_mutex(void *mutex) {
+    if (mutex == NULL) {
+        return CKR_MUTEX_BAD;
+    }
+
+    return pthread_mutex_lock((pthread_mutex_t *)mutex) == 0 ?
+        CKR_OK : CKR_GENERAL_ERROR;
+}
+
+static CK_RV p11_unlock_mutex(void *mutex) {
+    if (mutex == NULL) {
+        return CKR_MUTEX_BAD;
+    }
+
+    return pthread_mutex_unlock((pthread_mutex_t *)mutex) == 0 ?
+        CKR_OK : CKR_MUTEX_NOT_LOCKED;
+}
+
 JANET_FN(p11_new,
-         "(new lib-path)",
+         "(new lib-path & options)",
          "Get the `p11-obj`(an instance holding a handle to the opened PKCS#11 "
-         "library).")
+         "library). By default, the library is initialized for use from a "
+         "single thread. `options` may hold one of the following locking "
+         "modes:\n\n"
+         "\t:os-locking - the library may use the native OS locking primitives\n"
+         "\t:custom-locking - the library must use the pthread mutex callbacks "
+         "supplied by this module\n\n"
+         "With a locking mode, the `p11-obj` and the `session-obj`s opened from it "
+         "can be shared with other threads (e.g. `ev/thread`). A session must "
+         "still be used by one thread at a time, so each thread should open "
+         "its own session.\n\n"
+         "With the option `:stats`, every call into the library is counted "
+         "and timed, see `stats`. With `:trace`, every call is recorded in a "
+         "ring buffer, see `trace-dump`. Only one library at a time can be "
+         "loaded with `:stats` or `:trace`.")
 {
-    janet_fixarity(argc, 1);
+    janet_arity(argc, 1, -1);
+
+    CK_C_INITIALIZE_ARGS init_args;
+    CK_C_INITIALIZE_ARGS_PTR p_init_args = NULL_PTR;
+    memset(&init_args, 0, sizeof(init_args));
+    bool with_stats = false;
+    bool with_trace = false;
+
+    for (int32_t i=1; i<argc; i++) {
+        if (IS_ARG_KEYWORD(i, "os-locking") && p_init_args == NULL_PTR) {
+            init_args.flags = CKF_OS_LOCKING_OK;
+            p_init_args = &init_args;
+        } else if (IS_ARG_KEYWORD(i, "custom-locking") && p_init_args == NULL_PTR) {
+            init_args.CreateMutex = p11_create_mutex;
+            init_args.DestroyMutex = p11_destroy_mutex;
+            init_args.LockMutex = p11_lock_mutex;
+            init_args.UnlockMutex = p11_unlock_mutex;
+            p_init_args = &init_args;
+        } else if (IS_ARG_KEYWORD(i, "stats")) {
+            with_stats = true;
+        } else if (IS_ARG_KEYWORD(i, "trace")) {
+            with_trace = true;
+        } else {
+            janet_panicf("expected one of :os-locking, :custom-locking, :stats, :trace, got %v",
+                         argv[i]);
+        }
+    }
 
-    p11_obj_t *obj = janet_abstract(get_p11_obj_type(), sizeof(p11_obj_t));
+    /*
+     * A threaded abstract is passed by reference between threads and is
+     * garbage collected only after every thread has released it.
+     */
+    p11_obj_t *obj;
+    if (p_init_args) {
+        obj = janet_abstract_threaded(get_p11_obj_type(), sizeof(p11_obj_t));
+    } else {
+        obj = janet_abstract(get_p11_obj_type(), sizeof(p11_obj_t));
+    }
     memset(obj, 0, sizeof(p11_obj_t));
 
     const char *lib_path = janet_getcstring(argv, 0);
@@ -100,10 +203,18 @@ JANET_FN(p11_new,
     rv = (*get_func_list)(&obj->func_list);
     PKCS11_ASSERT(rv, "C_GetFunctionList");
 
-    rv = obj->func_list->C_Initialize(NULL_PTR);
-    PKCS11_ASSERT(rv, "C_Initialize");
+    if ((with_stats || with_trace) && !p11_stats_attach(obj, with_stats, with_trace)) {
+        janet_panic("another library is already loaded with :stats or :trace");
+    }
+
+    rv = obj->func_list->C_Initialize(p_init_args);
+    if (rv != CKR_OK) {
+        p11_stats_detach(obj);
+        PKCS11_ASSERT(rv, "C_Initialize");
+    }
 
     obj->is_p11_open = true;
+    obj->is_threaded = (p_init_args != NULL_PTR);
 
     return janet_wrap_abstract(obj);
 }
@@ -154,11 +265,14 @@ static void submod_general_purpose(JanetTable *env)
 }
 
 JANET_MODULE_ENTRY(JanetTable *env) {
+    init_type_table();
+
     submod_utils(env);
 
     submod_general_purpose(env);
     submod_slot_and_token(env);
     submod_session(env);
+    submod_session_pool(env);
     submod_object(env);
     submod_encrypt(env);
     submod_decrypt(env);
@@ -168,4 +282,14 @@ JANET_MODULE_ENTRY(JanetTable *env) {
     submod_dual(env);
     submod_key(env);
     submod_random(env);
+    submod_async(env);
+    submod_output(env);
+    submod_mechanism(env);
+    submod_template(env);
+    submod_find_objects(env);
+    submod_object_index(env);
+    submod_parallel(env);
+    submod_stream(env);
+    submod_stats(env);
+    submod_trace(env);
 }
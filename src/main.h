@@ -15,20 +15,59 @@ typedef struct p11_obj {
     void *lib_handle;
     CK_FUNCTION_LIST_PTR func_list;
     bool is_p11_open;
+    bool is_threaded;
+    bool is_stats;
+    bool is_traced;
 } p11_obj_t;
 
+/* Operations whose output buffer is sized by output.c */
+typedef enum p11_output_op {
+    P11_OUTPUT_ENCRYPT,
+    P11_OUTPUT_DECRYPT,
+    P11_OUTPUT_DIGEST,
+    P11_OUTPUT_SIGN,
+    P11_OUTPUT_SIGN_RECOVER,
+    P11_OUTPUT_VERIFY_RECOVER,
+    P11_OUTPUT_WRAP,
+    P11_OUTPUT_OP_COUNT
+} p11_output_op_t;
+
+#define P11_OUTPUT_CACHE_SIZE 8
+
+typedef struct p11_output_hint {
+    p11_output_op_t op;
+    CK_MECHANISM_TYPE mechanism;
+    CK_OBJECT_HANDLE key;
+    CK_ULONG len;
+} p11_output_hint_t;
+
 typedef struct session_obj {
     CK_SESSION_HANDLE session;
     CK_FUNCTION_LIST_PTR func_list;
+    CK_SLOT_ID slot_id;
     bool is_session_open;
+    bool is_threaded;
+    p11_output_hint_t output_hints[P11_OUTPUT_OP_COUNT];
+    p11_output_hint_t output_cache[P11_OUTPUT_CACHE_SIZE];
 } session_obj_t;
 
 JanetAbstractType *get_p11_obj_type(void);
 JanetAbstractType *get_session_obj_type(void);
+JanetAbstractType *get_session_pool_obj_type(void);
+JanetAbstractType *get_mechanism_obj_type(void);
+JanetAbstractType *get_template_obj_type(void);
+JanetAbstractType *get_find_objects_obj_type(void);
+JanetAbstractType *get_object_index_obj_type(void);
+
+session_obj_t *open_session_obj(p11_obj_t *obj, CK_SLOT_ID slot_id, CK_FLAGS flags);
+CK_USER_TYPE get_user_type(const Janet *argv, int32_t n);
 
 /* General purpose functions */
 Janet p11_new(int32_t argc, Janet *argv);
 Janet p11_get_info(int32_t argc, Janet *argv);
+Janet p11_stats(int32_t argc, Janet *argv);
+Janet p11_trace_dump(int32_t argc, Janet *argv);
+Janet p11_trace_clear(int32_t argc, Janet *argv);
 
 /* Slot and token management functions */
 Janet p11_get_slot_list(int32_t argc, Janet *argv);
@@ -50,32 +89,57 @@ Janet p11_get_operation_state(int32_t argc, Janet *argv);
 Janet p11_login(int32_t argc, Janet *argv);
 Janet p11_logout(int32_t argc, Janet *argv);
 
+/* Session pool functions */
+Janet p11_session_pool(int32_t argc, Janet *argv);
+Janet p11_session_pool_idle(int32_t argc, Janet *argv);
+Janet p11_session_pool_acquire(int32_t argc, Janet *argv);
+Janet p11_session_pool_return(int32_t argc, Janet *argv);
+Janet p11_session_pool_shutdown(int32_t argc, Janet *argv);
+
 /* Object management functions */
 Janet p11_create_object(int32_t argc, Janet *argv);
 Janet p11_copy_object(int32_t argc, Janet *argv);
 Janet p11_destroy_object(int32_t argc, Janet *argv);
 Janet p11_get_object_size(int32_t argc, Janet *argv);
 Janet p11_get_attribute_value(int32_t argc, Janet *argv);
+Janet p11_get_attributes_batch(int32_t argc, Janet *argv);
 Janet p11_set_attribute_value(int32_t argc, Janet *argv);
 Janet p11_find_objects_init(int32_t argc, Janet *argv);
 Janet p11_find_objects(int32_t argc, Janet *argv);
 Janet p11_find_objects_final(int32_t argc, Janet *argv);
+Janet p11_find_objects_seq(int32_t argc, Janet *argv);
+Janet p11_find_objects_seq_close(int32_t argc, Janet *argv);
+
+/* Object index functions */
+Janet p11_object_index(int32_t argc, Janet *argv);
+Janet p11_object_index_find(int32_t argc, Janet *argv);
+Janet p11_object_index_refresh(int32_t argc, Janet *argv);
+Janet p11_object_index_stats(int32_t argc, Janet *argv);
+Janet p11_object_index_close(int32_t argc, Janet *argv);
 
 /* Encrypt functions */
 Janet p11_encrypt_init(int32_t argc, Janet *argv);
 Janet p11_encrypt(int32_t argc, Janet *argv);
+Janet p11_encrypt_once(int32_t argc, Janet *argv);
+Janet p11_encrypt_batch(int32_t argc, Janet *argv);
+Janet p11_encrypt_stream(int32_t argc, Janet *argv);
 Janet p11_encrypt_update(int32_t argc, Janet *argv);
 Janet p11_encrypt_final(int32_t argc, Janet *argv);
 
 /* Decrypt functions */
 Janet p11_decrypt_init(int32_t argc, Janet *argv);
 Janet p11_decrypt(int32_t argc, Janet *argv);
+Janet p11_decrypt_once(int32_t argc, Janet *argv);
+Janet p11_decrypt_batch(int32_t argc, Janet *argv);
+Janet p11_decrypt_stream(int32_t argc, Janet *argv);
 Janet p11_decrypt_update(int32_t argc, Janet *argv);
 Janet p11_decrypt_final(int32_t argc, Janet *argv);
 
 /* Digest functions */
 Janet p11_digest_init(int32_t argc, Janet *argv);
 Janet p11_digest(int32_t argc, Janet *argv);
+Janet p11_digest_once(int32_t argc, Janet *argv);
+Janet p11_digest_file(int32_t argc, Janet *argv);
 Janet p11_digest_update(int32_t argc, Janet *argv);
 Janet p11_digest_key(int32_t argc, Janet *argv);
 Janet p11_digest_final(int32_t argc, Janet *argv);
@@ -83,6 +147,10 @@ Janet p11_digest_final(int32_t argc, Janet *argv);
 /* Signing and MACing functions */
 Janet p11_sign_init(int32_t argc, Janet *argv);
 Janet p11_sign(int32_t argc, Janet *argv);
+Janet p11_sign_once(int32_t argc, Janet *argv);
+Janet p11_sign_batch(int32_t argc, Janet *argv);
+Janet p11_sign_parallel(int32_t argc, Janet *argv);
+Janet p11_sign_file(int32_t argc, Janet *argv);
 Janet p11_sign_update(int32_t argc, Janet *argv);
 Janet p11_sign_final(int32_t argc, Janet *argv);
 Janet p11_sign_recover_init(int32_t argc, Janet *argv);
@@ -91,6 +159,9 @@ Janet p11_sign_recover(int32_t argc, Janet *argv);
 /* Verify signature and MAC functions */
 Janet p11_verify_init(int32_t argc, Janet *argv);
 Janet p11_verify(int32_t argc, Janet *argv);
+Janet p11_verify_once(int32_t argc, Janet *argv);
+Janet p11_verify_batch(int32_t argc, Janet *argv);
+Janet p11_verify_file(int32_t argc, Janet *argv);
 Janet p11_verify_update(int32_t argc, Janet *argv);
 Janet p11_verify_final(int32_t argc, Janet *argv);
 Janet p11_verify_recover_init(int32_t argc, Janet *argv);
@@ -113,10 +184,30 @@ Janet p11_derive_key(int32_t argc, Janet *argv);
 Janet p11_seed_random(int32_t argc, Janet *argv);
 Janet p11_generate_random(int32_t argc, Janet *argv);
 
+/* Asynchronous functions */
+Janet p11_encrypt_async(int32_t argc, Janet *argv);
+Janet p11_decrypt_async(int32_t argc, Janet *argv);
+Janet p11_digest_async(int32_t argc, Janet *argv);
+Janet p11_sign_async(int32_t argc, Janet *argv);
+Janet p11_verify_async(int32_t argc, Janet *argv);
+Janet p11_generate_key_async(int32_t argc, Janet *argv);
+Janet p11_generate_key_pair_async(int32_t argc, Janet *argv);
+Janet p11_generate_random_async(int32_t argc, Janet *argv);
+
+/* Mechanism functions */
+Janet p11_mechanism(int32_t argc, Janet *argv);
+
+/* Template functions */
+Janet p11_template(int32_t argc, Janet *argv);
+
+/* Output sizing functions */
+Janet p11_output_stats(int32_t argc, Janet *argv);
+
 /* Sub modules */
 void submod_utils(JanetTable *env);
 void submod_slot_and_token(JanetTable *env);
 void submod_session(JanetTable *env);
+void submod_session_pool(JanetTable *env);
 void submod_object(JanetTable *env);
 void submod_encrypt(JanetTable *env);
 void submod_decrypt(JanetTable *env);
@@ -126,5 +217,15 @@ void submod_verify(JanetTable *env);
 void submod_dual(JanetTable *env);
 void submod_key(JanetTable *env);
 void submod_random(JanetTable *env);
+void submod_async(JanetTable *env);
+void submod_output(JanetTable *env);
+void submod_mechanism(JanetTable *env);
+void submod_template(JanetTable *env);
+void submod_find_objects(JanetTable *env);
+void submod_object_index(JanetTable *env);
+void submod_parallel(JanetTable *env);
+void submod_stream(JanetTable *env);
+void submod_stats(JanetTable *env);
+void submod_trace(JanetTable *env);
 
 #endif /* MAIN_H */
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2024, Janet-pkcs11 Seungki Kim
+ *
+ * Janet-pkcs11 is released under the MIT License, see the LICENSE file.
+ */
+
+/* madvise() is not part of C99 */
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "mapped_file.h"
+
+/*
+ * Files are mapped instead of read, so their content reaches the provider
+ * without being copied into Janet buffers. The mapping is fed in chunks of
+ * MAPPED_CHUNK bytes, rounded to whole pages, which also keeps every length
+ * within CK_ULONG.
+ */
+#define MAPPED_CHUNK (1024 * 1024)
+
+void p11_mapped_file_open(mapped_file_t *file, const Janet *argv, int32_t n)
+{
+    const char *path = janet_getcstring(argv, n);
+
+    file->data = NULL;
+    file->len = 0;
+
+    /* A FIFO would block here until a writer opens it */
+    int fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (fd < 0) {
+        janet_panicf("failed to open %s: %s", path, strerror(errno));
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int err = errno;
+        close(fd);
+        janet_panicf("failed to stat %s: %s", path, strerror(err));
+    }
+
+    /* Pipes and devices report no size, they would read as empty */
+    if (!S_ISREG(st.st_mode)) {
+        close(fd);
+        janet_panicf("failed to map %s: not a regular file", path);
+    }
+
+    if (st.st_size > 0) {
+        void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            int err = errno;
+            close(fd);
+            janet_panicf("failed to map %s: %s", path, strerror(err));
+        }
+        madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+        file->data = data;
+        file->len = (size_t)st.st_size;
+    }
+
+    /* The mapping stays valid after the descriptor is closed */
+    close(fd);
+}
+
+void p11_mapped_file_close(mapped_file_t *file)
+{
+    if (file->data != NULL) {
+        munmap(file->data, file->len);
+        file->data = NULL;
+        file->len = 0;
+    }
+}
+
+CK_RV p11_mapped_file_feed(mapped_file_t *file, CK_SESSION_HANDLE session,
+                           p11_update_fn fn)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t chunk = (MAPPED_CHUNK + page - 1) / page * page;
+
+    for (size_t offset = 0; offset < file->len; offset += chunk) {
+        size_t len = file->len - offset < chunk ? file->len - offset : chunk;
+
+        CK_RV rv = fn(session, file->data + offset, (CK_ULONG)len);
+        if (rv != CKR_OK) {
+            return rv;
+        }
+    }
+
+    return CKR_OK;
+}
@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2024, Janet-pkcs11 Seungki Kim
+ *
+ * Janet-pkcs11 is released under the MIT License, see the LICENSE file.
+ */
+
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include "main.h"
+#include "output.h"
+
+typedef struct mapped_file {
+    CK_BYTE_PTR data;
+    size_t len;
+} mapped_file_t;
+
+/* Maps the file at argv[n] read-only, panics if that fails */
+void p11_mapped_file_open(mapped_file_t *file, const Janet *argv, int32_t n);
+void p11_mapped_file_close(mapped_file_t *file);
+
+/* Feeds the whole file to `fn` in page-aligned chunks */
+CK_RV p11_mapped_file_feed(mapped_file_t *file, CK_SESSION_HANDLE session,
+                           p11_update_fn fn);
+
+#endif /* MAPPED_FILE_H */
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2024, Janet-pkcs11 Seungki Kim
+ *
+ * Janet-pkcs11 is released under the MIT License, see the LICENSE file.
+ */
+
+#include "main.h"
+#include "attribute.h"
+
+/*
+ * A mechanism object holds a ready-to-use CK_MECHANISM. The parameter is
+ * stored right after the struct, in the memory of the abstract itself, so
+ * the object can be passed to the provider as is.
+ */
+typedef struct mechanism_obj {
+    CK_MECHANISM mechanism;
+    CK_BYTE parameter[];
+} mechanism_obj_t;
+
+static JanetAbstractType mechanism_obj_type = {
+    "mechanism",
+    JANET_ATEND_NAME
+};
+
+JanetAbstractType *get_mechanism_obj_type(void) {
+    return &mechanism_obj_type;
+}
+
+/*
+ * Returns the CK_MECHANISM of argv[n], which is either a mechanism struct
+ * or a `mechanism-obj`. A `mechanism-obj` is used without any conversion.
+ */
+CK_MECHANISM_PTR janet_get_p11_mechanism(const Janet *argv, int32_t n)
+{
+    Janet x = argv[n];
+
+    if (janet_checktype(x, JANET_ABSTRACT)) {
+        mechanism_obj_t *obj = janet_checkabstract(x, get_mechanism_obj_type());
+        if (obj != NULL) {
+            return &obj->mechanism;
+        }
+    } else if (janet_checktype(x, JANET_STRUCT)) {
+        return janet_struct_to_p11_mechanism(janet_unwrap_struct(x));
+    }
+
+    janet_panicf("bad slot #%d, expected struct or mechanism, got %v", n, x);
+}
+
+JANET_FN(p11_mechanism,
+         "(mechanism mechanism)",
+         "Converts a mechanism struct, e.g. `{:mechanism :CKM_AES_CBC_PAD "
+         ":parameter iv}`, into a `mechanism-obj`. A `mechanism-obj` can be "
+         "given to any function taking a mechanism, and is used without "
+         "parsing the struct again.")
+{
+    janet_fixarity(argc, 1);
+
+    JanetStruct st = janet_getstruct(argv, 0);
+    CK_MECHANISM_PTR p_mechanism = janet_struct_to_p11_mechanism(st);
+
+    mechanism_obj_t *obj = janet_abstract(get_mechanism_obj_type(),
+                                          sizeof(mechanism_obj_t) + p_mechanism->ulParameterLen);
+    obj->mechanism.mechanism = p_mechanism->mechanism;
+    obj->mechanism.pParameter = NULL_PTR;
+    obj->mechanism.ulParameterLen = p_mechanism->ulParameterLen;
+    if (p_mechanism->ulParameterLen) {
+        memcpy(obj->parameter, p_mechanism->pParameter, p_mechanism->ulParameterLen);
+        obj->mechanism.pParameter = obj->parameter;
+    }
+
+    return janet_wrap_abstract(obj);
+}
+
+void submod_mechanism(JanetTable *env) {
+    JanetRegExt cfuns[] = {
+        JANET_REG("mechanism", p11_mechanism),
+        JANET_REG_END
+    };
+    janet_cfuns_ext(env, "pkcs11", cfuns);
+    janet_register_abstract_type(get_mechanism_obj_type());
+}
@@ -7,6 +7,22 @@
 #include "main.h"
 #include "error.h"
 #include "attribute.h"
+#include "utils.h"
+#include "types.h"
+#include "object_index.h"
+
+static p11_result_kind_t get_result_kind(int32_t argc, Janet *argv, int32_t n)
+{
+    if (argc <= n || IS_ARG_KEYWORD(n, "struct")) {
+        return P11_RESULT_STRUCT;
+    } else if (IS_ARG_KEYWORD(n, "table")) {
+        return P11_RESULT_TABLE;
+    } else if (IS_ARG_KEYWORD(n, "tuple")) {
+        return P11_RESULT_TUPLE;
+    }
+
+    janet_panicf("expected one of :struct, :table, :tuple, got %v", argv[n]);
+}
 
 JANET_FN(p11_create_object,
          "(create-object session-obj template)",
@@ -15,16 +31,16 @@ JANET_FN(p11_create_object,
     janet_fixarity(argc, 2);
 
     session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
-    JanetStruct template = janet_getstruct(argv, 1);
-
-    CK_ULONG count = (CK_ULONG)janet_struct_length(template);
-    CK_ATTRIBUTE_PTR p_template = janet_struct_to_p11_template(template);
+    CK_ULONG count;
+    CK_ATTRIBUTE_PTR p_template = janet_get_p11_template(argv, 1, &count);
     CK_OBJECT_HANDLE obj_handle;
 
     CK_RV rv;
     rv = obj->func_list->C_CreateObject(obj->session, p_template, count, &obj_handle);
     PKCS11_ASSERT(rv, "C_CreateObject");
 
+    p11_index_add(obj, obj_handle);
+
     return janet_wrap_number((double)obj_handle);
 }
 
@@ -36,16 +52,16 @@ JANET_FN(p11_copy_object,
 
     session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
     CK_OBJECT_HANDLE obj_handle1 = (CK_OBJECT_HANDLE)janet_getnumber(argv, 1);
-    JanetStruct template = janet_getstruct(argv, 2);
-
-    CK_ULONG count = (CK_ULONG)janet_struct_length(template);
-    CK_ATTRIBUTE_PTR p_template = janet_struct_to_p11_template(template);
+    CK_ULONG count;
+    CK_ATTRIBUTE_PTR p_template = janet_get_p11_template(argv, 2, &count);
     CK_OBJECT_HANDLE obj_handle2 = 0;
 
     CK_RV rv;
     rv = obj->func_list->C_CopyObject(obj->session, obj_handle1, p_template, count, &obj_handle2);
     PKCS11_ASSERT(rv, "C_CopyObject");
 
+    p11_index_add(obj, obj_handle2);
+
     return janet_wrap_number((double)obj_handle2);
 }
 
@@ -62,6 +78,8 @@ JANET_FN(p11_destroy_object,
     rv = obj->func_list->C_DestroyObject(obj->session, obj_handle);
     PKCS11_ASSERT(rv, "C_DestroyObject");
 
+    p11_index_remove(obj, obj_handle);
+
     return janet_wrap_nil();
 }
 
@@ -83,16 +101,21 @@ JANET_FN(p11_get_object_size,
 }
 
 JANET_FN(p11_get_attribute_value,
-         "(get-attribute-value session-obj obj-handle attr-list)",
+         "(get-attribute-value session-obj obj-handle attr-list &opt result-type)",
          "Obtains the value of one or more attributes of an object. "
-         "Returns a template struct, if successful.")
+         "Returns a template struct, if successful. `result-type` may be "
+         "`:table` to get a mutable table instead, or `:tuple` to get the "
+         "values only, in the order of `attr-list`.")
 {
-    janet_fixarity(argc, 3);
+    janet_arity(argc, 3, 4);
 
     session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
     CK_OBJECT_HANDLE obj_handle = (CK_OBJECT_HANDLE)janet_getnumber(argv, 1);
     JanetTuple tup = janet_gettuple(argv, 2);
     CK_ULONG count = (CK_ULONG)janet_tuple_length(tup);
+
+    p11_result_kind_t kind = get_result_kind(argc, argv, 3);
+
     CK_ATTRIBUTE_PTR p_template = create_new_p11_template_from_janet_tuple(tup);
 
     CK_RV rv;
@@ -106,9 +129,135 @@ JANET_FN(p11_get_attribute_value,
     rv = obj->func_list->C_GetAttributeValue(obj->session, obj_handle, p_template, count);
     PKCS11_ASSERT(rv, "C_GetAttributeValue");
 
-    JanetStruct st = p11_template_to_janet_struct(p_template, count);
+    return p11_template_to_janet(p_template, count, kind, janet_wrap_nil());
+}
+
+/* Room for one CK_BBOOL, CK_ULONG or CK_DATE value */
+#define FIXED_VALUE_SLOT 16
 
-    return janet_wrap_struct(st);
+/* Return codes of C_GetAttributeValue reported per attribute */
+static bool is_attribute_error(CK_RV rv)
+{
+    return (rv == CKR_ATTRIBUTE_SENSITIVE ||
+            rv == CKR_ATTRIBUTE_TYPE_INVALID ||
+            rv == CKR_BUFFER_TOO_SMALL);
+}
+
+JANET_FN(p11_get_attributes_batch,
+         "(get-attributes-batch session-obj obj-handles attr-list &opt result-type)",
+         "Obtains the value of the attributes in `attr-list` for every object "
+         "in `obj-handles`. Returns an array with one result per object, in "
+         "the format of `get-attribute-value`. An attribute that cannot be "
+         "read, e.g. a sensitive one, has the error keyword as its value, "
+         "such as `:CKR_ATTRIBUTE_SENSITIVE`. If the object handle is "
+         "invalid, the result is `:CKR_OBJECT_HANDLE_INVALID`.")
+{
+    janet_arity(argc, 3, 4);
+
+    session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
+    JanetView handles = janet_getindexed(argv, 1);
+    JanetTuple tup = janet_gettuple(argv, 2);
+    CK_ULONG count = (CK_ULONG)janet_tuple_length(tup);
+    p11_result_kind_t kind = get_result_kind(argc, argv, 3);
+
+    CK_ATTRIBUTE_PTR p_template = create_new_p11_template_from_janet_tuple(tup);
+    CK_ATTRIBUTE_PTR p_variable = janet_smalloc((count ? count : 1) * sizeof(CK_ATTRIBUTE));
+    CK_ULONG *variable_index = janet_smalloc((count ? count : 1) * sizeof(CK_ULONG));
+
+    /*
+     * Fixed size values are read with the first call. Only attributes of
+     * variable size need the length query and a second call.
+     */
+    CK_ULONG *fixed_len = janet_smalloc((count ? count : 1) * sizeof(CK_ULONG));
+    CK_BYTE_PTR fixed_values = janet_smalloc((count ? count : 1) * FIXED_VALUE_SLOT);
+    for (CK_ULONG i=0; i<count; i++) {
+        switch (get_attribute_type(p_template[i].type)) {
+            case P11_ATTR_BOOL:
+                fixed_len[i] = sizeof(CK_BBOOL);
+                break;
+            case P11_ATTR_ULONG:
+                fixed_len[i] = sizeof(CK_ULONG);
+                break;
+            case P11_ATTR_DATE:
+                fixed_len[i] = sizeof(CK_DATE);
+                break;
+            default:
+                fixed_len[i] = 0;
+                break;
+        }
+    }
+
+    CK_BYTE_PTR variable_values = NULL;
+    size_t variable_capacity = 0;
+
+    JanetArray *results = janet_array(handles.len);
+    for (int32_t h=0; h<handles.len; h++) {
+        CK_OBJECT_HANDLE obj_handle = (CK_OBJECT_HANDLE)janet_getnumber(handles.items, h);
+
+        for (CK_ULONG i=0; i<count; i++) {
+            p_template[i].pValue = fixed_len[i] ?
+                (void *)(fixed_values + i * FIXED_VALUE_SLOT) : NULL_PTR;
+            p_template[i].ulValueLen = fixed_len[i];
+        }
+
+        CK_RV rv;
+        rv = obj->func_list->C_GetAttributeValue(obj->session, obj_handle, p_template, count);
+        if (rv == CKR_OBJECT_HANDLE_INVALID) {
+            janet_array_push(results, janet_ckeywordv(get_pkcs11_error(rv)));
+            continue;
+        } else if (!is_attribute_error(rv)) {
+            PKCS11_ASSERT(rv, "C_GetAttributeValue");
+        }
+        CK_RV attr_rv = rv;
+
+        size_t variable_len = 0;
+        CK_ULONG variable_count = 0;
+        for (CK_ULONG i=0; i<count; i++) {
+            if (fixed_len[i] == 0 &&
+                p_template[i].ulValueLen != CK_UNAVAILABLE_INFORMATION &&
+                p_template[i].ulValueLen > 0) {
+                variable_len += p_template[i].ulValueLen;
+                variable_index[variable_count++] = i;
+            }
+        }
+
+        if (variable_count) {
+            if (variable_len > variable_capacity) {
+                variable_values = janet_srealloc(variable_values, variable_len);
+                variable_capacity = variable_len;
+            }
+
+            CK_BYTE_PTR value = variable_values;
+            for (CK_ULONG k=0; k<variable_count; k++) {
+                p_variable[k] = p_template[variable_index[k]];
+                p_variable[k].pValue = value;
+                value += p_variable[k].ulValueLen;
+            }
+
+            rv = obj->func_list->C_GetAttributeValue(obj->session, obj_handle,
+                                                     p_variable, variable_count);
+            if (rv == CKR_OBJECT_HANDLE_INVALID) {
+                janet_array_push(results, janet_ckeywordv(get_pkcs11_error(rv)));
+                continue;
+            } else if (!is_attribute_error(rv)) {
+                PKCS11_ASSERT(rv, "C_GetAttributeValue");
+            }
+            if (rv != CKR_OK) {
+                attr_rv = rv;
+            }
+
+            for (CK_ULONG k=0; k<variable_count; k++) {
+                p_template[variable_index[k]] = p_variable[k];
+            }
+        }
+
+        Janet unavailable = janet_ckeywordv(get_pkcs11_error(attr_rv == CKR_OK ?
+                                                             CKR_ATTRIBUTE_TYPE_INVALID :
+                                                             attr_rv));
+        janet_array_push(results, p11_template_to_janet(p_template, count, kind, unavailable));
+    }
+
+    return janet_wrap_array(results);
 }
 
 JANET_FN(p11_set_attribute_value,
@@ -120,15 +269,17 @@ JANET_FN(p11_set_attribute_value,
 
     session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
     CK_OBJECT_HANDLE obj_handle = (CK_OBJECT_HANDLE)janet_getnumber(argv, 1);
-    JanetStruct template = janet_getstruct(argv, 2);
-
-    CK_ULONG count = (CK_ULONG)janet_struct_length(template);
-    CK_ATTRIBUTE_PTR p_template = janet_struct_to_p11_template(template);
+    CK_ULONG count;
+    CK_ATTRIBUTE_PTR p_template = janet_get_p11_template(argv, 2, &count);
 
     CK_RV rv;
     rv = obj->func_list->C_SetAttributeValue(obj->session, obj_handle, p_template, count);
     PKCS11_ASSERT(rv, "C_SetAttributeValue");
 
+    /* The label or the id may have changed */
+    p11_index_remove(obj, obj_handle);
+    p11_index_add(obj, obj_handle);
+
     return janet_wrap_abstract(obj);
 }
 
@@ -142,14 +293,11 @@ JANET_FN(p11_find_objects_init,
 
     session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
 
-    JanetStruct template;
     CK_ULONG count = 0;
     CK_ATTRIBUTE_PTR p_template = NULL_PTR;
 
     if (argc == 2) {
-        template = janet_getstruct(argv, 1);
-        count = (CK_ULONG)janet_struct_length(template);
-        p_template = janet_struct_to_p11_template(template);
+        p_template = janet_get_p11_template(argv, 1, &count);
     }
 
     CK_RV rv;
@@ -207,6 +355,7 @@ void submod_object(JanetTable *env) {
         JANET_REG("destroy-object", p11_destroy_object),
         JANET_REG("get-object-size", p11_get_object_size),
         JANET_REG("get-attribute-value", p11_get_attribute_value),
+        JANET_REG("get-attributes-batch", p11_get_attributes_batch),
         JANET_REG("set-attribute-value", p11_set_attribute_value),
         JANET_REG("find-objects-init", p11_find_objects_init),
         JANET_REG("find-objects", p11_find_objects),
@@ -0,0 +1,674 @@
+/*
+ * Copyright (c) 2024, Janet-pkcs11 Seungki Kim
+ *
+ * Janet-pkcs11 is released under the MIT License, see the LICENSE file.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "main.h"
+#include "error.h"
+#include "attribute.h"
+#include "types.h"
+#include "object_index.h"
+
+/*
+ * Object index
+ *
+ * An opt-in map of (class, label, id) to the handle of a token object, one
+ * per token. A lookup is answered from the index when possible, and only a
+ * miss is resolved with C_FindObjectsInit/C_FindObjects/C_FindObjectsFinal.
+ * The label and the id are optional parts of the key, so the index answers
+ * lookups by class and label, by class and id, or by all three.
+ *
+ * The functions of this module creating, changing or destroying objects
+ * update the index. Login, logout, closing all sessions, token
+ * initialization and slot events clear the index of the token, as does
+ * `object-index-refresh`. Closing the library clears every index of it, as
+ * a later load may reuse the same function list. Objects changed by other applications are not
+ * seen until then.
+ *
+ * Indexes are native and shared by every thread, all of them are guarded by
+ * `index_lock`. No provider call is made while the lock is held.
+ */
+
+#define INDEX_INITIAL_BUCKETS 64
+/* Longest label and id read back from a new object */
+#define INDEX_VALUE_MAX 256
+/* Length of a label or an id which is not part of the key */
+#define INDEX_ABSENT ((CK_ULONG)-1)
+
+typedef struct index_entry {
+    struct index_entry *next;
+    uint64_t hash;
+    CK_OBJECT_HANDLE handle;
+    CK_OBJECT_CLASS class;
+    CK_ULONG label_len;
+    CK_ULONG id_len;
+    CK_BYTE key[];      /* label, then id */
+} index_entry_t;
+
+typedef struct object_index {
+    struct object_index *next;
+    CK_FUNCTION_LIST_PTR func_list;
+    CK_SLOT_ID slot_id;
+    int32_t refcount;
+    index_entry_t **buckets;
+    size_t bucket_count;
+    size_t count;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t generation;    /* bumped whenever entries are dropped */
+} object_index_t;
+
+typedef struct index_key {
+    CK_OBJECT_CLASS class;
+    const CK_BYTE *label;
+    CK_ULONG label_len;
+    const CK_BYTE *id;
+    CK_ULONG id_len;
+} index_key_t;
+
+typedef struct object_index_obj {
+    object_index_t *index;
+} object_index_obj_t;
+
+static object_index_t *index_list = NULL;
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Abstract Object functions */
+static int object_index_gc_fn(void *data, size_t len);
+static int object_index_get_fn(void *data, Janet key, Janet *out);
+
+static JanetAbstractType object_index_obj_type = {
+    "object-index",
+    object_index_gc_fn,
+    NULL,
+    object_index_get_fn,
+    JANET_ATEND_GET
+};
+
+static JanetMethod object_index_methods[] = {
+    {"find", p11_object_index_find},
+    {"refresh", p11_object_index_refresh},
+    {"stats", p11_object_index_stats},
+    {"close", p11_object_index_close},
+    {NULL, NULL},
+};
+
+/* FNV-1a */
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t len)
+{
+    const CK_BYTE *p = data;
+    for (size_t i=0; i<len; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static uint64_t key_hash(const index_key_t *key)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    hash = hash_bytes(hash, &key->class, sizeof(key->class));
+    hash = hash_bytes(hash, &key->label_len, sizeof(key->label_len));
+    if (key->label_len != INDEX_ABSENT) {
+        hash = hash_bytes(hash, key->label, key->label_len);
+    }
+    hash = hash_bytes(hash, &key->id_len, sizeof(key->id_len));
+    if (key->id_len != INDEX_ABSENT) {
+        hash = hash_bytes(hash, key->id, key->id_len);
+    }
+
+    return hash;
+}
+
+static CK_ULONG value_len(CK_ULONG len)
+{
+    return len == INDEX_ABSENT ? 0 : len;
+}
+
+static bool key_equals(const index_entry_t *entry, const index_key_t *key, uint64_t hash)
+{
+    if (entry->hash != hash || entry->class != key->class ||
+        entry->label_len != key->label_len || entry->id_len != key->id_len) {
+        return false;
+    }
+
+    CK_ULONG label_len = value_len(key->label_len);
+    CK_ULONG id_len = value_len(key->id_len);
+    return (label_len == 0 || memcmp(entry->key, key->label, label_len) == 0) &&
+        (id_len == 0 || memcmp(entry->key + label_len, key->id, id_len) == 0);
+}
+
+/* Must be called with `index_lock` held */
+static object_index_t *find_index(CK_FUNCTION_LIST_PTR func_list, CK_SLOT_ID slot_id)
+{
+    for (object_index_t *index = index_list; index != NULL; index = index->next) {
+        if (index->func_list == func_list && index->slot_id == slot_id) {
+            return index;
+        }
+    }
+
+    return NULL;
+}
+
+static index_entry_t *index_get(object_index_t *index, const index_key_t *key, uint64_t hash)
+{
+    index_entry_t *entry = index->buckets[hash & (index->bucket_count - 1)];
+    for (; entry != NULL; entry = entry->next) {
+        if (key_equals(entry, key, hash)) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+static void index_grow(object_index_t *index)
+{
+    size_t bucket_count = index->bucket_count * 2;
+    index_entry_t **buckets = calloc(bucket_count, sizeof(index_entry_t *));
+    if (buckets == NULL) {
+        /* Keep the current buckets, lookups only get slower */
+        return;
+    }
+
+    for (size_t i=0; i<index->bucket_count; i++) {
+        index_entry_t *entry = index->buckets[i];
+        while (entry != NULL) {
+            index_entry_t *next = entry->next;
+            size_t slot = entry->hash & (bucket_count - 1);
+            entry->next = buckets[slot];
+            buckets[slot] = entry;
+            entry = next;
+        }
+    }
+
+    free(index->buckets);
+    index->buckets = buckets;
+    index->bucket_count = bucket_count;
+}
+
+/* Maps `key` to `handle`, unless `key` is already mapped */
+static void index_put(object_index_t *index, const index_key_t *key, CK_OBJECT_HANDLE handle)
+{
+    uint64_t hash = key_hash(key);
+    if (index_get(index, key, hash) != NULL) {
+        return;
+    }
+
+    CK_ULONG label_len = value_len(key->label_len);
+    CK_ULONG id_len = value_len(key->id_len);
+    index_entry_t *entry = malloc(sizeof(index_entry_t) + label_len + id_len);
+    if (entry == NULL) {
+        return;
+    }
+
+    entry->hash = hash;
+    entry->handle = handle;
+    entry->class = key->class;
+    entry->label_len = key->label_len;
+    entry->id_len = key->id_len;
+    if (label_len) {
+        memcpy(entry->key, key->label, label_len);
+    }
+    if (id_len) {
+        memcpy(entry->key + label_len, key->id, id_len);
+    }
+
+    size_t slot = hash & (index->bucket_count - 1);
+    entry->next = index->buckets[slot];
+    index->buckets[slot] = entry;
+
+    if (++index->count > index->bucket_count) {
+        index_grow(index);
+    }
+}
+
+static void index_remove_handle(object_index_t *index, CK_OBJECT_HANDLE handle)
+{
+    index->generation++;
+    for (size_t i=0; i<index->bucket_count; i++) {
+        index_entry_t **link = &index->buckets[i];
+        while (*link != NULL) {
+            index_entry_t *entry = *link;
+            if (entry->handle == handle) {
+                *link = entry->next;
+                free(entry);
+                index->count--;
+            } else {
+                link = &entry->next;
+            }
+        }
+    }
+}
+
+static void index_clear(object_index_t *index)
+{
+    index->generation++;
+    for (size_t i=0; i<index->bucket_count; i++) {
+        index_entry_t *entry = index->buckets[i];
+        while (entry != NULL) {
+            index_entry_t *next = entry->next;
+            free(entry);
+            entry = next;
+        }
+        index->buckets[i] = NULL;
+    }
+
+    index->count = 0;
+}
+
+static bool has_index(CK_FUNCTION_LIST_PTR func_list, CK_SLOT_ID slot_id)
+{
+    if (__atomic_load_n(&index_list, __ATOMIC_ACQUIRE) == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&index_lock);
+    bool found = find_index(func_list, slot_id) != NULL;
+    pthread_mutex_unlock(&index_lock);
+
+    return found;
+}
+
+void p11_index_add(session_obj_t *obj, CK_OBJECT_HANDLE handle)
+{
+    if (!has_index(obj->func_list, obj->slot_id)) {
+        return;
+    }
+
+    CK_OBJECT_CLASS class;
+    CK_BBOOL token = CK_FALSE;
+    CK_BYTE label[INDEX_VALUE_MAX];
+    CK_BYTE id[INDEX_VALUE_MAX];
+    CK_ATTRIBUTE attributes[] = {
+        {CKA_CLASS, &class, sizeof(class)},
+        {CKA_TOKEN, &token, sizeof(token)},
+        {CKA_LABEL, label, sizeof(label)},
+        {CKA_ID, id, sizeof(id)},
+    };
+
+    CK_RV rv;
+    rv = obj->func_list->C_GetAttributeValue(obj->session, handle, attributes, 4);
+    if (rv != CKR_OK || !token) {
+        /* Not indexed, a lookup will find it */
+        return;
+    }
+
+    index_key_t keys[] = {
+        {class, label, attributes[2].ulValueLen, NULL, INDEX_ABSENT},
+        {class, NULL, INDEX_ABSENT, id, attributes[3].ulValueLen},
+        {class, label, attributes[2].ulValueLen, id, attributes[3].ulValueLen},
+    };
+
+    pthread_mutex_lock(&index_lock);
+    object_index_t *index = find_index(obj->func_list, obj->slot_id);
+    if (index != NULL) {
+        for (size_t i=0; i<sizeof(keys)/sizeof(keys[0]); i++) {
+            index_put(index, &keys[i], handle);
+        }
+    }
+    pthread_mutex_unlock(&index_lock);
+}
+
+void p11_index_remove(session_obj_t *obj, CK_OBJECT_HANDLE handle)
+{
+    if (__atomic_load_n(&index_list, __ATOMIC_ACQUIRE) == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&index_lock);
+    object_index_t *index = find_index(obj->func_list, obj->slot_id);
+    if (index != NULL) {
+        index_remove_handle(index, handle);
+    }
+    pthread_mutex_unlock(&index_lock);
+}
+
+void p11_index_invalidate(CK_FUNCTION_LIST_PTR func_list, CK_SLOT_ID slot_id)
+{
+    if (__atomic_load_n(&index_list, __ATOMIC_ACQUIRE) == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&index_lock);
+    object_index_t *index = find_index(func_list, slot_id);
+    if (index != NULL) {
+        index_clear(index);
+    }
+    pthread_mutex_unlock(&index_lock);
+}
+
+void p11_index_invalidate_all(CK_FUNCTION_LIST_PTR func_list)
+{
+    if (__atomic_load_n(&index_list, __ATOMIC_ACQUIRE) == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&index_lock);
+    for (object_index_t *index = index_list; index != NULL; index = index->next) {
+        if (index->func_list == func_list) {
+            index_clear(index);
+        }
+    }
+    pthread_mutex_unlock(&index_lock);
+}
+
+static void object_index_release(object_index_obj_t *obj)
+{
+    if (obj->index == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&index_lock);
+    object_index_t *index = obj->index;
+    obj->index = NULL;
+
+    if (--index->refcount == 0) {
+        object_index_t **link = &index_list;
+        while (*link != index) {
+            link = &(*link)->next;
+        }
+        __atomic_store_n(link, index->next, __ATOMIC_RELEASE);
+
+        index_clear(index);
+        free(index->buckets);
+        free(index);
+    }
+    pthread_mutex_unlock(&index_lock);
+}
+
+/* Abstract Object functions */
+static int object_index_gc_fn(void *data, size_t len) {
+    object_index_obj_t *obj = (object_index_obj_t *)data;
+    object_index_release(obj);
+
+    return 0;
+}
+
+static int object_index_get_fn(void *data, Janet key, Janet *out) {
+    (void)data;
+    if (!janet_checktype(key, JANET_KEYWORD)) {
+        return 0;
+    }
+
+    return janet_getmethod(janet_unwrap_keyword(key), object_index_methods, out);
+}
+
+JanetAbstractType *get_object_index_obj_type(void) {
+    return &object_index_obj_type;
+}
+
+static object_index_t *get_object_index(const Janet *argv, int32_t n)
+{
+    object_index_obj_t *obj = janet_getabstract(argv, n, get_object_index_obj_type());
+    if (obj->index == NULL) {
+        janet_panic("object index is closed");
+    }
+
+    return obj->index;
+}
+
+/* Reads `{:CKA_CLASS class :CKA_LABEL label :CKA_ID id}` into `key` */
+static void get_index_key(JanetStruct query, index_key_t *key)
+{
+    Janet class = janet_wrap_nil();
+    Janet label = janet_wrap_nil();
+    Janet id = janet_wrap_nil();
+
+    int32_t capacity = janet_struct_capacity(query);
+    for (int32_t i=0; i<capacity; i++) {
+        if (janet_checktype(query[i].key, JANET_NIL))
+            continue;
+
+        if (janet_keyeq(query[i].key, "CKA_CLASS")) {
+            class = query[i].value;
+        } else if (janet_keyeq(query[i].key, "CKA_LABEL")) {
+            label = query[i].value;
+        } else if (janet_keyeq(query[i].key, "CKA_ID")) {
+            id = query[i].value;
+        } else {
+            janet_panicf("expected :CKA_CLASS, :CKA_LABEL or :CKA_ID, got %v",
+                         query[i].key);
+        }
+    }
+
+    if (janet_checktype(class, JANET_KEYWORD)) {
+        key->class = get_type_value(janet_unwrap_keyword(class));
+    } else if (janet_checktype(class, JANET_NUMBER)) {
+        key->class = (CK_OBJECT_CLASS)janet_unwrap_number(class);
+    } else {
+        janet_panicf("expected :CKA_CLASS keyword or number, got %v", class);
+    }
+
+    if (janet_checktype(label, JANET_NIL) && janet_checktype(id, JANET_NIL)) {
+        janet_panic("expected :CKA_LABEL or :CKA_ID");
+    }
+
+    key->label = NULL;
+    key->label_len = INDEX_ABSENT;
+    if (!janet_checktype(label, JANET_NIL)) {
+        JanetByteView view = janet_getbytes(&label, 0);
+        key->label = view.bytes;
+        key->label_len = (CK_ULONG)view.len;
+    }
+
+    key->id = NULL;
+    key->id_len = INDEX_ABSENT;
+    if (!janet_checktype(id, JANET_NIL)) {
+        JanetByteView view = janet_getbytes(&id, 0);
+        key->id = view.bytes;
+        key->id_len = (CK_ULONG)view.len;
+    }
+}
+
+/* Finds the first token object matching `key` */
+static Janet find_object(session_obj_t *obj, const index_key_t *key, CK_OBJECT_HANDLE *handle)
+{
+    CK_OBJECT_CLASS class = key->class;
+    CK_BBOOL token = CK_TRUE;
+    CK_ATTRIBUTE p_template[4] = {
+        {CKA_CLASS, &class, sizeof(class)},
+        {CKA_TOKEN, &token, sizeof(token)},
+    };
+    CK_ULONG count = 2;
+
+    if (key->label_len != INDEX_ABSENT) {
+        p_template[count].type = CKA_LABEL;
+        p_template[count].pValue = (CK_VOID_PTR)key->label;
+        p_template[count].ulValueLen = key->label_len;
+        count++;
+    }
+    if (key->id_len != INDEX_ABSENT) {
+        p_template[count].type = CKA_ID;
+        p_template[count].pValue = (CK_VOID_PTR)key->id;
+        p_template[count].ulValueLen = key->id_len;
+        count++;
+    }
+
+    CK_ULONG found = 0;
+    CK_RV rv;
+    rv = obj->func_list->C_FindObjectsInit(obj->session, p_template, count);
+    PKCS11_ASSERT(rv, "C_FindObjectsInit");
+
+    rv = obj->func_list->C_FindObjects(obj->session, handle, 1, &found);
+    if (rv != CKR_OK) {
+        obj->func_list->C_FindObjectsFinal(obj->session);
+        PKCS11_ASSERT(rv, "C_FindObjects");
+    }
+
+    rv = obj->func_list->C_FindObjectsFinal(obj->session);
+    PKCS11_ASSERT(rv, "C_FindObjectsFinal");
+
+    return found ? janet_wrap_number((double)*handle) : janet_wrap_nil();
+}
+
+JANET_FN(p11_object_index,
+         "(object-index p11-obj slot-id)",
+         "Opens the object index of the token in `slot-id`, creating it if no "
+         "index is open for the token yet. The index maps the class, label "
+         "and id of token objects to their handle and is filled as lookups "
+         "are made with `object-index-find`. Returns an `object-index-obj`. "
+         "The index is dropped once every `object-index-obj` of the token is "
+         "closed or garbage collected.")
+{
+    janet_fixarity(argc, 2);
+
+    p11_obj_t *p11 = janet_getabstract(argv, 0, get_p11_obj_type());
+    CK_SLOT_ID slot_id = janet_getinteger64(argv, 1);
+
+    object_index_obj_t *obj = janet_abstract(get_object_index_obj_type(),
+                                             sizeof(object_index_obj_t));
+    obj->index = NULL;
+
+    pthread_mutex_lock(&index_lock);
+    object_index_t *index = find_index(p11->func_list, slot_id);
+    if (index == NULL) {
+        index = calloc(1, sizeof(object_index_t));
+        if (index != NULL) {
+            index->buckets = calloc(INDEX_INITIAL_BUCKETS, sizeof(index_entry_t *));
+            if (index->buckets == NULL) {
+                free(index);
+                index = NULL;
+            }
+        }
+        if (index == NULL) {
+            pthread_mutex_unlock(&index_lock);
+            janet_panic("Out of memory");
+        }
+
+        index->func_list = p11->func_list;
+        index->slot_id = slot_id;
+        index->bucket_count = INDEX_INITIAL_BUCKETS;
+        index->next = index_list;
+        __atomic_store_n(&index_list, index, __ATOMIC_RELEASE);
+    }
+    index->refcount++;
+    obj->index = index;
+    pthread_mutex_unlock(&index_lock);
+
+    return janet_wrap_abstract(obj);
+}
+
+JANET_FN(p11_object_index_find,
+         "(object-index-find object-index-obj session-obj query)",
+         "Returns the handle of a token object matching `query`, or nil if "
+         "there is none. `query` is a struct of `:CKA_CLASS` and at least one "
+         "of `:CKA_LABEL` and `:CKA_ID`, e.g. `{:CKA_CLASS :CKO_SECRET_KEY "
+         ":CKA_LABEL \"key 1\"}`. The index is searched first. On a miss, the "
+         "token is searched through `session-obj`, which must be a session "
+         "of the token of the index, and the result is added to the index. "
+         "If several objects match, one of them is returned.")
+{
+    janet_fixarity(argc, 3);
+
+    object_index_t *index = get_object_index(argv, 0);
+    session_obj_t *session = janet_getabstract(argv, 1, get_session_obj_type());
+    JanetStruct query = janet_getstruct(argv, 2);
+
+    if (session->func_list != index->func_list || session->slot_id != index->slot_id) {
+        janet_panic("session does not belong to the token of the index");
+    }
+
+    index_key_t key;
+    get_index_key(query, &key);
+    uint64_t hash = key_hash(&key);
+
+    pthread_mutex_lock(&index_lock);
+    index_entry_t *entry = index_get(index, &key, hash);
+    CK_OBJECT_HANDLE handle = entry ? entry->handle : 0;
+    uint64_t generation = index->generation;
+    if (entry != NULL) {
+        index->hits++;
+    } else {
+        index->misses++;
+    }
+    pthread_mutex_unlock(&index_lock);
+
+    if (entry != NULL) {
+        return janet_wrap_number((double)handle);
+    }
+
+    Janet ret = find_object(session, &key, &handle);
+    if (!janet_checktype(ret, JANET_NIL)) {
+        /* The object may have been destroyed or invalidated while searching */
+        pthread_mutex_lock(&index_lock);
+        if (index->generation == generation) {
+            index_put(index, &key, handle);
+        }
+        pthread_mutex_unlock(&index_lock);
+    }
+
+    return ret;
+}
+
+JANET_FN(p11_object_index_refresh,
+         "(object-index-refresh object-index-obj)",
+         "Clears the index, e.g. after objects were changed by another "
+         "application. Lookups fill it again.")
+{
+    janet_fixarity(argc, 1);
+
+    object_index_t *index = get_object_index(argv, 0);
+
+    pthread_mutex_lock(&index_lock);
+    index_clear(index);
+    pthread_mutex_unlock(&index_lock);
+
+    return janet_wrap_nil();
+}
+
+JANET_FN(p11_object_index_stats,
+         "(object-index-stats object-index-obj)",
+         "Returns a struct of `:entries`, the number of keys in the index, "
+         "`:hits`, the number of lookups answered from the index, and "
+         "`:misses`, the number of lookups that searched the token.")
+{
+    janet_fixarity(argc, 1);
+
+    object_index_t *index = get_object_index(argv, 0);
+
+    pthread_mutex_lock(&index_lock);
+    size_t entries = index->count;
+    uint64_t hits = index->hits;
+    uint64_t misses = index->misses;
+    pthread_mutex_unlock(&index_lock);
+
+    JanetKV *st = janet_struct_begin(3);
+    janet_struct_put(st, janet_ckeywordv("entries"), janet_wrap_number((double)entries));
+    janet_struct_put(st, janet_ckeywordv("hits"), janet_wrap_number((double)hits));
+    janet_struct_put(st, janet_ckeywordv("misses"), janet_wrap_number((double)misses));
+
+    return janet_wrap_struct(janet_struct_end(st));
+}
+
+JANET_FN(p11_object_index_close,
+         "(object-index-close object-index-obj)",
+         "Closes an `object-index-obj`. The index of the token is dropped "
+         "when no other `object-index-obj` refers to it.")
+{
+    janet_fixarity(argc, 1);
+
+    object_index_obj_t *obj = janet_getabstract(argv, 0, get_object_index_obj_type());
+    object_index_release(obj);
+
+    return janet_wrap_nil();
+}
+
+void submod_object_index(JanetTable *env) {
+    JanetRegExt cfuns[] = {
+        JANET_REG("object-index", p11_object_index),
+        JANET_REG("object-index-find", p11_object_index_find),
+        JANET_REG("object-index-refresh", p11_object_index_refresh),
+        JANET_REG("object-index-stats", p11_object_index_stats),
+        JANET_REG("object-index-close", p11_object_index_close),
+        JANET_REG_END
+    };
+    janet_cfuns_ext(env, "pkcs11", cfuns);
+    janet_register_abstract_type(get_object_index_obj_type());
+}
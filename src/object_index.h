@@ -0,0 +1,21 @@
+/*
+ * Copyright (c) 2024, Janet-pkcs11 Seungki Kim
+ *
+ * Janet-pkcs11 is released under the MIT License, see the LICENSE file.
+ */
+
+#ifndef OBJECT_INDEX_H
+#define OBJECT_INDEX_H
+
+#include "main.h"
+
+/*
+ * Hooks keeping the object index of a token up to date. They do nothing
+ * unless an index was opened for the token with `object-index`.
+ */
+void p11_index_add(session_obj_t *obj, CK_OBJECT_HANDLE handle);
+void p11_index_remove(session_obj_t *obj, CK_OBJECT_HANDLE handle);
+void p11_index_invalidate(CK_FUNCTION_LIST_PTR func_list, CK_SLOT_ID slot_id);
+void p11_index_invalidate_all(CK_FUNCTION_LIST_PTR func_list);
+
+#endif /* OBJECT_INDEX_H */
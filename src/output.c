@@ -0,0 +1,524 @@
+/*
+ * Copyright (c) 2024, Janet-pkcs11 Seungki Kim
+ *
+ * Janet-pkcs11 is released under the MIT License, see the LICENSE file.
+ */
+
+#include "main.h"
+#include "error.h"
+#include "attribute.h"
+#include "utils.h"
+#include "output.h"
+
+/*
+ * Output buffer sizing
+ *
+ * Instead of asking the provider for the output length before every call,
+ * the output buffer is allocated from a guess and the provider is called
+ * once. The length query is only made when the provider answers
+ * CKR_BUFFER_TOO_SMALL. The guess comes from the mechanism (digest and MAC
+ * sizes, maximum signature sizes, block padding) and from the length of
+ * the previous result for the same operation, mechanism and key.
+ */
+
+/* Extra room for padding, tags and partial blocks held by the provider */
+#define OUTPUT_SLACK 64
+/* Wrapped keys, e.g. an RSA-4096 private key wrapped with AES */
+#define OUTPUT_WRAP_DEFAULT 4096
+/* Signatures and digests of unknown mechanisms */
+#define OUTPUT_DEFAULT 512
+
+static uint64_t output_calls = 0;
+static uint64_t output_fallbacks = 0;
+
+/*
+ * Returns the output length of `mechanism`, or 0 when it depends on the
+ * input. When the length depends on the key, `key_sized` is set and the
+ * largest length in common use is returned.
+ */
+static CK_ULONG mechanism_output_len(CK_MECHANISM_TYPE mechanism, bool *key_sized)
+{
+    *key_sized = false;
+
+    switch (mechanism) {
+        case CKM_MD5:
+        case CKM_MD5_HMAC:
+        case CKM_AES_MAC:
+        case CKM_AES_MAC_GENERAL:
+        case CKM_AES_CMAC:
+        case CKM_AES_CMAC_GENERAL:
+            return 16;
+        case CKM_DES3_MAC:
+        case CKM_DES3_CMAC:
+            return 8;
+        case CKM_SHA_1:
+        case CKM_SHA_1_HMAC:
+        case CKM_RIPEMD160:
+            return 20;
+        case CKM_SHA224:
+        case CKM_SHA224_HMAC:
+        case CKM_SHA512_224:
+        case CKM_SHA512_224_HMAC:
+        case CKM_SHA3_224:
+        case CKM_SHA3_224_HMAC:
+            return 28;
+        case CKM_SHA256:
+        case CKM_SHA256_HMAC:
+        case CKM_SHA512_256:
+        case CKM_SHA512_256_HMAC:
+        case CKM_SHA3_256:
+        case CKM_SHA3_256_HMAC:
+            return 32;
+        case CKM_SHA384:
+        case CKM_SHA384_HMAC:
+        case CKM_SHA3_384:
+        case CKM_SHA3_384_HMAC:
+            return 48;
+        case CKM_SHA512:
+        case CKM_SHA512_HMAC:
+        case CKM_SHA3_512:
+        case CKM_SHA3_512_HMAC:
+            return 64;
+
+        /* RSA up to 4096 bits */
+        case CKM_RSA_PKCS:
+        case CKM_RSA_X_509:
+        case CKM_RSA_9796:
+        case CKM_RSA_PKCS_OAEP:
+        case CKM_RSA_PKCS_PSS:
+        case CKM_SHA1_RSA_PKCS:
+        case CKM_SHA224_RSA_PKCS:
+        case CKM_SHA256_RSA_PKCS:
+        case CKM_SHA384_RSA_PKCS:
+        case CKM_SHA512_RSA_PKCS:
+        case CKM_SHA1_RSA_PKCS_PSS:
+        case CKM_SHA224_RSA_PKCS_PSS:
+        case CKM_SHA256_RSA_PKCS_PSS:
+        case CKM_SHA384_RSA_PKCS_PSS:
+        case CKM_SHA512_RSA_PKCS_PSS:
+            *key_sized = true;
+            return 512;
+        /* ECDSA up to P-521 */
+        case CKM_ECDSA:
+        case CKM_ECDSA_SHA1:
+        case CKM_ECDSA_SHA224:
+        case CKM_ECDSA_SHA256:
+        case CKM_ECDSA_SHA384:
+        case CKM_ECDSA_SHA512:
+            *key_sized = true;
+            return 132;
+        /* Ed448 */
+        case CKM_EDDSA:
+            *key_sized = true;
+            return 114;
+        /* DSA up to N = 256 */
+        case CKM_DSA:
+        case CKM_DSA_SHA1:
+        case CKM_DSA_SHA224:
+        case CKM_DSA_SHA256:
+        case CKM_DSA_SHA384:
+        case CKM_DSA_SHA512:
+            *key_sized = true;
+            return 64;
+        default:
+            return 0;
+    }
+}
+
+static p11_output_hint_t *cache_slot(session_obj_t *obj, p11_output_op_t op,
+                                     CK_MECHANISM_TYPE mechanism, CK_OBJECT_HANDLE key)
+{
+    size_t index = ((size_t)op * 31 + (size_t)mechanism * 17 + (size_t)key)
+        % P11_OUTPUT_CACHE_SIZE;
+
+    return &obj->output_cache[index];
+}
+
+/* Called by the *-init functions to select the hint of the new operation. */
+void p11_output_hint_init(session_obj_t *obj, p11_output_op_t op,
+                          CK_MECHANISM_TYPE mechanism, CK_OBJECT_HANDLE key)
+{
+    p11_output_hint_t *hint = &obj->output_hints[op];
+    p11_output_hint_t *cached = cache_slot(obj, op, mechanism, key);
+
+    hint->op = op;
+    hint->mechanism = mechanism;
+    hint->key = key;
+    hint->len = 0;
+
+    if (cached->len && cached->op == op &&
+        cached->mechanism == mechanism && cached->key == key) {
+        hint->len = cached->len;
+    }
+}
+
+/* Remembers the length of a result for the next guess. */
+void p11_output_hint_update(session_obj_t *obj, p11_output_op_t op, CK_ULONG len)
+{
+    p11_output_hint_t *hint = &obj->output_hints[op];
+    if (len == 0) {
+        return;
+    }
+
+    hint->len = len;
+    *cache_slot(obj, op, hint->mechanism, hint->key) = *hint;
+}
+
+CK_ULONG p11_output_guess(session_obj_t *obj, p11_output_op_t op, CK_ULONG in_len)
+{
+    p11_output_hint_t *hint = &obj->output_hints[op];
+    bool key_sized;
+    CK_ULONG len = mechanism_output_len(hint->mechanism, &key_sized);
+
+    switch (op) {
+        case P11_OUTPUT_DECRYPT:
+        case P11_OUTPUT_VERIFY_RECOVER:
+            /* The recovered data is never longer than the input */
+            return in_len + OUTPUT_SLACK;
+        case P11_OUTPUT_ENCRYPT:
+            if (key_sized) {
+                return hint->len ? hint->len : len;
+            }
+            return in_len + OUTPUT_SLACK;
+        case P11_OUTPUT_WRAP:
+            return hint->len > OUTPUT_WRAP_DEFAULT ? hint->len : OUTPUT_WRAP_DEFAULT;
+        default:
+            if (len && !key_sized) {
+                return len;
+            }
+            if (hint->len) {
+                return hint->len;
+            }
+            return len ? len : OUTPUT_DEFAULT;
+    }
+}
+
+void p11_output_count(bool fallback)
+{
+    __atomic_fetch_add(&output_calls, 1, __ATOMIC_RELAXED);
+    if (fallback) {
+        __atomic_fetch_add(&output_fallbacks, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* Makes room for `len` bytes after `out->count`, keeping the content */
+static void output_reserve(p11_output_t *out, CK_ULONG len)
+{
+    if (len > (CK_ULONG)(INT32_MAX - out->count)) {
+        janet_panic("output is too large");
+    }
+
+    janet_buffer_ensure(out->buffer, out->count + (int32_t)len, 2);
+}
+
+/*
+ * Calls `fn` with an output buffer of `guess` bytes at `out->count`.
+ * On CKR_BUFFER_TOO_SMALL the buffer is grown to the required length and
+ * `fn` is called again. Returns the rv of the last call, `out` is only
+ * extended on CKR_OK.
+ */
+CK_RV p11_output_call(session_obj_t *obj, p11_output_op_t op, CK_ULONG guess,
+                      p11_output_fn fn, const void *ctx, p11_output_t *out)
+{
+    int32_t start = out->count;
+    CK_ULONG capacity = guess ? guess : 1;
+    CK_ULONG len = capacity;
+
+    output_reserve(out, capacity);
+
+    CK_RV rv;
+    rv = fn(obj, ctx, out->buffer->data + start, &len);
+    p11_output_count(rv == CKR_BUFFER_TOO_SMALL);
+
+    if (rv == CKR_BUFFER_TOO_SMALL) {
+        /* Not every provider returns the required length with the error */
+        if (len <= capacity) {
+            len = 0;
+            rv = fn(obj, ctx, NULL_PTR, &len);
+            if (rv != CKR_OK) {
+                return rv;
+            }
+        }
+
+        output_reserve(out, len);
+        rv = fn(obj, ctx, out->buffer->data + start, &len);
+    }
+
+    if (rv == CKR_OK) {
+        out->count = start + (int32_t)len;
+        out->buffer->count = out->count;
+        p11_output_hint_update(obj, op, len);
+    }
+
+    return rv;
+}
+
+typedef struct data_out_ctx {
+    p11_data_out_fn fn;
+    CK_BYTE_PTR in;
+    CK_ULONG in_len;
+} data_out_ctx_t;
+
+static CK_RV data_out(session_obj_t *obj, const void *ctx,
+                      CK_BYTE_PTR out, CK_ULONG_PTR out_len)
+{
+    const data_out_ctx_t *c = ctx;
+    return c->fn(obj->session, c->in, c->in_len, out, out_len);
+}
+
+CK_RV p11_output_data(session_obj_t *obj, p11_output_op_t op, p11_data_out_fn fn,
+                      CK_BYTE_PTR in, CK_ULONG in_len, p11_output_t *out)
+{
+    data_out_ctx_t ctx = {fn, in, in_len};
+    CK_ULONG guess = p11_output_guess(obj, op, in_len);
+
+    return p11_output_call(obj, op, guess, data_out, &ctx, out);
+}
+
+static CK_RV final_out(session_obj_t *obj, const void *ctx,
+                       CK_BYTE_PTR out, CK_ULONG_PTR out_len)
+{
+    const p11_final_out_fn *fn = ctx;
+    return (*fn)(obj->session, out, out_len);
+}
+
+CK_RV p11_output_final(session_obj_t *obj, p11_output_op_t op, p11_final_out_fn fn,
+                       p11_output_t *out)
+{
+    CK_ULONG guess = p11_output_guess(obj, op, 0);
+
+    return p11_output_call(obj, op, guess, final_out, &fn, out);
+}
+
+/*
+ * Output functions take an optional buffer at argv[n] followed by an
+ * optional mode, `:append` (the default) or `:overwrite`. The provider
+ * writes into that buffer directly, from its start with `:overwrite`, and
+ * the content is only replaced once the call succeeds. Without a buffer,
+ * a fresh one is used and the output is returned as a string.
+ */
+p11_output_t p11_output_buffer(int32_t argc, const Janet *argv, int32_t n)
+{
+    if (argc <= n || janet_checktype(argv[n], JANET_NIL)) {
+        if (argc > n + 1) {
+            janet_panic("mode requires an output buffer");
+        }
+        return (p11_output_t){janet_buffer(0), 0};
+    }
+
+    JanetBuffer *out = janet_getbuffer(argv, n);
+
+    /* The input would move or be cleared under the provider */
+    for (int32_t i=1; i<n; i++) {
+        if (janet_checktype(argv[i], JANET_BUFFER) && janet_unwrap_buffer(argv[i]) == out) {
+            janet_panicf("bad slot #%d, the output buffer can not be an input", n);
+        }
+    }
+
+    int32_t count = out->count;
+    if (argc > n + 1) {
+        const uint8_t *mode = janet_getkeyword(argv, n + 1);
+        if (janet_cstrcmp(mode, "overwrite") == 0) {
+            count = 0;
+        } else if (janet_cstrcmp(mode, "append") != 0) {
+            janet_panicf("expected :append or :overwrite, got %v", argv[n + 1]);
+        }
+    }
+
+    return (p11_output_t){out, count};
+}
+
+/* Returns the caller's buffer, or the output in a string */
+Janet p11_output_wrap(int32_t argc, const Janet *argv, int32_t n, p11_output_t *out)
+{
+    if (argc <= n || janet_checktype(argv[n], JANET_NIL)) {
+        return janet_stringv(out->buffer->data, out->count);
+    }
+
+    /* Replaces the content even when no call wrote into it, e.g. no pieces */
+    out->buffer->count = out->count;
+
+    return janet_wrap_buffer(out->buffer);
+}
+
+/*
+ * Update calls also take an array or tuple of byte sequences at argv[n],
+ * processed piece by piece in one call. Every piece is checked before the
+ * first one is passed to the provider, so a bad piece does not leave the
+ * operation half-fed.
+ */
+static JanetView update_pieces(const Janet *argv, int32_t n)
+{
+    JanetView pieces = janet_getindexed(argv, n);
+    for (int32_t i=0; i<pieces.len; i++) {
+        if (!janet_checktypes(pieces.items[i], JANET_TFLAG_BYTES)) {
+            janet_panicf("bad piece #%d, expected bytes, got %v", i, pieces.items[i]);
+        }
+    }
+
+    return pieces;
+}
+
+void p11_update_data(session_obj_t *obj, const Janet *argv, int32_t n,
+                     p11_update_fn fn, const char *desc)
+{
+    JanetView pieces = update_pieces(argv, n);
+
+    for (int32_t i=0; i<pieces.len; i++) {
+        JanetByteView data = janet_getbytes(pieces.items, i);
+
+        CK_RV rv;
+        rv = fn(obj->session, (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len);
+        if (rv != CKR_OK) {
+            janet_panicf("%s, piece #%d, rv:%s", desc, i, get_pkcs11_error(rv));
+        }
+    }
+}
+
+/* Like p11_update_data, and appends the output of the pieces to `out` */
+void p11_output_update(session_obj_t *obj, p11_output_op_t op,
+                       const Janet *argv, int32_t n,
+                       p11_data_out_fn fn, const char *desc, p11_output_t *out)
+{
+    JanetView pieces = update_pieces(argv, n);
+    for (int32_t i=0; i<pieces.len; i++) {
+        if (janet_checktype(pieces.items[i], JANET_BUFFER) &&
+            janet_unwrap_buffer(pieces.items[i]) == out->buffer) {
+            janet_panicf("bad piece #%d, the output buffer can not be an input", i);
+        }
+    }
+
+    for (int32_t i=0; i<pieces.len; i++) {
+        JanetByteView data = janet_getbytes(pieces.items, i);
+
+        CK_RV rv;
+        rv = p11_output_data(obj, op, fn, (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len, out);
+        if (rv != CKR_OK) {
+            janet_panicf("%s, piece #%d, rv:%s", desc, i, get_pkcs11_error(rv));
+        }
+    }
+}
+
+/*
+ * Runs `init_fn` of session argv[0] with the mechanism argv[1] and the key
+ * argv[2], then `fn` on the data argv[3]. argv[4] and argv[5] are the
+ * optional output buffer and mode.
+ */
+Janet p11_output_once(session_obj_t *obj, int32_t argc, Janet *argv, p11_output_op_t op,
+                      p11_init_fn init_fn, const char *init_desc,
+                      p11_data_out_fn fn, const char *desc)
+{
+    CK_MECHANISM_PTR p_mechanism = janet_get_p11_mechanism(argv, 1);
+    CK_OBJECT_HANDLE key_handle = janet_getnumber(argv, 2);
+    JanetByteView data = janet_getbytes(argv, 3);
+    p11_output_t out = p11_output_buffer(argc, argv, 4);
+
+    CK_RV rv;
+    rv = init_fn(obj->session, p_mechanism, key_handle);
+    PKCS11_ASSERT(rv, init_desc);
+
+    p11_output_hint_init(obj, op, p_mechanism->mechanism, key_handle);
+
+    rv = p11_output_data(obj, op, fn, (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len, &out);
+    PKCS11_ASSERT(rv, desc);
+
+    return p11_output_wrap(argc, argv, 4, &out);
+}
+
+/*
+ * Runs `init_fn` and `fn` of session argv[0] for every payload of argv[3] with the mechanism
+ * argv[1] and the key argv[2]. argv[4], if given, holds the parameter of
+ * the mechanism per payload, or nil to keep the one of argv[1]. Outputs
+ * are packed into one buffer, and [buffer offsets] is returned where
+ * payload i maps to bytes (offsets i) to (offsets (+ i 1)) of the buffer.
+ */
+Janet p11_output_batch(session_obj_t *obj, int32_t argc, Janet *argv, p11_output_op_t op,
+                       p11_init_fn init_fn, const char *init_desc,
+                       p11_data_out_fn fn, const char *desc)
+{
+    CK_OBJECT_HANDLE key_handle = janet_getnumber(argv, 2);
+    JanetView payloads = janet_getindexed(argv, 3);
+
+    JanetView params = {NULL, 0};
+    if (argc == 5 && !janet_checktype(argv[4], JANET_NIL)) {
+        params = janet_getindexed(argv, 4);
+        if (params.len != payloads.len) {
+            janet_panicf("expected %d parameters, got %d", payloads.len, params.len);
+        }
+    }
+
+    CK_MECHANISM mechanism = *janet_get_p11_mechanism(argv, 1);
+    CK_VOID_PTR default_parameter = mechanism.pParameter;
+    CK_ULONG default_parameter_len = mechanism.ulParameterLen;
+
+    p11_output_hint_init(obj, op, mechanism.mechanism, key_handle);
+
+    p11_output_t out = {janet_buffer(0), 0};
+    Janet *offsets = janet_tuple_begin(payloads.len + 1);
+    offsets[0] = janet_wrap_number(0);
+
+    for (int32_t i=0; i<payloads.len; i++) {
+        JanetByteView data = janet_getbytes(payloads.items, i);
+
+        mechanism.pParameter = default_parameter;
+        mechanism.ulParameterLen = default_parameter_len;
+        if (params.items && !janet_checktype(params.items[i], JANET_NIL)) {
+            JanetByteView param = janet_getbytes(params.items, i);
+            mechanism.pParameter = (CK_VOID_PTR)param.bytes;
+            mechanism.ulParameterLen = (CK_ULONG)param.len;
+        }
+
+        CK_RV rv;
+        rv = init_fn(obj->session, &mechanism, key_handle);
+        if (rv != CKR_OK) {
+            janet_panicf("%s, payload #%d, rv:%s", init_desc, i, get_pkcs11_error(rv));
+        }
+
+        rv = p11_output_data(obj, op, fn, (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len, &out);
+        if (rv != CKR_OK) {
+            janet_panicf("%s, payload #%d, rv:%s", desc, i, get_pkcs11_error(rv));
+        }
+
+        offsets[i + 1] = janet_wrap_number((double)out.count);
+    }
+
+    Janet *tup = janet_tuple_begin(2);
+    tup[0] = janet_wrap_buffer(out.buffer);
+    tup[1] = janet_wrap_tuple(janet_tuple_end(offsets));
+
+    return janet_wrap_tuple(janet_tuple_end(tup));
+}
+
+JANET_FN(p11_output_stats,
+         "(output-stats &opt :reset)",
+         "Returns a struct of `:calls`, the number of crypto calls whose output "
+         "buffer was sized by a guess, and `:fallbacks`, the number of those "
+         "calls that needed a length query because the guess was too small. "
+         "With `:reset`, the counters are cleared after reading.")
+{
+    janet_arity(argc, 0, 1);
+
+    bool reset = IS_ARG_KEYWORD(0, "reset");
+    uint64_t calls, fallbacks;
+    if (reset) {
+        calls = __atomic_exchange_n(&output_calls, 0, __ATOMIC_RELAXED);
+        fallbacks = __atomic_exchange_n(&output_fallbacks, 0, __ATOMIC_RELAXED);
+    } else {
+        calls = __atomic_load_n(&output_calls, __ATOMIC_RELAXED);
+        fallbacks = __atomic_load_n(&output_fallbacks, __ATOMIC_RELAXED);
+    }
+
+    JanetKV *st = janet_struct_begin(2);
+    janet_struct_put(st, janet_ckeywordv("calls"), janet_wrap_number((double)calls));
+    janet_struct_put(st, janet_ckeywordv("fallbacks"), janet_wrap_number((double)fallbacks));
+
+    return janet_wrap_struct(janet_struct_end(st));
+}
+
+void submod_output(JanetTable *env) {
+    JanetRegExt cfuns[] = {
+        JANET_REG("output-stats", p11_output_stats),
+        JANET_REG_END
+    };
+    janet_cfuns_ext(env, "pkcs11", cfuns);
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2024, Janet-pkcs11 Seungki Kim
+ *
+ * Janet-pkcs11 is released under the MIT License, see the LICENSE file.
+ */
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include "main.h"
+
+/* Output functions sharing the C_Encrypt signature */
+typedef CK_RV (*p11_data_out_fn)(CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG,
+                                 CK_BYTE_PTR, CK_ULONG_PTR);
+
+/* Output functions sharing the C_EncryptFinal signature */
+typedef CK_RV (*p11_final_out_fn)(CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG_PTR);
+
+/* Update functions sharing the C_DigestUpdate signature */
+typedef CK_RV (*p11_update_fn)(CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG);
+
+/* Init functions sharing the C_EncryptInit signature */
+typedef CK_RV (*p11_init_fn)(CK_SESSION_HANDLE, CK_MECHANISM_PTR, CK_OBJECT_HANDLE);
+
+/*
+ * Output of a call into `buffer`, written from `count` on. The count of
+ * `buffer` only follows `count` once a provider call succeeds.
+ */
+typedef struct p11_output {
+    JanetBuffer *buffer;
+    int32_t count;
+} p11_output_t;
+
+/* Generic output function, `ctx` holds the inputs of the call */
+typedef CK_RV (*p11_output_fn)(session_obj_t *obj, const void *ctx,
+                               CK_BYTE_PTR out, CK_ULONG_PTR out_len);
+
+void p11_output_hint_init(session_obj_t *obj, p11_output_op_t op,
+                          CK_MECHANISM_TYPE mechanism, CK_OBJECT_HANDLE key);
+void p11_output_hint_update(session_obj_t *obj, p11_output_op_t op, CK_ULONG len);
+CK_ULONG p11_output_guess(session_obj_t *obj, p11_output_op_t op, CK_ULONG in_len);
+void p11_output_count(bool fallback);
+
+CK_RV p11_output_call(session_obj_t *obj, p11_output_op_t op, CK_ULONG guess,
+                      p11_output_fn fn, const void *ctx, p11_output_t *out);
+CK_RV p11_output_data(session_obj_t *obj, p11_output_op_t op, p11_data_out_fn fn,
+                      CK_BYTE_PTR in, CK_ULONG in_len, p11_output_t *out);
+CK_RV p11_output_final(session_obj_t *obj, p11_output_op_t op, p11_final_out_fn fn,
+                       p11_output_t *out);
+
+p11_output_t p11_output_buffer(int32_t argc, const Janet *argv, int32_t n);
+Janet p11_output_wrap(int32_t argc, const Janet *argv, int32_t n, p11_output_t *out);
+
+void p11_update_data(session_obj_t *obj, const Janet *argv, int32_t n,
+                     p11_update_fn fn, const char *desc);
+void p11_output_update(session_obj_t *obj, p11_output_op_t op,
+                       const Janet *argv, int32_t n,
+                       p11_data_out_fn fn, const char *desc, p11_output_t *out);
+
+Janet p11_output_once(session_obj_t *obj, int32_t argc, Janet *argv, p11_output_op_t op,
+                      p11_init_fn init_fn, const char *init_desc,
+                      p11_data_out_fn fn, const char *desc);
+Janet p11_output_batch(session_obj_t *obj, int32_t argc, Janet *argv, p11_output_op_t op,
+                       p11_init_fn init_fn, const char *init_desc,
+                       p11_data_out_fn fn, const char *desc);
+
+#endif /* OUTPUT_H */
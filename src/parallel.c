@@ -0,0 +1,406 @@
+/*
+ * Copyright (c) 2024, Janet-pkcs11 Seungki Kim
+ *
+ * Janet-pkcs11 is released under the MIT License, see the LICENSE file.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include "main.h"
+#include "error.h"
+#include "attribute.h"
+#include "object_index.h"
+
+#define PARALLEL_DEFAULT_THREADS 4
+#define PARALLEL_MAX_THREADS 64
+/* Stride used when no message answers the signature length query */
+#define PARALLEL_DEFAULT_STRIDE 512
+
+/*
+ * Parallel signing
+ *
+ * The messages are split into one contiguous shard per thread, and each
+ * thread signs its shard with its own session. A thread whose shard is
+ * empty steals the upper half of the remaining range of another shard, so
+ * a few slow messages do not hold back the whole batch. The calling thread
+ * is one of the workers and returns once every message is signed.
+ *
+ * Workers never touch Janet values. Message bytes are read in place while
+ * the calling thread waits, and signatures are written at a fixed stride
+ * into one native block, sized by the signature length the provider gives
+ * for the first message. A longer signature is kept in its own buffer.
+ */
+
+typedef struct sign_shard {
+    pthread_mutex_t lock;
+    int32_t begin;
+    int32_t end;
+} sign_shard_t;
+
+typedef struct sign_engine {
+    CK_FUNCTION_LIST_PTR func_list;
+    CK_MECHANISM_PTR mechanism;
+    CK_OBJECT_HANDLE key;
+    JanetByteView *messages;
+    CK_BYTE_PTR out;
+    CK_ULONG stride;
+    CK_BYTE_PTR *oversized;     /* signatures longer than the stride */
+    CK_ULONG *lens;
+    CK_RV *rvs;
+    sign_shard_t *shards;
+    int32_t shard_count;
+    bool per_item;
+    int failed;
+} sign_engine_t;
+
+typedef struct sign_worker {
+    sign_engine_t *engine;
+    int32_t id;
+    CK_SESSION_HANDLE session;
+    pthread_t thread;
+} sign_worker_t;
+
+/* Takes the next message of shard `id`, or steals from another shard */
+static bool take_message(sign_engine_t *engine, int32_t id, int32_t *index)
+{
+    sign_shard_t *own = &engine->shards[id];
+
+    pthread_mutex_lock(&own->lock);
+    bool found = own->begin < own->end;
+    if (found) {
+        *index = own->begin++;
+    }
+    pthread_mutex_unlock(&own->lock);
+
+    if (found) {
+        return true;
+    }
+
+    for (int32_t i=1; i<engine->shard_count; i++) {
+        sign_shard_t *victim = &engine->shards[(id + i) % engine->shard_count];
+        int32_t begin = 0;
+        int32_t end = 0;
+
+        pthread_mutex_lock(&victim->lock);
+        int32_t remaining = victim->end - victim->begin;
+        if (remaining > 0) {
+            end = victim->end;
+            begin = end - (remaining + 1) / 2;
+            victim->end = begin;
+        }
+        pthread_mutex_unlock(&victim->lock);
+
+        if (begin < end) {
+            pthread_mutex_lock(&own->lock);
+            own->begin = begin + 1;
+            own->end = end;
+            pthread_mutex_unlock(&own->lock);
+
+            *index = begin;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void sign_message(sign_engine_t *engine, CK_SESSION_HANDLE session, int32_t index)
+{
+    CK_FUNCTION_LIST_PTR f = engine->func_list;
+    JanetByteView msg = engine->messages[index];
+    CK_ULONG len = engine->stride;
+
+    CK_RV rv;
+    rv = f->C_SignInit(session, engine->mechanism, engine->key);
+    if (rv == CKR_OK) {
+        rv = f->C_Sign(session, (CK_BYTE_PTR)msg.bytes, (CK_ULONG)msg.len,
+                       engine->out + (size_t)index * engine->stride, &len);
+    }
+
+    if (rv == CKR_BUFFER_TOO_SMALL) {
+        /* Longer than the stride, the operation is still active */
+        CK_BYTE_PTR sig = malloc(len);
+        if (sig == NULL) {
+            /* Cancels the operation on providers supporting it, as in v3.0 */
+            rv = CKR_HOST_MEMORY;
+            f->C_SignInit(session, NULL_PTR, CK_INVALID_HANDLE);
+        } else {
+            rv = f->C_Sign(session, (CK_BYTE_PTR)msg.bytes, (CK_ULONG)msg.len, sig, &len);
+            if (rv == CKR_OK) {
+                engine->oversized[index] = sig;
+            } else {
+                free(sig);
+            }
+        }
+    }
+
+    engine->rvs[index] = rv;
+    engine->lens[index] = (rv == CKR_OK) ? len : 0;
+
+    if (rv != CKR_OK && !engine->per_item) {
+        __atomic_store_n(&engine->failed, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void *sign_worker_main(void *arg)
+{
+    sign_worker_t *worker = arg;
+    sign_engine_t *engine = worker->engine;
+    int32_t index;
+
+    while (!__atomic_load_n(&engine->failed, __ATOMIC_RELAXED) &&
+           take_message(engine, worker->id, &index)) {
+        sign_message(engine, worker->session, index);
+    }
+
+    return NULL;
+}
+
+static void close_sessions(CK_FUNCTION_LIST_PTR func_list, sign_worker_t *workers, int32_t count)
+{
+    for (int32_t i=0; i<count; i++) {
+        func_list->C_CloseSession(workers[i].session);
+    }
+}
+
+/*
+ * Signs the first messages on the calling thread until the provider gives
+ * the length of a signature, which is used as the stride of the output
+ * block. Returns the number of messages handled.
+ */
+static int32_t sign_first_messages(sign_engine_t *engine, CK_SESSION_HANDLE session,
+                                   int32_t count)
+{
+    CK_FUNCTION_LIST_PTR f = engine->func_list;
+    int32_t index = 0;
+    CK_ULONG len = 0;
+    CK_RV rv;
+
+    for (;;) {
+        JanetByteView msg = engine->messages[index];
+        len = 0;
+        rv = f->C_SignInit(session, engine->mechanism, engine->key);
+        if (rv == CKR_OK) {
+            rv = f->C_Sign(session, (CK_BYTE_PTR)msg.bytes, (CK_ULONG)msg.len, NULL_PTR, &len);
+        }
+
+        /* A failed C_Sign ends the operation, the next message can start */
+        if (rv == CKR_OK || !engine->per_item || index == count - 1) {
+            break;
+        }
+
+        engine->rvs[index++] = rv;
+    }
+
+    engine->stride = (rv == CKR_OK && len) ? len : PARALLEL_DEFAULT_STRIDE;
+    engine->out = janet_smalloc((size_t)count * engine->stride);
+
+    if (rv == CKR_OK) {
+        JanetByteView msg = engine->messages[index];
+        rv = f->C_Sign(session, (CK_BYTE_PTR)msg.bytes, (CK_ULONG)msg.len,
+                       engine->out + (size_t)index * engine->stride, &len);
+    }
+
+    engine->rvs[index] = rv;
+    engine->lens[index] = (rv == CKR_OK) ? len : 0;
+    if (rv != CKR_OK && !engine->per_item) {
+        engine->failed = 1;
+    }
+
+    return index + 1;
+}
+
+JANET_FN(p11_sign_parallel,
+         "(sign-parallel p11-obj slot-id mechanism key-handle messages &opt options)",
+         "Signs every message of `messages` with `key-handle` on several "
+         "threads, each with its own session on the token in `slot-id`. "
+         "Returns a tuple of signatures in the order of `messages`. The "
+         "calling thread is blocked until all messages are signed. "
+         "`key-handle` must be a token object. Requires a `p11-obj` created "
+         "with locking. `options` is a struct of:\n\n"
+         "* :threads - the number of threads, 4 by default.\n\n"
+         "* :user-type, :pin - log in before signing, see `login`. The "
+         "sessions are read-write if the user type is :so.\n\n"
+         "* :per-item - if true, the signature of a message that fails is "
+         "replaced by the error keyword instead of aborting the batch.")
+{
+    janet_arity(argc, 5, 6);
+
+    p11_obj_t *p11 = janet_getabstract(argv, 0, get_p11_obj_type());
+    CK_SLOT_ID slot_id = janet_getinteger64(argv, 1);
+    CK_MECHANISM_PTR p_mechanism = janet_get_p11_mechanism(argv, 2);
+    CK_OBJECT_HANDLE key_handle = (CK_OBJECT_HANDLE)janet_getnumber(argv, 3);
+    JanetView messages = janet_getindexed(argv, 4);
+
+    if (!p11->is_threaded) {
+        janet_panic("sign-parallel requires a p11-obj created with "
+                    ":os-locking or :custom-locking");
+    }
+
+    int32_t threads = PARALLEL_DEFAULT_THREADS;
+    bool per_item = false;
+    Janet user_type = janet_wrap_nil();
+    Janet pin = janet_wrap_nil();
+    if (argc == 6) {
+        JanetStruct options = janet_getstruct(argv, 5);
+        Janet value = janet_struct_get(options, janet_ckeywordv("threads"));
+        if (!janet_checktype(value, JANET_NIL)) {
+            threads = janet_getnat(&value, 0);
+        }
+        per_item = janet_truthy(janet_struct_get(options, janet_ckeywordv("per-item")));
+        user_type = janet_struct_get(options, janet_ckeywordv("user-type"));
+        pin = janet_struct_get(options, janet_ckeywordv("pin"));
+    }
+
+    if (threads < 1 || threads > PARALLEL_MAX_THREADS) {
+        janet_panicf("threads must be between 1 and %d", PARALLEL_MAX_THREADS);
+    }
+
+    if (messages.len == 0) {
+        return janet_wrap_tuple(janet_tuple_end(janet_tuple_begin(0)));
+    }
+
+    if (threads > messages.len) {
+        threads = messages.len;
+    }
+
+    sign_engine_t engine;
+    memset(&engine, 0, sizeof(engine));
+    engine.func_list = p11->func_list;
+    engine.mechanism = p_mechanism;
+    engine.key = key_handle;
+    engine.per_item = per_item;
+    engine.messages = janet_smalloc(messages.len * sizeof(JanetByteView));
+    engine.lens = janet_smalloc(messages.len * sizeof(CK_ULONG));
+    engine.rvs = janet_smalloc(messages.len * sizeof(CK_RV));
+    engine.oversized = janet_smalloc(messages.len * sizeof(CK_BYTE_PTR));
+
+    for (int32_t i=0; i<messages.len; i++) {
+        engine.messages[i] = janet_getbytes(messages.items, i);
+        engine.rvs[i] = CKR_FUNCTION_CANCELED;
+        engine.lens[i] = 0;
+        engine.oversized[i] = NULL;
+    }
+
+    bool login = !janet_checktype(pin, JANET_NIL);
+    CK_USER_TYPE p11_user_type = CKU_USER;
+    JanetByteView p11_pin = {NULL, 0};
+    if (login) {
+        if (!janet_checktype(user_type, JANET_NIL)) {
+            p11_user_type = get_user_type(&user_type, 0);
+        }
+        p11_pin = janet_getbytes(&pin, 0);
+    }
+
+    /* The SO can only log in when no read-only session exists */
+    CK_FLAGS flags = CKF_SERIAL_SESSION;
+    if (login && p11_user_type == CKU_SO) {
+        flags |= CKF_RW_SESSION;
+    }
+
+    sign_worker_t *workers = janet_smalloc(threads * sizeof(sign_worker_t));
+    for (int32_t i=0; i<threads; i++) {
+        workers[i].engine = &engine;
+        workers[i].id = i;
+
+        CK_RV rv;
+        rv = p11->func_list->C_OpenSession(slot_id, flags, NULL_PTR,
+                                           NULL_PTR, &workers[i].session);
+        if (rv != CKR_OK) {
+            close_sessions(p11->func_list, workers, i);
+            PKCS11_ASSERT(rv, "C_OpenSession");
+        }
+    }
+
+    if (login) {
+        /* The login state is shared by all sessions of an application */
+        CK_RV rv;
+        rv = p11->func_list->C_Login(workers[0].session, p11_user_type,
+                                     (CK_UTF8CHAR_PTR)p11_pin.bytes, (CK_ULONG)p11_pin.len);
+        if (rv != CKR_OK && rv != CKR_USER_ALREADY_LOGGED_IN) {
+            close_sessions(p11->func_list, workers, threads);
+            PKCS11_ASSERT(rv, "C_Login");
+        }
+
+        /* Private objects are now visible */
+        if (rv == CKR_OK) {
+            p11_index_invalidate(p11->func_list, slot_id);
+        }
+    }
+
+    /* The first messages are signed first, the rest is split evenly */
+    int32_t first = sign_first_messages(&engine, workers[0].session, messages.len);
+
+    engine.shard_count = threads;
+    engine.shards = janet_smalloc(threads * sizeof(sign_shard_t));
+    for (int32_t i=0; i<threads; i++) {
+        int64_t rest = messages.len - first;
+        pthread_mutex_init(&engine.shards[i].lock, NULL);
+        engine.shards[i].begin = first + (int32_t)(rest * i / threads);
+        engine.shards[i].end = first + (int32_t)(rest * (i + 1) / threads);
+    }
+
+    /* A thread that fails to start leaves its shard to be stolen */
+    for (int32_t i=1; i<threads; i++) {
+        if (pthread_create(&workers[i].thread, NULL, sign_worker_main, &workers[i]) != 0) {
+            workers[i].id = -1;
+        }
+    }
+    sign_worker_main(&workers[0]);
+    for (int32_t i=1; i<threads; i++) {
+        if (workers[i].id >= 0) {
+            pthread_join(workers[i].thread, NULL);
+        }
+    }
+
+    close_sessions(p11->func_list, workers, threads);
+    if (login) {
+        /* Closing the last sessions of the application logs it out */
+        p11_index_invalidate(p11->func_list, slot_id);
+    }
+    for (int32_t i=0; i<threads; i++) {
+        pthread_mutex_destroy(&engine.shards[i].lock);
+    }
+
+    if (!per_item && engine.failed) {
+        for (int32_t i=0; i<messages.len; i++) {
+            free(engine.oversized[i]);
+        }
+        for (int32_t i=0; i<messages.len; i++) {
+            CK_RV rv = engine.rvs[i];
+            if (rv != CKR_OK && rv != CKR_FUNCTION_CANCELED) {
+                janet_panicf("C_Sign, message #%d, rv:%s", i, get_pkcs11_error(rv));
+            }
+        }
+    }
+
+    Janet *tup = janet_tuple_begin(messages.len);
+    for (int32_t i=0; i<messages.len; i++) {
+        if (engine.rvs[i] != CKR_OK) {
+            tup[i] = janet_ckeywordv(get_pkcs11_error(engine.rvs[i]));
+        } else if (engine.oversized[i] != NULL) {
+            tup[i] = janet_stringv(engine.oversized[i], engine.lens[i]);
+            free(engine.oversized[i]);
+        } else {
+            tup[i] = janet_stringv(engine.out + (size_t)i * engine.stride, engine.lens[i]);
+        }
+    }
+
+    janet_sfree(engine.out);
+    janet_sfree(workers);
+    janet_sfree(engine.shards);
+    janet_sfree(engine.rvs);
+    janet_sfree(engine.lens);
+    janet_sfree(engine.oversized);
+    janet_sfree(engine.messages);
+
+    return janet_wrap_tuple(janet_tuple_end(tup));
+}
+
+void submod_parallel(JanetTable *env) {
+    JanetRegExt cfuns[] = {
+        JANET_REG("sign-parallel", p11_sign_parallel),
+        JANET_REG_END
+    };
+    janet_cfuns_ext(env, "pkcs11", cfuns);
+}
@@ -6,6 +6,7 @@
 
 #include "main.h"
 #include "error.h"
+#include "output.h"
 
 JANET_FN(p11_seed_random,
          "(seed-random session-obj seed)",
@@ -25,21 +26,43 @@ JANET_FN(p11_seed_random,
 }
 
 JANET_FN(p11_generate_random,
-         "(generate-random session-obj length)",
+         "(generate-random session-obj length &opt buffer mode)",
          "Generates random or pseudo-random data. Returns the `length` "
-         "bytes of random data in string format, if successful.")
+         "bytes of random data in string format, if successful. "
+         "With `buffer`, the output is appended to it, or replaces its "
+         "content if `mode` is `:overwrite`, and `buffer` is returned.")
 {
-    janet_fixarity(argc, 2);
+    janet_arity(argc, 2, 4);
 
     session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
-    CK_ULONG length = (CK_ULONG)janet_getnumber(argv, 1);
-    CK_BYTE_PTR random_data = (CK_BYTE_PTR)janet_smalloc(length);
+    int32_t length = janet_getnat(argv, 1);
 
     CK_RV rv;
-    rv = obj->func_list->C_GenerateRandom(obj->session, random_data, length);
+    if (argc == 2 || janet_checktype(argv[2], JANET_NIL)) {
+        if (argc > 3) {
+            janet_panic("mode requires an output buffer");
+        }
+
+        /* Generated straight into the string */
+        uint8_t *random_data = janet_string_begin(length);
+        rv = obj->func_list->C_GenerateRandom(obj->session, random_data, (CK_ULONG)length);
+        PKCS11_ASSERT(rv, "C_GenerateRandom");
+
+        return janet_wrap_string(janet_string_end(random_data));
+    }
+
+    p11_output_t out = p11_output_buffer(argc, argv, 2);
+    if (length > INT32_MAX - out.count) {
+        janet_panic("output is too large");
+    }
+    janet_buffer_ensure(out.buffer, out.count + length, 2);
+
+    rv = obj->func_list->C_GenerateRandom(obj->session, out.buffer->data + out.count,
+                                          (CK_ULONG)length);
     PKCS11_ASSERT(rv, "C_GenerateRandom");
+    out.count += length;
 
-    return janet_wrap_string(janet_string(random_data, length));
+    return p11_output_wrap(argc, argv, 2, &out);
 }
 
 void submod_random(JanetTable *env) {
@@ -7,6 +7,7 @@
 #include "main.h"
 #include "error.h"
 #include "utils.h"
+#include "object_index.h"
 
 /* Abstract Object functions */
 static int session_gc_fn(void *data, size_t len);
@@ -35,29 +36,42 @@ static JanetMethod session_methods[] = {
     {"destroy-object", p11_destroy_object},
     {"get-object-size", p11_get_object_size},
     {"get-attribute-value", p11_get_attribute_value},
+    {"get-attributes-batch", p11_get_attributes_batch},
     {"set-attribute-value", p11_set_attribute_value},
     {"find-objects-init", p11_find_objects_init},
     {"find-objects", p11_find_objects},
     {"find-objects-final", p11_find_objects_final},
+    {"find-objects-seq", p11_find_objects_seq},
 
     {"encrypt-init", p11_encrypt_init},
     {"encrypt", p11_encrypt},
+    {"encrypt-once", p11_encrypt_once},
+    {"encrypt-batch", p11_encrypt_batch},
+    {"encrypt-stream", p11_encrypt_stream},
     {"encrypt-update", p11_encrypt_update},
     {"encrypt-final", p11_encrypt_final},
 
     {"decrypt-init", p11_decrypt_init},
     {"decrypt", p11_decrypt},
+    {"decrypt-once", p11_decrypt_once},
+    {"decrypt-batch", p11_decrypt_batch},
+    {"decrypt-stream", p11_decrypt_stream},
     {"decrypt-update", p11_decrypt_update},
     {"decrypt-final", p11_decrypt_final},
 
     {"digest-init", p11_digest_init},
     {"digest", p11_digest},
+    {"digest-once", p11_digest_once},
+    {"digest-file", p11_digest_file},
     {"digest-update", p11_digest_update},
     {"digest-key", p11_digest_key},
     {"digest-final", p11_digest_final},
 
     {"sign-init", p11_sign_init},
     {"sign", p11_sign},
+    {"sign-once", p11_sign_once},
+    {"sign-batch", p11_sign_batch},
+    {"sign-file", p11_sign_file},
     {"sign-update", p11_sign_update},
     {"sign-final", p11_sign_final},
     {"sign-recover-init", p11_sign_recover_init},
@@ -65,6 +79,9 @@ static JanetMethod session_methods[] = {
 
     {"verify-init", p11_verify_init},
     {"verify", p11_verify},
+    {"verify-once", p11_verify_once},
+    {"verify-batch", p11_verify_batch},
+    {"verify-file", p11_verify_file},
     {"verify-update", p11_verify_update},
     {"verify-final", p11_verify_final},
     {"verify-recover-init", p11_verify_recover_init},
@@ -83,6 +100,15 @@ static JanetMethod session_methods[] = {
 
     {"seed-random", p11_seed_random},
     {"generate-random", p11_generate_random},
+
+    {"encrypt-async", p11_encrypt_async},
+    {"decrypt-async", p11_decrypt_async},
+    {"digest-async", p11_digest_async},
+    {"sign-async", p11_sign_async},
+    {"verify-async", p11_verify_async},
+    {"generate-key-async", p11_generate_key_async},
+    {"generate-key-pair-async", p11_generate_key_pair_async},
+    {"generate-random-async", p11_generate_random_async},
     {NULL, NULL},
 };
 
@@ -116,6 +142,44 @@ JanetAbstractType *get_session_obj_type(void) {
     return &session_obj_type;
 }
 
+session_obj_t *open_session_obj(p11_obj_t *obj, CK_SLOT_ID slot_id, CK_FLAGS flags)
+{
+    CK_SESSION_HANDLE session;
+    CK_RV rv;
+    rv = obj->func_list->C_OpenSession(slot_id, flags, NULL_PTR, NULL_PTR, &session);
+    PKCS11_ASSERT(rv, "C_OpenSession");
+
+    session_obj_t *session_obj;
+    if (obj->is_threaded) {
+        session_obj = janet_abstract_threaded(get_session_obj_type(), sizeof(session_obj_t));
+    } else {
+        session_obj = janet_abstract(get_session_obj_type(), sizeof(session_obj_t));
+    }
+    memset(session_obj, 0, sizeof(session_obj_t));
+    session_obj->session = session;
+    session_obj->func_list = obj->func_list;
+    session_obj->slot_id = slot_id;
+    session_obj->is_session_open = true;
+    session_obj->is_threaded = obj->is_threaded;
+
+    return session_obj;
+}
+
+CK_USER_TYPE get_user_type(const Janet *argv, int32_t n)
+{
+    const uint8_t *user_type_kw = janet_getkeyword(argv, n);
+
+    if (!janet_cstrcmp(user_type_kw, "so")) {
+        return CKU_SO;
+    } else if (!janet_cstrcmp(user_type_kw, "user")) {
+        return CKU_USER;
+    } else if (!janet_cstrcmp(user_type_kw, "context-speicifc")) {
+        return CKU_CONTEXT_SPECIFIC;
+    }
+
+    janet_panicf("expected one of :so, :user, :context-speicifc, got %v", argv[n]);
+}
+
 JANET_FN(p11_open_session,
          "(open-session p11-obj slot-id &opt :read-only)",
          "Opens a session between an application and a token in a particular "
@@ -128,21 +192,12 @@ JANET_FN(p11_open_session,
     CK_SLOT_ID slot_id = janet_getinteger64(argv, 1);
 
     CK_FLAGS flags = CKF_SERIAL_SESSION | CKF_RW_SESSION;
-    CK_SESSION_HANDLE session;
 
     if (IS_ARG_KEYWORD(2, "read-only")) {
         flags = CKF_SERIAL_SESSION;
     }
 
-    CK_RV rv;
-    rv = obj->func_list->C_OpenSession(slot_id, flags, NULL_PTR, NULL_PTR, &session);
-    PKCS11_ASSERT(rv, "C_OpenSession");
-
-    session_obj_t *session_obj = janet_abstract(get_session_obj_type(), sizeof(session_obj_t));
-    memset(session_obj, 0, sizeof(session_obj_t));
-    session_obj->session = session;
-    session_obj->func_list = obj->func_list;
-    session_obj->is_session_open = true;
+    session_obj_t *session_obj = open_session_obj(obj, slot_id, flags);
 
     return janet_wrap_abstract(session_obj);
 }
@@ -172,6 +227,8 @@ JANET_FN(p11_close_all_sessions,
     rv = obj->func_list->C_CloseAllSessions(slot_id);
     PKCS11_ASSERT(rv, "C_CloseAllSessions");
 
+    p11_index_invalidate(obj->func_list, slot_id);
+
     return janet_wrap_nil();
 }
 
@@ -226,24 +283,16 @@ JANET_FN(p11_login,
     janet_fixarity(argc, 3);
 
     session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
-    const uint8_t *user_type_kw = janet_getkeyword(argv, 1);
+    CK_USER_TYPE user_type = get_user_type(argv, 1);
     JanetByteView pin = janet_getbytes(argv, 2);
 
-    CK_USER_TYPE user_type;
-    if (!janet_cstrcmp(user_type_kw, "so")) {
-        user_type = CKU_SO;
-    } else if (!janet_cstrcmp(user_type_kw, "user")) {
-        user_type = CKU_USER;
-    } else if (!janet_cstrcmp(user_type_kw, "context-speicifc")) {
-        user_type = CKU_CONTEXT_SPECIFIC;
-    } else {
-        janet_panicf("expected one of :so, :user, :context-speicifc, got %v", argv[1]);
-    }
-
     CK_RV rv;
     rv = obj->func_list->C_Login(obj->session, user_type, (CK_UTF8CHAR_PTR)pin.bytes, (CK_ULONG)pin.len);
     PKCS11_ASSERT(rv, "C_Login");
 
+    /* Private objects are now visible */
+    p11_index_invalidate(obj->func_list, obj->slot_id);
+
     return janet_wrap_abstract(obj);
 }
 
@@ -258,6 +307,8 @@ JANET_FN(p11_logout,
     rv = obj->func_list->C_Logout(obj->session);
     PKCS11_ASSERT(rv, "C_Logout");
 
+    p11_index_invalidate(obj->func_list, obj->slot_id);
+
     return janet_wrap_abstract(obj);
 }
 
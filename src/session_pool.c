@@ -0,0 +1,270 @@
+/*
+ * Copyright (c) 2024, Janet-pkcs11 Seungki Kim
+ *
+ * Janet-pkcs11 is released under the MIT License, see the LICENSE file.
+ */
+
+#include "main.h"
+#include "error.h"
+#include "object_index.h"
+
+typedef struct session_pool_obj {
+    JanetArray *sessions;
+    JanetTable *checked_out;
+    JanetChannel *idle;
+    bool is_pool_open;
+} session_pool_obj_t;
+
+/* `checkout` and `close` are defined in Janet, see session_pool_source */
+static JANET_THREAD_LOCAL Janet pool_checkout_fn;
+static JANET_THREAD_LOCAL Janet pool_close_fn;
+
+/* Abstract Object functions */
+static int session_pool_gcmark_fn(void *data, size_t len);
+static int session_pool_get_fn(void *data, Janet key, Janet *out);
+
+static JanetAbstractType session_pool_obj_type = {
+    "session-pool",
+    NULL,
+    session_pool_gcmark_fn,
+    session_pool_get_fn,
+    JANET_ATEND_GET
+};
+
+static JanetMethod session_pool_methods[] = {
+    {"return", p11_session_pool_return},
+    {NULL, NULL},
+};
+
+static int session_pool_gcmark_fn(void *data, size_t len) {
+    session_pool_obj_t *obj = (session_pool_obj_t *)data;
+    janet_mark(janet_wrap_array(obj->sessions));
+    janet_mark(janet_wrap_table(obj->checked_out));
+    janet_mark(janet_wrap_abstract(obj->idle));
+
+    return 0;
+}
+
+static int session_pool_get_fn(void *data, Janet key, Janet *out) {
+    (void)data;
+    if (!janet_checktype(key, JANET_KEYWORD)) {
+        return 0;
+    }
+
+    JanetKeyword method = janet_unwrap_keyword(key);
+    if (!janet_cstrcmp(method, "checkout")) {
+        *out = pool_checkout_fn;
+        return 1;
+    }
+    if (!janet_cstrcmp(method, "close")) {
+        *out = pool_close_fn;
+        return 1;
+    }
+
+    return janet_getmethod(method, session_pool_methods, out);
+}
+
+JanetAbstractType *get_session_pool_obj_type(void) {
+    return &session_pool_obj_type;
+}
+
+JANET_FN(p11_session_pool,
+         "(session-pool p11-obj slot-id size &opt user-type pin)",
+         "Opens `size` R/W sessions on the token in `slot-id` and keeps them "
+         "for reuse. If `user-type` and `pin` are given, the sessions are "
+         "logged in as well. Returns a `session-pool-obj`, if successful.")
+{
+    janet_arity(argc, 3, 5);
+
+    p11_obj_t *obj = janet_getabstract(argv, 0, get_p11_obj_type());
+    CK_SLOT_ID slot_id = janet_getinteger64(argv, 1);
+    int32_t size = janet_getnat(argv, 2);
+
+    if (size == 0) {
+        janet_panic("size must be positive");
+    }
+
+    CK_USER_TYPE user_type = 0;
+    JanetByteView pin = {NULL, 0};
+    bool login = (argc > 3);
+    if (login) {
+        janet_fixarity(argc, 5);
+        user_type = get_user_type(argv, 3);
+        pin = janet_getbytes(argv, 4);
+    }
+
+    session_pool_obj_t *pool = janet_abstract(get_session_pool_obj_type(), sizeof(session_pool_obj_t));
+    memset(pool, 0, sizeof(session_pool_obj_t));
+    pool->sessions = janet_array(size);
+    pool->checked_out = janet_table(size);
+    pool->idle = janet_channel_make((uint32_t)size);
+    pool->is_pool_open = true;
+
+    for (int32_t i=0; i<size; i++) {
+        session_obj_t *session = open_session_obj(obj, slot_id,
+                                                  CKF_SERIAL_SESSION | CKF_RW_SESSION);
+        janet_array_push(pool->sessions, janet_wrap_abstract(session));
+
+        if (login) {
+            /* The login state is shared by all sessions of an application */
+            CK_RV rv;
+            rv = session->func_list->C_Login(session->session, user_type,
+                                             (CK_UTF8CHAR_PTR)pin.bytes, (CK_ULONG)pin.len);
+            if (rv != CKR_USER_ALREADY_LOGGED_IN) {
+                PKCS11_ASSERT(rv, "C_Login");
+            }
+        }
+
+        janet_channel_give(pool->idle, janet_wrap_abstract(session));
+    }
+
+    if (login) {
+        p11_index_invalidate(obj->func_list, slot_id);
+    }
+
+    return janet_wrap_abstract(pool);
+}
+
+JANET_FN(p11_session_pool_idle,
+         "(session-pool-idle session-pool-obj)",
+         "Returns the channel of idle sessions of the pool, used by "
+         "`session-pool-checkout`.")
+{
+    janet_fixarity(argc, 1);
+
+    session_pool_obj_t *pool = janet_getabstract(argv, 0, get_session_pool_obj_type());
+    if (!pool->is_pool_open) {
+        janet_panic("session pool is closed");
+    }
+
+    return janet_wrap_abstract(pool->idle);
+}
+
+JANET_FN(p11_session_pool_acquire,
+         "(session-pool-acquire session-pool-obj session)",
+         "Marks `session`, taken from the channel of idle sessions, as checked "
+         "out and returns it. `session` is nil if the pool was closed while "
+         "waiting.")
+{
+    janet_fixarity(argc, 2);
+
+    session_pool_obj_t *pool = janet_getabstract(argv, 0, get_session_pool_obj_type());
+    if (janet_checktype(argv[1], JANET_NIL) || !pool->is_pool_open) {
+        janet_panic("session pool is closed");
+    }
+
+    janet_getabstract(argv, 1, get_session_obj_type());
+    janet_table_put(pool->checked_out, argv[1], janet_wrap_true());
+
+    return argv[1];
+}
+
+JANET_FN(p11_session_pool_return,
+         "(session-pool-return session-pool-obj session-obj)",
+         "Gives a `session-obj` taken by `session-pool-checkout` back to the "
+         "pool, resuming a fiber waiting for a session, if any.")
+{
+    janet_fixarity(argc, 2);
+
+    session_pool_obj_t *pool = janet_getabstract(argv, 0, get_session_pool_obj_type());
+    janet_getabstract(argv, 1, get_session_obj_type());
+
+    bool found = false;
+    for (int32_t i=0; i<pool->sessions->count; i++) {
+        if (janet_equals(pool->sessions->data[i], argv[1])) {
+            found = true;
+            break;
+        }
+    }
+
+    if (!found) {
+        janet_panic("session does not belong to the pool");
+    }
+
+    /* A session given back twice could be checked out by two fibers */
+    if (janet_checktype(janet_table_get(pool->checked_out, argv[1]), JANET_NIL)) {
+        janet_panic("session is not checked out");
+    }
+    janet_table_remove(pool->checked_out, argv[1]);
+
+    if (pool->is_pool_open) {
+        janet_channel_give(pool->idle, argv[1]);
+    }
+
+    return janet_wrap_nil();
+}
+
+JANET_FN(p11_session_pool_shutdown,
+         "(session-pool-shutdown session-pool-obj)",
+         "Closes all sessions of the pool. Returns the channel of idle sessions "
+         "for `session-pool-close` to close, or nil if the pool was already "
+         "closed.")
+{
+    janet_fixarity(argc, 1);
+
+    session_pool_obj_t *pool = janet_getabstract(argv, 0, get_session_pool_obj_type());
+    if (!pool->is_pool_open) {
+        return janet_wrap_nil();
+    }
+
+    pool->is_pool_open = false;
+    for (int32_t i=0; i<pool->sessions->count; i++) {
+        Janet session = pool->sessions->data[i];
+        p11_close_session(1, &session);
+    }
+
+    return janet_wrap_abstract(pool->idle);
+}
+
+static const char session_pool_source[] =
+    "(defn session-pool-checkout\n"
+    "  ``(session-pool-checkout session-pool-obj)\n\n"
+    "  Takes an idle `session-obj` out of the pool. If every session is in "
+    "use, the current fiber waits until one is returned. The session must "
+    "be given back with `session-pool-return`.``\n"
+    "  [pool]\n"
+    "  (session-pool-acquire pool (ev/take (session-pool-idle pool))))\n"
+    "\n"
+    "(defn session-pool-close\n"
+    "  ``(session-pool-close session-pool-obj)\n\n"
+    "  Closes all sessions of the pool. Fibers waiting in "
+    "`session-pool-checkout` raise an error.``\n"
+    "  [pool]\n"
+    "  (when-let [idle (session-pool-shutdown pool)]\n"
+    "    (ev/chan-close idle))\n"
+    "  nil)\n"
+    "\n"
+    "(defmacro with-session\n"
+    "  ``(with-session [binding session-pool-obj] & body)\n\n"
+    "  Checks out a session from the pool, binds it to `binding` and evaluates "
+    "`body`. The session is returned to the pool when `body` exits, even on "
+    "error.``\n"
+    "  [[binding pool] & body]\n"
+    "  (with-syms [p]\n"
+    "    ~(let [,p ,pool ,binding (:checkout ,p)]\n"
+    "       (defer (:return ,p ,binding) ,;body))))\n";
+
+static Janet resolve_function(JanetTable *env, const char *name)
+{
+    Janet fn = janet_wrap_nil();
+    janet_resolve(env, janet_csymbol(name), &fn);
+    janet_gcroot(fn);
+
+    return fn;
+}
+
+void submod_session_pool(JanetTable *env) {
+    JanetRegExt cfuns[] = {
+        JANET_REG("session-pool", p11_session_pool),
+        JANET_REG("session-pool-idle", p11_session_pool_idle),
+        JANET_REG("session-pool-acquire", p11_session_pool_acquire),
+        JANET_REG("session-pool-return", p11_session_pool_return),
+        JANET_REG("session-pool-shutdown", p11_session_pool_shutdown),
+        JANET_REG_END
+    };
+    janet_cfuns_ext(env, "pkcs11", cfuns);
+    janet_register_abstract_type(get_session_pool_obj_type());
+    janet_dostring(env, session_pool_source, "pkcs11", NULL);
+    pool_checkout_fn = resolve_function(env, "session-pool-checkout");
+    pool_close_fn = resolve_function(env, "session-pool-close");
+}
@@ -7,6 +7,9 @@
 #include "main.h"
 #include "error.h"
 #include "attribute.h"
+#include "output.h"
+#include "mapped_file.h"
+#include "utils.h"
 
 JANET_FN(p11_sign_init,
          "(sign-init session-obj mechanism key-handle)",
@@ -16,54 +19,172 @@ JANET_FN(p11_sign_init,
     janet_fixarity(argc, 3);
 
     session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
-    JanetStruct mechanism = janet_getstruct(argv, 1);
     CK_OBJECT_HANDLE key_handle = janet_getnumber(argv, 2);
 
-    CK_MECHANISM_PTR p_mechanism = janet_struct_to_p11_mechanism(mechanism);
+    CK_MECHANISM_PTR p_mechanism = janet_get_p11_mechanism(argv, 1);
 
     CK_RV rv;
     rv = obj->func_list->C_SignInit(obj->session, p_mechanism, key_handle);
     PKCS11_ASSERT(rv, "C_SignInit");
 
+    p11_output_hint_init(obj, P11_OUTPUT_SIGN, p_mechanism->mechanism, key_handle);
+
     return janet_wrap_abstract(obj);
 }
 
 JANET_FN(p11_sign,
-         "(sign session-obj data)",
+         "(sign session-obj data &opt buffer mode)",
          "Signs data in a single part. Returns a signature of the data in "
-         "string, if successful.")
+         "string, if successful. "
+         "With `buffer`, the output is appended to it, or replaces its "
+         "content if `mode` is `:overwrite`, and `buffer` is returned.")
 {
-    janet_fixarity(argc, 2);
+    janet_arity(argc, 2, 4);
 
     session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
     JanetByteView data = janet_getbytes(argv, 1);
 
-    CK_BYTE_PTR sign_data = NULL_PTR;
-    CK_ULONG sign_data_len = 0;
+    p11_output_t out = p11_output_buffer(argc, argv, 2);
 
     CK_RV rv;
-    rv = obj->func_list->C_Sign(obj->session,
-                                (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len,
-                                sign_data, &sign_data_len);
+    rv = p11_output_data(obj, P11_OUTPUT_SIGN, obj->func_list->C_Sign,
+                         (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len, &out);
     PKCS11_ASSERT(rv, "C_Sign");
 
-    sign_data = janet_smalloc(sign_data_len);
-    rv = obj->func_list->C_Sign(obj->session,
-                                (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len,
-                                sign_data, &sign_data_len);
-    PKCS11_ASSERT(rv, "C_Sign");
+    return p11_output_wrap(argc, argv, 2, &out);
+}
+
+JANET_FN(p11_sign_once,
+         "(sign-once session-obj mechanism key-handle data &opt buffer mode)",
+         "Signs single-part data with `key-handle`, running `sign-init` and "
+         "`sign` in one call. `mechanism` is a struct or a `mechanism-obj`. "
+         "Returns a signature of the data in string, if successful. "
+         "With `buffer`, the output is appended to it, or replaces its "
+         "content if `mode` is `:overwrite`, and `buffer` is returned.")
+{
+    janet_arity(argc, 4, 6);
+
+    session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
+
+    return p11_output_once(obj, argc, argv, P11_OUTPUT_SIGN,
+                           obj->func_list->C_SignInit, "C_SignInit",
+                           obj->func_list->C_Sign, "C_Sign");
+}
+
+JANET_FN(p11_sign_batch,
+         "(sign-batch session-obj mechanism key-handle messages &opt :per-item)",
+         "Signs every message of `messages` with `key-handle` in a single "
+         "call, running `sign-init` and `sign` for each message. Returns a "
+         "tuple of signatures in the order of `messages`. The first error "
+         "aborts the batch, unless `:per-item` is given. Then the signature "
+         "of a message that fails is replaced by the error keyword, e.g. "
+         "`:CKR_DATA_LEN_RANGE`, and the batch goes on.")
+{
+    janet_arity(argc, 4, 5);
+
+    session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
+    CK_OBJECT_HANDLE key_handle = janet_getnumber(argv, 2);
+    JanetView messages = janet_getindexed(argv, 3);
+
+    bool per_item = IS_ARG_KEYWORD(4, "per-item");
+    if (argc == 5 && !per_item) {
+        janet_panicf("expected :per-item, got %v", argv[4]);
+    }
+
+    CK_MECHANISM_PTR p_mechanism = janet_get_p11_mechanism(argv, 1);
+    p11_output_hint_init(obj, P11_OUTPUT_SIGN, p_mechanism->mechanism, key_handle);
+
+    /* Sized by the first signature, the following ones fit in a single call */
+    p11_output_t out = {janet_buffer(0), 0};
+    Janet *tup = janet_tuple_begin(messages.len);
+
+    for (int32_t i=0; i<messages.len; i++) {
+        JanetByteView data;
+        if (!janet_bytes_view(messages.items[i], &data.bytes, &data.len)) {
+            if (!per_item) {
+                janet_panicf("bad message #%d, expected bytes, got %v",
+                             i, messages.items[i]);
+            }
+            tup[i] = janet_ckeywordv(get_pkcs11_error(CKR_ARGUMENTS_BAD));
+            continue;
+        }
+
+        const char *desc = "C_SignInit";
+        CK_RV rv;
+        rv = obj->func_list->C_SignInit(obj->session, p_mechanism, key_handle);
+        if (rv == CKR_OK) {
+            desc = "C_Sign";
+            out.count = 0;
+            rv = p11_output_data(obj, P11_OUTPUT_SIGN, obj->func_list->C_Sign,
+                                 (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len, &out);
+        }
+
+        if (rv != CKR_OK) {
+            if (!per_item) {
+                janet_panicf("%s, message #%d, rv:%s", desc, i, get_pkcs11_error(rv));
+            }
+            tup[i] = janet_ckeywordv(get_pkcs11_error(rv));
+            continue;
+        }
+
+        tup[i] = janet_stringv(out.buffer->data, out.count);
+    }
+
+    return janet_wrap_tuple(janet_tuple_end(tup));
+}
+
+JANET_FN(p11_sign_file,
+         "(sign-file session-obj mechanism key-handle path)",
+         "Signs or MACs the file at `path` with `key-handle`. The file is "
+         "mapped into memory and fed to `C_SignUpdate` in large chunks, "
+         "without being read into Janet buffers. Returns a signature of the "
+         "file in string, if successful.")
+{
+    janet_fixarity(argc, 4);
+
+    session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
+    CK_MECHANISM_PTR p_mechanism = janet_get_p11_mechanism(argv, 1);
+    CK_OBJECT_HANDLE key_handle = janet_getnumber(argv, 2);
+
+    mapped_file_t file;
+    p11_mapped_file_open(&file, argv, 3);
+
+    const char *desc = "C_SignInit";
+    CK_RV rv;
+    rv = obj->func_list->C_SignInit(obj->session, p_mechanism, key_handle);
+    if (rv == CKR_OK) {
+        desc = "C_SignUpdate";
+        rv = p11_mapped_file_feed(&file, obj->session, obj->func_list->C_SignUpdate);
+    }
+    p11_mapped_file_close(&file);
+    PKCS11_ASSERT(rv, desc);
+
+    p11_output_hint_init(obj, P11_OUTPUT_SIGN, p_mechanism->mechanism, key_handle);
+
+    p11_output_t out = {janet_buffer(0), 0};
+
+    rv = p11_output_final(obj, P11_OUTPUT_SIGN, obj->func_list->C_SignFinal, &out);
+    PKCS11_ASSERT(rv, "C_SignFinal");
 
-    return janet_wrap_string(janet_string(sign_data, sign_data_len));
+    return janet_stringv(out.buffer->data, out.count);
 }
 
 JANET_FN(p11_sign_update,
          "(sign-update session-obj data)",
-         "Continues a multiple-part signature operation, processing another "
-         "`data` part. Returns a `session-obj`, if successful.")
+         "Continues a multiple-part signature operation, processing "
+         "another `data` part. `data` may also be an array or tuple of parts, "
+         "e.g. `[header body trailer]`, processed in order in one call. "
+         "Returns a `session-obj`, if successful.")
 {
     janet_fixarity(argc, 2);
 
     session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
+
+    if (janet_checktypes(argv[1], JANET_TFLAG_INDEXED)) {
+        p11_update_data(obj, argv, 1, obj->func_list->C_SignUpdate, "C_SignUpdate");
+        return janet_wrap_abstract(obj);
+    }
+
     JanetByteView data = janet_getbytes(argv, 1);
 
     CK_RV rv;
@@ -75,26 +196,23 @@ JANET_FN(p11_sign_update,
 }
 
 JANET_FN(p11_sign_final,
-         "(sign-final session-obj)",
+         "(sign-final session-obj &opt buffer mode)",
          "Finishes a multiple-part signature operation. "
-         "Return a signature of the data in string, if successful.")
+         "Return a signature of the data in string, if successful. "
+         "With `buffer`, the output is appended to it, or replaces its "
+         "content if `mode` is `:overwrite`, and `buffer` is returned.")
 {
-    janet_fixarity(argc, 1);
+    janet_arity(argc, 1, 3);
 
     session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
 
-    CK_BYTE_PTR sign_data = NULL_PTR;
-    CK_ULONG sign_data_len = 0;
+    p11_output_t out = p11_output_buffer(argc, argv, 1);
 
     CK_RV rv;
-    rv = obj->func_list->C_SignFinal(obj->session, sign_data, &sign_data_len);
-    PKCS11_ASSERT(rv, "C_SignFinal");
-
-    sign_data = janet_smalloc(sign_data_len);
-    rv = obj->func_list->C_SignFinal(obj->session, sign_data, &sign_data_len);
+    rv = p11_output_final(obj, P11_OUTPUT_SIGN, obj->func_list->C_SignFinal, &out);
     PKCS11_ASSERT(rv, "C_SignFinal");
 
-    return janet_wrap_string(janet_string(sign_data, sign_data_len));
+    return p11_output_wrap(argc, argv, 1, &out);
 }
 
 JANET_FN(p11_sign_recover_init,
@@ -105,51 +223,49 @@ JANET_FN(p11_sign_recover_init,
     janet_fixarity(argc, 3);
 
     session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
-    JanetStruct mechanism = janet_getstruct(argv, 1);
     CK_OBJECT_HANDLE key_handle = janet_getnumber(argv, 2);
 
-    CK_MECHANISM_PTR p_mechanism = janet_struct_to_p11_mechanism(mechanism);
+    CK_MECHANISM_PTR p_mechanism = janet_get_p11_mechanism(argv, 1);
 
     CK_RV rv;
     rv = obj->func_list->C_SignRecoverInit(obj->session, p_mechanism, key_handle);
     PKCS11_ASSERT(rv, "C_SignRecoverInit");
 
+    p11_output_hint_init(obj, P11_OUTPUT_SIGN_RECOVER, p_mechanism->mechanism, key_handle);
+
     return janet_wrap_abstract(obj);
 }
 
 JANET_FN(p11_sign_recover,
-         "(sign-recover session-obj data)",
+         "(sign-recover session-obj data &opt buffer mode)",
          "Signs data in a single operation, where the data can be recovered "
          "from the signature. Returns a signature of the data in string, if "
-         "successful.")
+         "successful. "
+         "With `buffer`, the output is appended to it, or replaces its "
+         "content if `mode` is `:overwrite`, and `buffer` is returned.")
 {
-    janet_fixarity(argc, 2);
+    janet_arity(argc, 2, 4);
 
     session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
     JanetByteView data = janet_getbytes(argv, 1);
 
-    CK_BYTE_PTR sign_data = NULL_PTR;
-    CK_ULONG sign_data_len = 0;
+    p11_output_t out = p11_output_buffer(argc, argv, 2);
 
     CK_RV rv;
-    rv = obj->func_list->C_SignRecover(obj->session,
-                                       (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len,
-                                       sign_data, &sign_data_len);
-    PKCS11_ASSERT(rv, "C_SignRecover");
-
-    sign_data = janet_smalloc(sign_data_len);
-    rv = obj->func_list->C_SignRecover(obj->session,
-                                       (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len,
-                                       sign_data, &sign_data_len);
+    rv = p11_output_data(obj, P11_OUTPUT_SIGN_RECOVER, obj->func_list->C_SignRecover,
+                         (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len, &out);
     PKCS11_ASSERT(rv, "C_SignRecover");
 
-    return janet_wrap_string(janet_string(sign_data, sign_data_len));
+    return p11_output_wrap(argc, argv, 2, &out);
 }
 
 void submod_sign(JanetTable *env) {
     JanetRegExt cfuns[] = {
         JANET_REG("sign-init", p11_sign_init),
         JANET_REG("sign", p11_sign),
+        JANET_REG("sign-once", p11_sign_once),
+        JANET_REG("sign-batch", p11_sign_batch),
+        JANET_REG("sign-file", p11_sign_file),
         JANET_REG("sign-update", p11_sign_update),
         JANET_REG("sign-final", p11_sign_final),
         JANET_REG("sign-recover-init", p11_sign_recover_init),
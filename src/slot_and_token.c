@@ -6,6 +6,7 @@
 
 #include "main.h"
 #include "error.h"
+#include "object_index.h"
 
 /* `:slot-id` will be added to original CK_SLOT_INFO */
 static JanetStruct slot_info_to_struct(CK_SLOT_INFO_PTR info, CK_SLOT_ID slot_id)
@@ -190,6 +191,7 @@ JANET_FN(p11_wait_for_slot_event,
         }
 
         PKCS11_ASSERT(rv, "C_WaitForSlotEvent");
+        p11_index_invalidate(obj->func_list, slot_id);
         slot_ids[i] = slot_id;
         event_slots += 1;
     }
@@ -312,6 +314,8 @@ JANET_FN(p11_init_token,
     rv = obj->func_list->C_InitToken(slot_id, (CK_UTF8CHAR_PTR)pin.bytes, (CK_ULONG)pin.len, label);
     PKCS11_ASSERT(rv, "C_InitToken");
 
+    p11_index_invalidate(obj->func_list, slot_id);
+
     return janet_wrap_abstract(obj);
 }
 
@@ -0,0 +1,733 @@
+/*
+ * Copyright (c) 2024, Janet-pkcs11 Seungki Kim
+ *
+ * Janet-pkcs11 is released under the MIT License, see the LICENSE file.
+ */
+
+/* clock_gettime() is not part of C99 */
+#define _DEFAULT_SOURCE
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include "main.h"
+#include "error.h"
+#include "utils.h"
+#include "stats.h"
+#include "trace.h"
+
+/*
+ * Call statistics
+ *
+ * A library loaded with `:stats` or `:trace` gets a copy of its
+ * CK_FUNCTION_LIST whose entries record the call, then forward it to the
+ * library. Every other module goes through obj->func_list, so nothing else
+ * changes, and a library loaded without them keeps its own function list at
+ * no cost. Calls are counted here and traced by trace.c.
+ *
+ * PKCS #11 entry points take no context pointer, so the forwarding functions
+ * use one process-wide function list and set of counters. Only one loaded
+ * library can be instrumented at a time.
+ */
+
+/* Latency bucket i counts calls of 2^(i-1) to 2^i - 1 nanoseconds */
+#define STATS_BUCKETS 32
+/* Distinct error codes counted per function, the rest go to :other */
+#define STATS_ERROR_SLOTS 8
+
+#define STATS_FUNCTIONS(X) \
+    X(C_Initialize) \
+    X(C_Finalize) \
+    X(C_GetInfo) \
+    X(C_GetFunctionList) \
+    X(C_GetSlotList) \
+    X(C_GetSlotInfo) \
+    X(C_GetTokenInfo) \
+    X(C_GetMechanismList) \
+    X(C_GetMechanismInfo) \
+    X(C_InitToken) \
+    X(C_InitPIN) \
+    X(C_SetPIN) \
+    X(C_OpenSession) \
+    X(C_CloseSession) \
+    X(C_CloseAllSessions) \
+    X(C_GetSessionInfo) \
+    X(C_GetOperationState) \
+    X(C_SetOperationState) \
+    X(C_Login) \
+    X(C_Logout) \
+    X(C_CreateObject) \
+    X(C_CopyObject) \
+    X(C_DestroyObject) \
+    X(C_GetObjectSize) \
+    X(C_GetAttributeValue) \
+    X(C_SetAttributeValue) \
+    X(C_FindObjectsInit) \
+    X(C_FindObjects) \
+    X(C_FindObjectsFinal) \
+    X(C_EncryptInit) \
+    X(C_Encrypt) \
+    X(C_EncryptUpdate) \
+    X(C_EncryptFinal) \
+    X(C_DecryptInit) \
+    X(C_Decrypt) \
+    X(C_DecryptUpdate) \
+    X(C_DecryptFinal) \
+    X(C_DigestInit) \
+    X(C_Digest) \
+    X(C_DigestUpdate) \
+    X(C_DigestKey) \
+    X(C_DigestFinal) \
+    X(C_SignInit) \
+    X(C_Sign) \
+    X(C_SignUpdate) \
+    X(C_SignFinal) \
+    X(C_SignRecoverInit) \
+    X(C_SignRecover) \
+    X(C_VerifyInit) \
+    X(C_Verify) \
+    X(C_VerifyUpdate) \
+    X(C_VerifyFinal) \
+    X(C_VerifyRecoverInit) \
+    X(C_VerifyRecover) \
+    X(C_DigestEncryptUpdate) \
+    X(C_DecryptDigestUpdate) \
+    X(C_SignEncryptUpdate) \
+    X(C_DecryptVerifyUpdate) \
+    X(C_GenerateKey) \
+    X(C_GenerateKeyPair) \
+    X(C_WrapKey) \
+    X(C_UnwrapKey) \
+    X(C_DeriveKey) \
+    X(C_SeedRandom) \
+    X(C_GenerateRandom) \
+    X(C_GetFunctionStatus) \
+    X(C_CancelFunction) \
+    X(C_WaitForSlotEvent)
+
+enum {
+#define X(name) STATS_##name,
+    STATS_FUNCTIONS(X)
+#undef X
+    STATS_COUNT
+};
+
+static const char *stats_names[STATS_COUNT] = {
+#define X(name) #name,
+    STATS_FUNCTIONS(X)
+#undef X
+};
+
+typedef struct stats_error {
+    CK_RV rv;
+    uint64_t count;
+} stats_error_t;
+
+typedef struct stats_func {
+    uint64_t calls;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t time;
+    uint64_t latency[STATS_BUCKETS];
+    uint64_t other_errors;
+    stats_error_t errors[STATS_ERROR_SLOTS];
+} stats_func_t;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool stats_in_use = false;
+static bool stats_counting = false;
+static bool stats_tracing = false;
+static CK_FUNCTION_LIST_PTR stats_real;
+static CK_FUNCTION_LIST stats_list;
+static stats_func_t stats_funcs[STATS_COUNT];
+
+static uint64_t stats_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void stats_count_error(stats_func_t *f, CK_RV rv)
+{
+    for (int i=0; i<STATS_ERROR_SLOTS; i++) {
+        stats_error_t *e = &f->errors[i];
+        CK_RV cur = __atomic_load_n(&e->rv, __ATOMIC_RELAXED);
+
+        /* CKR_OK marks a free slot, the first thread to claim it wins */
+        if (cur == CKR_OK) {
+            __atomic_compare_exchange_n(&e->rv, &cur, rv, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+            if (cur == CKR_OK) {
+                cur = rv;
+            }
+        }
+
+        if (cur == rv) {
+            __atomic_fetch_add(&e->count, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    __atomic_fetch_add(&f->other_errors, 1, __ATOMIC_RELAXED);
+}
+
+const char *p11_stats_function_name(int fn)
+{
+    return stats_names[fn];
+}
+
+static void stats_record(int fn, CK_RV rv, uint64_t start,
+                         CK_SESSION_HANDLE session, CK_MECHANISM_TYPE mechanism,
+                         CK_ULONG in_len, CK_ULONG out_len)
+{
+    uint64_t end = stats_clock();
+    if (stats_tracing) {
+        p11_trace_push(fn, session, mechanism, rv, start, end);
+    }
+    if (!stats_counting) {
+        return;
+    }
+
+    stats_func_t *f = &stats_funcs[fn];
+    uint64_t elapsed = end - start;
+    int bucket = elapsed ? 64 - __builtin_clzll(elapsed) : 0;
+    if (bucket >= STATS_BUCKETS) {
+        bucket = STATS_BUCKETS - 1;
+    }
+
+    __atomic_fetch_add(&f->calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&f->bytes_in, in_len, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&f->bytes_out, out_len, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&f->time, elapsed, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&f->latency[bucket], 1, __ATOMIC_RELAXED);
+
+    if (rv != CKR_OK) {
+        stats_count_error(f, rv);
+    }
+}
+
+/* Output length of a call that may have been a length query */
+#define OUT_LEN(p, len) (rv == CKR_OK && (p) != NULL_PTR ? *(len) : 0)
+#define MECH(p) ((p) != NULL_PTR ? (p)->mechanism : CK_UNAVAILABLE_INFORMATION)
+
+#define STATS_WRAP(name, params, args, session, mechanism, in_len, out_len) \
+    static CK_RV stats_##name params                                        \
+    {                                                                       \
+        uint64_t start = stats_clock();                                     \
+        CK_RV rv = stats_real->name args;                                   \
+        stats_record(STATS_##name, rv, start, (session), (mechanism),       \
+                     (in_len), (out_len));                                  \
+        return rv;                                                          \
+    }
+
+STATS_WRAP(C_Initialize,
+           (void *init_args),
+           (init_args),
+           CK_INVALID_HANDLE, CK_UNAVAILABLE_INFORMATION, 0, 0)
+
+STATS_WRAP(C_Finalize,
+           (void *reserved),
+           (reserved),
+           CK_INVALID_HANDLE, CK_UNAVAILABLE_INFORMATION, 0, 0)
+
+STATS_WRAP(C_GetInfo,
+           (CK_INFO *info),
+           (info),
+           CK_INVALID_HANDLE, CK_UNAVAILABLE_INFORMATION, 0, 0)
+
+STATS_WRAP(C_GetFunctionList,
+           (CK_FUNCTION_LIST **list),
+           (list),
+           CK_INVALID_HANDLE, CK_UNAVAILABLE_INFORMATION, 0, 0)
+
+STATS_WRAP(C_GetSlotList,
+           (CK_BBOOL present, CK_SLOT_ID *slots, CK_ULONG *count),
+           (present, slots, count),
+           CK_INVALID_HANDLE, CK_UNAVAILABLE_INFORMATION, 0, 0)
+
+STATS_WRAP(C_GetSlotInfo,
+           (CK_SLOT_ID slot, CK_SLOT_INFO *info),
+           (slot, info),
+           CK_INVALID_HANDLE, CK_UNAVAILABLE_INFORMATION, 0, 0)
+
+STATS_WRAP(C_GetTokenInfo,
+           (CK_SLOT_ID slot, CK_TOKEN_INFO *info),
+           (slot, info),
+           CK_INVALID_HANDLE, CK_UNAVAILABLE_INFORMATION, 0, 0)
+
+STATS_WRAP(C_GetMechanismList,
+           (CK_SLOT_ID slot, CK_MECHANISM_TYPE *list, CK_ULONG *count),
+           (slot, list, count),
+           CK_INVALID_HANDLE, CK_UNAVAILABLE_INFORMATION, 0, 0)
+
+STATS_WRAP(C_GetMechanismInfo,
+           (CK_SLOT_ID slot, CK_MECHANISM_TYPE type, CK_MECHANISM_INFO *info),
+           (slot, type, info),
+           CK_INVALID_HANDLE, CK_UNAVAILABLE_INFORMATION, 0, 0)
+
+STATS_WRAP(C_InitToken,
+           (CK_SLOT_ID slot, CK_UTF8CHAR *pin, CK_ULONG pin_len, CK_UTF8CHAR
+            *label),
+           (slot, pin, pin_len, label),
+           CK_INVALID_HANDLE, CK_UNAVAILABLE_INFORMATION, 0, 0)
+
+STATS_WRAP(C_InitPIN,
+           (CK_SESSION_HANDLE s, CK_UTF8CHAR *pin, CK_ULONG pin_len),
+           (s, pin, pin_len),
+           s, CK_UNAVAILABLE_INFORMATION, 0, 0)
+
+STATS_WRAP(C_SetPIN,
+           (CK_SESSION_HANDLE s, CK_UTF8CHAR *old_pin, CK_ULONG old_len,
+            CK_UTF8CHAR *new_pin, CK_ULONG new_len),
+           (s, old_pin, old_len, new_pin, new_len),
+           s, CK_UNAVAILABLE_INFORMATION, 0, 0)
+
+STATS_WRAP(C_OpenSession,
+           (CK_SLOT_ID slot, CK_FLAGS flags, void *app, CK_NOTIFY notify,
+            CK_SESSION_HANDLE *session),
+           (slot, flags, app, notify, session),
+           CK_INVALID_HANDLE, CK_UNAVAILABLE_INFORMATION, 0, 0)
+
+STATS_WRAP(C_CloseSession,
+           (CK_SESSION_HANDLE s),
+           (s),
+           s, CK_UNAVAILABLE_INFORMATION, 0, 0)
+
+STATS_WRAP(C_CloseAllSessions,
+           (CK_SLOT_ID slot),
+           (slot),
+           CK_INVALID_HANDLE, CK_UNAVAILABLE_INFORMATION, 0, 0)
+
+STATS_WRAP(C_GetSessionInfo,
+           (CK_SESSION_HANDLE s, CK_SESSION_INFO *info),
+           (s, info),
+           s, CK_UNAVAILABLE_INFORMATION, 0, 0)
+
+STATS_WRAP(C_GetOperationState,
+           (CK_SESSION_HANDLE s, CK_BYTE *state, CK_ULONG *state_len),
+           (s, state, state_len),
+           s, CK_UNAVAILABLE_INFORMATION, 0, OUT_LEN(state, state_len))
+
+STATS_WRAP(C_SetOperationState,
+           (CK_SESSION_HANDLE s, CK_BYTE *state, CK_ULONG state_len,
+            CK_OBJECT_HANDLE enc_key, CK_OBJECT_HANDLE auth_key),
+           (s, state, state_len, enc_key, auth_key),
+           s, CK_UNAVAILABLE_INFORMATION, state_len, 0)
+
+STATS_WRAP(C_Login,
+           (CK_SESSION_HANDLE s, CK_USER_TYPE user, CK_UTF8CHAR *pin, CK_ULONG
+            pin_len),
+           (s, user, pin, pin_len),
+           s, CK_UNAVAILABLE_INFORMATION, 0, 0)
+
+STATS_WRAP(C_Logout,
+           (CK_SESSION_HANDLE s),
+           (s),
+           s, CK_UNAVAILABLE_INFORMATION, 0, 0)
+
+STATS_WRAP(C_CreateObject,
+           (CK_SESSION_HANDLE s, CK_ATTRIBUTE *tpl, CK_ULONG count,
+            CK_OBJECT_HANDLE *object),
+           (s, tpl, count, object),
+           s, CK_UNAVAILABLE_INFORMATION, 0, 0)
+
+STATS_WRAP(C_CopyObject,
+           (CK_SESSION_HANDLE s, CK_OBJECT_HANDLE object, CK_ATTRIBUTE *tpl,
+            CK_ULONG count, CK_OBJECT_HANDLE *new_object),
+           (s, object, tpl, count, new_object),
+           s, CK_UNAVAILABLE_INFORMATION, 0, 0)
+
+STATS_WRAP(C_DestroyObject,
+           (CK_SESSION_HANDLE s, CK_OBJECT_HANDLE object),
+           (s, object),
+           s, CK_UNAVAILABLE_INFORMATION, 0, 0)
+
+STATS_WRAP(C_GetObjectSize,
+           (CK_SESSION_HANDLE s, CK_OBJECT_HANDLE object, CK_ULONG *size),
+           (s, object, size),
+           s, CK_UNAVAILABLE_INFORMATION, 0, 0)
+
+STATS_WRAP(C_GetAttributeValue,
+           (CK_SESSION_HANDLE s, CK_OBJECT_HANDLE object, CK_ATTRIBUTE *tpl,
+            CK_ULONG count),
+           (s, object, tpl, count),
+           s, CK_UNAVAILABLE_INFORMATION, 0, 0)
+
+STATS_WRAP(C_SetAttributeValue,
+           (CK_SESSION_HANDLE s, CK_OBJECT_HANDLE object, CK_ATTRIBUTE *tpl,
+            CK_ULONG count),
+           (s, object, tpl, count),
+           s, CK_UNAVAILABLE_INFORMATION, 0, 0)
+
+STATS_WRAP(C_FindObjectsInit,
+           (CK_SESSION_HANDLE s, CK_ATTRIBUTE *tpl, CK_ULONG count),
+           (s, tpl, count),
+           s, CK_UNAVAILABLE_INFORMATION, 0, 0)
+
+STATS_WRAP(C_FindObjects,
+           (CK_SESSION_HANDLE s, CK_OBJECT_HANDLE *objects, CK_ULONG max,
+            CK_ULONG *count),
+           (s, objects, max, count),
+           s, CK_UNAVAILABLE_INFORMATION, 0, 0)
+
+STATS_WRAP(C_FindObjectsFinal,
+           (CK_SESSION_HANDLE s),
+           (s),
+           s, CK_UNAVAILABLE_INFORMATION, 0, 0)
+
+STATS_WRAP(C_EncryptInit,
+           (CK_SESSION_HANDLE s, CK_MECHANISM *mech, CK_OBJECT_HANDLE key),
+           (s, mech, key),
+           s, MECH(mech), 0, 0)
+
+STATS_WRAP(C_Encrypt,
+           (CK_SESSION_HANDLE s, CK_BYTE *in, CK_ULONG in_len, CK_BYTE *out,
+            CK_ULONG *out_len),
+           (s, in, in_len, out, out_len),
+           s, CK_UNAVAILABLE_INFORMATION, in_len, OUT_LEN(out, out_len))
+
+STATS_WRAP(C_EncryptUpdate,
+           (CK_SESSION_HANDLE s, CK_BYTE *in, CK_ULONG in_len, CK_BYTE *out,
+            CK_ULONG *out_len),
+           (s, in, in_len, out, out_len),
+           s, CK_UNAVAILABLE_INFORMATION, in_len, OUT_LEN(out, out_len))
+
+STATS_WRAP(C_EncryptFinal,
+           (CK_SESSION_HANDLE s, CK_BYTE *out, CK_ULONG *out_len),
+           (s, out, out_len),
+           s, CK_UNAVAILABLE_INFORMATION, 0, OUT_LEN(out, out_len))
+
+STATS_WRAP(C_DecryptInit,
+           (CK_SESSION_HANDLE s, CK_MECHANISM *mech, CK_OBJECT_HANDLE key),
+           (s, mech, key),
+           s, MECH(mech), 0, 0)
+
+STATS_WRAP(C_Decrypt,
+           (CK_SESSION_HANDLE s, CK_BYTE *in, CK_ULONG in_len, CK_BYTE *out,
+            CK_ULONG *out_len),
+           (s, in, in_len, out, out_len),
+           s, CK_UNAVAILABLE_INFORMATION, in_len, OUT_LEN(out, out_len))
+
+STATS_WRAP(C_DecryptUpdate,
+           (CK_SESSION_HANDLE s, CK_BYTE *in, CK_ULONG in_len, CK_BYTE *out,
+            CK_ULONG *out_len),
+           (s, in, in_len, out, out_len),
+           s, CK_UNAVAILABLE_INFORMATION, in_len, OUT_LEN(out, out_len))
+
+STATS_WRAP(C_DecryptFinal,
+           (CK_SESSION_HANDLE s, CK_BYTE *out, CK_ULONG *out_len),
+           (s, out, out_len),
+           s, CK_UNAVAILABLE_INFORMATION, 0, OUT_LEN(out, out_len))
+
+STATS_WRAP(C_DigestInit,
+           (CK_SESSION_HANDLE s, CK_MECHANISM *mech),
+           (s, mech),
+           s, MECH(mech), 0, 0)
+
+STATS_WRAP(C_Digest,
+           (CK_SESSION_HANDLE s, CK_BYTE *in, CK_ULONG in_len, CK_BYTE *out,
+            CK_ULONG *out_len),
+           (s, in, in_len, out, out_len),
+           s, CK_UNAVAILABLE_INFORMATION, in_len, OUT_LEN(out, out_len))
+
+STATS_WRAP(C_DigestUpdate,
+           (CK_SESSION_HANDLE s, CK_BYTE *in, CK_ULONG in_len),
+           (s, in, in_len),
+           s, CK_UNAVAILABLE_INFORMATION, in_len, 0)
+
+STATS_WRAP(C_DigestKey,
+           (CK_SESSION_HANDLE s, CK_OBJECT_HANDLE key),
+           (s, key),
+           s, CK_UNAVAILABLE_INFORMATION, 0, 0)
+
+STATS_WRAP(C_DigestFinal,
+           (CK_SESSION_HANDLE s, CK_BYTE *out, CK_ULONG *out_len),
+           (s, out, out_len),
+           s, CK_UNAVAILABLE_INFORMATION, 0, OUT_LEN(out, out_len))
+
+STATS_WRAP(C_SignInit,
+           (CK_SESSION_HANDLE s, CK_MECHANISM *mech, CK_OBJECT_HANDLE key),
+           (s, mech, key),
+           s, MECH(mech), 0, 0)
+
+STATS_WRAP(C_Sign,
+           (CK_SESSION_HANDLE s, CK_BYTE *in, CK_ULONG in_len, CK_BYTE *out,
+            CK_ULONG *out_len),
+           (s, in, in_len, out, out_len),
+           s, CK_UNAVAILABLE_INFORMATION, in_len, OUT_LEN(out, out_len))
+
+STATS_WRAP(C_SignUpdate,
+           (CK_SESSION_HANDLE s, CK_BYTE *in, CK_ULONG in_len),
+           (s, in, in_len),
+           s, CK_UNAVAILABLE_INFORMATION, in_len, 0)
+
+STATS_WRAP(C_SignFinal,
+           (CK_SESSION_HANDLE s, CK_BYTE *out, CK_ULONG *out_len),
+           (s, out, out_len),
+           s, CK_UNAVAILABLE_INFORMATION, 0, OUT_LEN(out, out_len))
+
+STATS_WRAP(C_SignRecoverInit,
+           (CK_SESSION_HANDLE s, CK_MECHANISM *mech, CK_OBJECT_HANDLE key),
+           (s, mech, key),
+           s, MECH(mech), 0, 0)
+
+STATS_WRAP(C_SignRecover,
+           (CK_SESSION_HANDLE s, CK_BYTE *in, CK_ULONG in_len, CK_BYTE *out,
+            CK_ULONG *out_len),
+           (s, in, in_len, out, out_len),
+           s, CK_UNAVAILABLE_INFORMATION, in_len, OUT_LEN(out, out_len))
+
+STATS_WRAP(C_VerifyInit,
+           (CK_SESSION_HANDLE s, CK_MECHANISM *mech, CK_OBJECT_HANDLE key),
+           (s, mech, key),
+           s, MECH(mech), 0, 0)
+
+STATS_WRAP(C_Verify,
+           (CK_SESSION_HANDLE s, CK_BYTE *in, CK_ULONG in_len, CK_BYTE *sig,
+            CK_ULONG sig_len),
+           (s, in, in_len, sig, sig_len),
+           s, CK_UNAVAILABLE_INFORMATION, in_len + sig_len, 0)
+
+STATS_WRAP(C_VerifyUpdate,
+           (CK_SESSION_HANDLE s, CK_BYTE *in, CK_ULONG in_len),
+           (s, in, in_len),
+           s, CK_UNAVAILABLE_INFORMATION, in_len, 0)
+
+STATS_WRAP(C_VerifyFinal,
+           (CK_SESSION_HANDLE s, CK_BYTE *sig, CK_ULONG sig_len),
+           (s, sig, sig_len),
+           s, CK_UNAVAILABLE_INFORMATION, sig_len, 0)
+
+STATS_WRAP(C_VerifyRecoverInit,
+           (CK_SESSION_HANDLE s, CK_MECHANISM *mech, CK_OBJECT_HANDLE key),
+           (s, mech, key),
+           s, MECH(mech), 0, 0)
+
+STATS_WRAP(C_VerifyRecover,
+           (CK_SESSION_HANDLE s, CK_BYTE *in, CK_ULONG in_len, CK_BYTE *out,
+            CK_ULONG *out_len),
+           (s, in, in_len, out, out_len),
+           s, CK_UNAVAILABLE_INFORMATION, in_len, OUT_LEN(out, out_len))
+
+STATS_WRAP(C_DigestEncryptUpdate,
+           (CK_SESSION_HANDLE s, CK_BYTE *in, CK_ULONG in_len, CK_BYTE *out,
+            CK_ULONG *out_len),
+           (s, in, in_len, out, out_len),
+           s, CK_UNAVAILABLE_INFORMATION, in_len, OUT_LEN(out, out_len))
+
+STATS_WRAP(C_DecryptDigestUpdate,
+           (CK_SESSION_HANDLE s, CK_BYTE *in, CK_ULONG in_len, CK_BYTE *out,
+            CK_ULONG *out_len),
+           (s, in, in_len, out, out_len),
+           s, CK_UNAVAILABLE_INFORMATION, in_len, OUT_LEN(out, out_len))
+
+STATS_WRAP(C_SignEncryptUpdate,
+           (CK_SESSION_HANDLE s, CK_BYTE *in, CK_ULONG in_len, CK_BYTE *out,
+            CK_ULONG *out_len),
+           (s, in, in_len, out, out_len),
+           s, CK_UNAVAILABLE_INFORMATION, in_len, OUT_LEN(out, out_len))
+
+STATS_WRAP(C_DecryptVerifyUpdate,
+           (CK_SESSION_HANDLE s, CK_BYTE *in, CK_ULONG in_len, CK_BYTE *out,
+            CK_ULONG *out_len),
+           (s, in, in_len, out, out_len),
+           s, CK_UNAVAILABLE_INFORMATION, in_len, OUT_LEN(out, out_len))
+
+STATS_WRAP(C_GenerateKey,
+           (CK_SESSION_HANDLE s, CK_MECHANISM *mech, CK_ATTRIBUTE *tpl,
+            CK_ULONG count, CK_OBJECT_HANDLE *key),
+           (s, mech, tpl, count, key),
+           s, MECH(mech), 0, 0)
+
+STATS_WRAP(C_GenerateKeyPair,
+           (CK_SESSION_HANDLE s, CK_MECHANISM *mech, CK_ATTRIBUTE *pub_tpl,
+            CK_ULONG pub_count, CK_ATTRIBUTE *priv_tpl, CK_ULONG priv_count,
+            CK_OBJECT_HANDLE *pub_key, CK_OBJECT_HANDLE *priv_key),
+           (s, mech, pub_tpl, pub_count, priv_tpl, priv_count, pub_key, priv_key),
+           s, MECH(mech), 0, 0)
+
+STATS_WRAP(C_WrapKey,
+           (CK_SESSION_HANDLE s, CK_MECHANISM *mech, CK_OBJECT_HANDLE
+            wrapping_key, CK_OBJECT_HANDLE key, CK_BYTE *out, CK_ULONG
+            *out_len),
+           (s, mech, wrapping_key, key, out, out_len),
+           s, MECH(mech), 0, OUT_LEN(out, out_len))
+
+STATS_WRAP(C_UnwrapKey,
+           (CK_SESSION_HANDLE s, CK_MECHANISM *mech, CK_OBJECT_HANDLE
+            unwrapping_key, CK_BYTE *in, CK_ULONG in_len, CK_ATTRIBUTE *tpl,
+            CK_ULONG count, CK_OBJECT_HANDLE *key),
+           (s, mech, unwrapping_key, in, in_len, tpl, count, key),
+           s, MECH(mech), in_len, 0)
+
+STATS_WRAP(C_DeriveKey,
+           (CK_SESSION_HANDLE s, CK_MECHANISM *mech, CK_OBJECT_HANDLE
+            base_key, CK_ATTRIBUTE *tpl, CK_ULONG count, CK_OBJECT_HANDLE
+            *key),
+           (s, mech, base_key, tpl, count, key),
+           s, MECH(mech), 0, 0)
+
+STATS_WRAP(C_SeedRandom,
+           (CK_SESSION_HANDLE s, CK_BYTE *seed, CK_ULONG seed_len),
+           (s, seed, seed_len),
+           s, CK_UNAVAILABLE_INFORMATION, seed_len, 0)
+
+STATS_WRAP(C_GenerateRandom,
+           (CK_SESSION_HANDLE s, CK_BYTE *out, CK_ULONG out_len),
+           (s, out, out_len),
+           s, CK_UNAVAILABLE_INFORMATION, 0, rv == CKR_OK ? out_len : 0)
+
+STATS_WRAP(C_GetFunctionStatus,
+           (CK_SESSION_HANDLE s),
+           (s),
+           s, CK_UNAVAILABLE_INFORMATION, 0, 0)
+
+STATS_WRAP(C_CancelFunction,
+           (CK_SESSION_HANDLE s),
+           (s),
+           s, CK_UNAVAILABLE_INFORMATION, 0, 0)
+
+STATS_WRAP(C_WaitForSlotEvent,
+           (CK_FLAGS flags, CK_SLOT_ID *slot, void *reserved),
+           (flags, slot, reserved),
+           CK_INVALID_HANDLE, CK_UNAVAILABLE_INFORMATION, 0, 0)
+
+bool p11_stats_attach(p11_obj_t *obj, bool counting, bool tracing)
+{
+    pthread_mutex_lock(&stats_lock);
+    if (stats_in_use || (tracing && !p11_trace_open())) {
+        pthread_mutex_unlock(&stats_lock);
+        return false;
+    }
+
+    stats_in_use = true;
+    stats_counting = counting;
+    stats_tracing = tracing;
+    stats_real = obj->func_list;
+    memset(stats_funcs, 0, sizeof(stats_funcs));
+
+    stats_list.version = obj->func_list->version;
+#define X(name) stats_list.name = stats_##name;
+    STATS_FUNCTIONS(X)
+#undef X
+
+    obj->func_list = &stats_list;
+    obj->is_stats = counting;
+    obj->is_traced = tracing;
+    pthread_mutex_unlock(&stats_lock);
+
+    return true;
+}
+
+void p11_stats_detach(p11_obj_t *obj)
+{
+    if (!obj->is_stats && !obj->is_traced) {
+        return;
+    }
+
+    pthread_mutex_lock(&stats_lock);
+    if (obj->is_traced) {
+        stats_tracing = false;
+        p11_trace_close();
+    }
+    obj->func_list = stats_real;
+    obj->is_stats = false;
+    obj->is_traced = false;
+    stats_counting = false;
+    stats_in_use = false;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static uint64_t stats_read(uint64_t *counter, bool reset)
+{
+    if (reset) {
+        return __atomic_exchange_n(counter, 0, __ATOMIC_RELAXED);
+    }
+
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static Janet stats_func_struct(stats_func_t *f, uint64_t calls, bool reset)
+{
+    JanetTable *errors = janet_table(0);
+    for (int i=0; i<STATS_ERROR_SLOTS; i++) {
+        CK_RV rv = __atomic_load_n(&f->errors[i].rv, __ATOMIC_RELAXED);
+        uint64_t count = stats_read(&f->errors[i].count, reset);
+        if (rv != CKR_OK && count) {
+            janet_table_put(errors, janet_ckeywordv(get_pkcs11_error(rv)),
+                            janet_wrap_number((double)count));
+        }
+    }
+    uint64_t other = stats_read(&f->other_errors, reset);
+    if (other) {
+        janet_table_put(errors, janet_ckeywordv("other"), janet_wrap_number((double)other));
+    }
+
+    Janet *latency = janet_tuple_begin(STATS_BUCKETS);
+    for (int i=0; i<STATS_BUCKETS; i++) {
+        latency[i] = janet_wrap_number((double)stats_read(&f->latency[i], reset));
+    }
+
+    JanetKV *st = janet_struct_begin(6);
+    janet_struct_put(st, janet_ckeywordv("calls"), janet_wrap_number((double)calls));
+    janet_struct_put(st, janet_ckeywordv("errors"),
+                     janet_wrap_struct(janet_table_to_struct(errors)));
+    janet_struct_put(st, janet_ckeywordv("bytes-in"),
+                     janet_wrap_number((double)stats_read(&f->bytes_in, reset)));
+    janet_struct_put(st, janet_ckeywordv("bytes-out"),
+                     janet_wrap_number((double)stats_read(&f->bytes_out, reset)));
+    janet_struct_put(st, janet_ckeywordv("time"),
+                     janet_wrap_number((double)stats_read(&f->time, reset)));
+    janet_struct_put(st, janet_ckeywordv("latency"),
+                     janet_wrap_tuple(janet_tuple_end(latency)));
+
+    return janet_wrap_struct(janet_struct_end(st));
+}
+
+JANET_FN(p11_stats,
+         "(stats p11-obj &opt :reset)",
+         "Returns the call statistics of a library loaded with `:stats`, or "
+         "nil if it was loaded without. The result maps every `C_*` function "
+         "called so far, e.g. `:C_Sign`, to a struct of `:calls`, `:errors` "
+         "(the number of calls per `CKR_*` code), `:bytes-in`, `:bytes-out`, "
+         "`:time` (the total time in nanoseconds) and `:latency`, a tuple "
+         "where element i is the number of calls that took 2^(i-1) to "
+         "2^i - 1 nanoseconds. With `:reset`, the counters are cleared after "
+         "reading.")
+{
+    janet_arity(argc, 1, 2);
+
+    p11_obj_t *obj = janet_getabstract(argv, 0, get_p11_obj_type());
+    bool reset = IS_ARG_KEYWORD(1, "reset");
+    if (argc == 2 && !reset) {
+        janet_panicf("expected :reset, got %v", argv[1]);
+    }
+
+    if (!obj->is_stats) {
+        return janet_wrap_nil();
+    }
+
+    JanetTable *ret = janet_table(0);
+    for (int fn=0; fn<STATS_COUNT; fn++) {
+        stats_func_t *f = &stats_funcs[fn];
+        uint64_t calls = stats_read(&f->calls, reset);
+        if (calls == 0) {
+            continue;
+        }
+
+        janet_table_put(ret, janet_ckeywordv(stats_names[fn]),
+                        stats_func_struct(f, calls, reset));
+    }
+
+    return janet_wrap_struct(janet_table_to_struct(ret));
+}
+
+void submod_stats(JanetTable *env) {
+    JanetRegExt cfuns[] = {
+        JANET_REG("stats", p11_stats),
+        JANET_REG_END
+    };
+    janet_cfuns_ext(env, "pkcs11", cfuns);
+}
@@ -0,0 +1,23 @@
+/*
+ * Copyright (c) 2024, Janet-pkcs11 Seungki Kim
+ *
+ * Janet-pkcs11 is released under the MIT License, see the LICENSE file.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include "main.h"
+
+/*
+ * Replaces obj->func_list with an instrumented copy that counts every call
+ * if `counting` and traces it if `tracing`. Returns false if another library
+ * is already instrumented.
+ */
+bool p11_stats_attach(p11_obj_t *obj, bool counting, bool tracing);
+void p11_stats_detach(p11_obj_t *obj);
+
+/* The name of function `fn`, e.g. "C_Sign", as numbered in traces */
+const char *p11_stats_function_name(int fn);
+
+#endif /* STATS_H */
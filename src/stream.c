@@ -0,0 +1,327 @@
+/*
+ * Copyright (c) 2024, Janet-pkcs11 Seungki Kim
+ *
+ * Janet-pkcs11 is released under the MIT License, see the LICENSE file.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include "main.h"
+#include "error.h"
+#include "output.h"
+
+#define STREAM_DEFAULT_CHUNK (64 * 1024)
+/* Room for padding and blocks held back by the provider */
+#define STREAM_SLACK 256
+
+/*
+ * Streaming encryption and decryption
+ *
+ * Data is read from a file in chunks into one native input buffer and run
+ * through C_EncryptUpdate or C_DecryptUpdate. The output goes to one of two
+ * native buffers, and a writer thread writes it out. While the writer
+ * writes one buffer, the provider fills the other.
+ */
+
+typedef struct stream_buffer {
+    CK_BYTE_PTR data;
+    CK_ULONG capacity;
+    CK_ULONG len;
+    bool is_full;
+} stream_buffer_t;
+
+typedef struct stream_writer {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    FILE *out;
+    stream_buffer_t buffers[2];
+    bool is_done;
+    bool is_failed;
+    uint64_t written;
+} stream_writer_t;
+
+static void *writer_main(void *arg)
+{
+    stream_writer_t *writer = arg;
+    int k = 0;
+
+    pthread_mutex_lock(&writer->lock);
+    for (;;) {
+        stream_buffer_t *buf = &writer->buffers[k];
+        while (!buf->is_full && !writer->is_done) {
+            pthread_cond_wait(&writer->cond, &writer->lock);
+        }
+        if (!buf->is_full) {
+            break;
+        }
+        bool skip = writer->is_failed;
+        pthread_mutex_unlock(&writer->lock);
+
+        bool ok = skip || fwrite(buf->data, 1, buf->len, writer->out) == buf->len;
+
+        pthread_mutex_lock(&writer->lock);
+        if (!ok) {
+            writer->is_failed = true;
+        } else if (!skip) {
+            writer->written += buf->len;
+        }
+        buf->is_full = false;
+        pthread_cond_broadcast(&writer->cond);
+        k ^= 1;
+    }
+    pthread_mutex_unlock(&writer->lock);
+
+    return NULL;
+}
+
+/* Waits until buffer `k` is written out and returns it */
+static stream_buffer_t *writer_acquire(stream_writer_t *writer, int k)
+{
+    stream_buffer_t *buf = &writer->buffers[k];
+
+    pthread_mutex_lock(&writer->lock);
+    while (buf->is_full) {
+        pthread_cond_wait(&writer->cond, &writer->lock);
+    }
+    pthread_mutex_unlock(&writer->lock);
+
+    return buf;
+}
+
+static void writer_submit(stream_writer_t *writer, int k)
+{
+    pthread_mutex_lock(&writer->lock);
+    writer->buffers[k].is_full = true;
+    pthread_cond_broadcast(&writer->cond);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+static bool writer_failed(stream_writer_t *writer)
+{
+    pthread_mutex_lock(&writer->lock);
+    bool failed = writer->is_failed;
+    pthread_mutex_unlock(&writer->lock);
+
+    return failed;
+}
+
+/* Waits for the pending buffers and stops the writer */
+static void writer_finish(stream_writer_t *writer)
+{
+    pthread_mutex_lock(&writer->lock);
+    writer->is_done = true;
+    pthread_cond_broadcast(&writer->cond);
+    pthread_mutex_unlock(&writer->lock);
+
+    pthread_join(writer->thread, NULL);
+    fflush(writer->out);
+}
+
+static bool buffer_grow(stream_buffer_t *buf, CK_ULONG len)
+{
+    CK_BYTE_PTR data = realloc(buf->data, len);
+    if (data == NULL) {
+        return false;
+    }
+
+    buf->data = data;
+    buf->capacity = len;
+    return true;
+}
+
+typedef struct stream_ctx {
+    CK_SESSION_HANDLE session;
+    p11_data_out_fn update_fn;
+    p11_final_out_fn final_fn;
+    CK_BYTE_PTR in;
+    CK_ULONG in_len;
+} stream_ctx_t;
+
+static CK_RV stream_call(stream_ctx_t *ctx, bool final, stream_buffer_t *buf)
+{
+    CK_RV rv;
+    for (int i=0; i<2; i++) {
+        buf->len = buf->capacity;
+        if (final) {
+            rv = ctx->final_fn(ctx->session, buf->data, &buf->len);
+        } else {
+            rv = ctx->update_fn(ctx->session, ctx->in, ctx->in_len, buf->data, &buf->len);
+        }
+
+        if (rv != CKR_BUFFER_TOO_SMALL || buf->len <= buf->capacity) {
+            break;
+        }
+        if (!buffer_grow(buf, buf->len)) {
+            return CKR_HOST_MEMORY;
+        }
+    }
+
+    return rv;
+}
+
+/* Panics unless the file in slot `n` is open and readable or writable */
+static void check_file(int32_t n, int32_t flags, bool is_output)
+{
+    if (flags & JANET_FILE_CLOSED) {
+        janet_panicf("bad slot #%d, file is closed", n);
+    }
+    if (is_output && !(flags & (JANET_FILE_WRITE | JANET_FILE_APPEND | JANET_FILE_UPDATE))) {
+        janet_panicf("bad slot #%d, file is not writable", n);
+    }
+    if (!is_output && !(flags & (JANET_FILE_READ | JANET_FILE_UPDATE))) {
+        janet_panicf("bad slot #%d, file is not readable", n);
+    }
+}
+
+static Janet crypt_stream(int32_t argc, Janet *argv,
+                          p11_data_out_fn update_fn, const char *update_desc,
+                          p11_final_out_fn final_fn, const char *final_desc)
+{
+    session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
+    int32_t in_flags, out_flags;
+    FILE *in = janet_getfile(argv, 1, &in_flags);
+    FILE *out = janet_getfile(argv, 2, &out_flags);
+    check_file(1, in_flags, false);
+    check_file(2, out_flags, true);
+    int32_t chunk = argc == 4 ? janet_getnat(argv, 3) : STREAM_DEFAULT_CHUNK;
+
+    if (chunk == 0 || chunk > INT32_MAX - STREAM_SLACK) {
+        janet_panic("chunk-size is out of range");
+    }
+
+    stream_writer_t writer;
+    memset(&writer, 0, sizeof(writer));
+    writer.out = out;
+
+    stream_ctx_t ctx = {obj->session, update_fn, final_fn, NULL, 0};
+    ctx.in = malloc(chunk);
+    bool ok = ctx.in != NULL;
+    for (int k=0; k<2; k++) {
+        ok = ok && buffer_grow(&writer.buffers[k], (CK_ULONG)chunk + STREAM_SLACK);
+    }
+
+    if (ok) {
+        pthread_mutex_init(&writer.lock, NULL);
+        pthread_cond_init(&writer.cond, NULL);
+        if (pthread_create(&writer.thread, NULL, writer_main, &writer) != 0) {
+            pthread_cond_destroy(&writer.cond);
+            pthread_mutex_destroy(&writer.lock);
+            ok = false;
+        }
+    }
+
+    if (!ok) {
+        free(ctx.in);
+        free(writer.buffers[0].data);
+        free(writer.buffers[1].data);
+        janet_panic("Failed to start streaming");
+    }
+
+    const char *error = NULL;
+    CK_RV rv = CKR_OK;
+    int k = 0;
+
+    for (;;) {
+        ctx.in_len = (CK_ULONG)fread(ctx.in, 1, chunk, in);
+        if (ctx.in_len == 0) {
+            if (ferror(in)) {
+                error = "failed to read input";
+            }
+            break;
+        }
+
+        stream_buffer_t *buf = writer_acquire(&writer, k);
+        rv = stream_call(&ctx, false, buf);
+        if (rv != CKR_OK) {
+            error = update_desc;
+            break;
+        }
+
+        if (buf->len) {
+            writer_submit(&writer, k);
+            k ^= 1;
+        }
+
+        if (writer_failed(&writer)) {
+            error = "failed to write output";
+            break;
+        }
+    }
+
+    stream_buffer_t *buf = writer_acquire(&writer, k);
+    if (error == NULL || rv == CKR_OK) {
+        /* Finishes the operation, also when a read or a write failed */
+        CK_RV final_rv = stream_call(&ctx, true, buf);
+        if (error == NULL && final_rv != CKR_OK) {
+            error = final_desc;
+            rv = final_rv;
+        }
+        if (error == NULL && buf->len) {
+            writer_submit(&writer, k);
+        }
+    }
+
+    writer_finish(&writer);
+    if (error == NULL && writer.is_failed) {
+        error = "failed to write output";
+    }
+
+    pthread_cond_destroy(&writer.cond);
+    pthread_mutex_destroy(&writer.lock);
+    free(ctx.in);
+    free(writer.buffers[0].data);
+    free(writer.buffers[1].data);
+
+    if (error != NULL) {
+        if (rv != CKR_OK) {
+            janet_panicf("%s, rv:%s", error, get_pkcs11_error(rv));
+        }
+        janet_panic(error);
+    }
+
+    return janet_wrap_number((double)writer.written);
+}
+
+JANET_FN(p11_encrypt_stream,
+         "(encrypt-stream session-obj in out &opt chunk-size)",
+         "Encrypts the rest of file `in` into file `out` in chunks of "
+         "`chunk-size` bytes, 64 KiB by default, continuing an operation "
+         "started by `encrypt-init`, and finishes the operation. Output is "
+         "written by a helper thread while the next chunk is encrypted. "
+         "Returns the number of bytes written.")
+{
+    janet_arity(argc, 3, 4);
+
+    session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
+
+    return crypt_stream(argc, argv,
+                        obj->func_list->C_EncryptUpdate, "C_EncryptUpdate",
+                        obj->func_list->C_EncryptFinal, "C_EncryptFinal");
+}
+
+JANET_FN(p11_decrypt_stream,
+         "(decrypt-stream session-obj in out &opt chunk-size)",
+         "Decrypts the rest of file `in` into file `out` in chunks of "
+         "`chunk-size` bytes, 64 KiB by default, continuing an operation "
+         "started by `decrypt-init`, and finishes the operation. Output is "
+         "written by a helper thread while the next chunk is decrypted. "
+         "Returns the number of bytes written.")
+{
+    janet_arity(argc, 3, 4);
+
+    session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
+
+    return crypt_stream(argc, argv,
+                        obj->func_list->C_DecryptUpdate, "C_DecryptUpdate",
+                        obj->func_list->C_DecryptFinal, "C_DecryptFinal");
+}
+
+void submod_stream(JanetTable *env) {
+    JanetRegExt cfuns[] = {
+        JANET_REG("encrypt-stream", p11_encrypt_stream),
+        JANET_REG("decrypt-stream", p11_decrypt_stream),
+        JANET_REG_END
+    };
+    janet_cfuns_ext(env, "pkcs11", cfuns);
+}
@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2024, Janet-pkcs11 Seungki Kim
+ *
+ * Janet-pkcs11 is released under the MIT License, see the LICENSE file.
+ */
+
+#include "main.h"
+#include "attribute.h"
+#include "types.h"
+
+/*
+ * A template object holds a ready-to-use CK_ATTRIBUTE array. All values are
+ * packed right after the array, in the memory of the abstract itself.
+ */
+typedef struct template_obj {
+    CK_ULONG count;
+    CK_ATTRIBUTE attributes[];
+} template_obj_t;
+
+/* Keeps CK_ULONG values aligned inside the arena */
+#define ALIGN_VALUE(len) (((len) + sizeof(CK_ULONG) - 1) & ~(sizeof(CK_ULONG) - 1))
+
+static JanetAbstractType template_obj_type = {
+    "template",
+    JANET_ATEND_NAME
+};
+
+JanetAbstractType *get_template_obj_type(void) {
+    return &template_obj_type;
+}
+
+/*
+ * Applies `overrides` to a copy of the attribute array of `base`.
+ * Attributes found in `base` are replaced, others are appended.
+ */
+static CK_ATTRIBUTE_PTR override_template(CK_ATTRIBUTE_PTR base, CK_ULONG base_count,
+                                          JanetStruct overrides, CK_ULONG *count)
+{
+    CK_ULONG override_count = (CK_ULONG)janet_struct_length(overrides);
+    CK_ATTRIBUTE_PTR p_overrides = janet_struct_to_p11_template(overrides);
+    CK_ATTRIBUTE_PTR p_template = janet_smalloc((base_count + override_count) * sizeof(CK_ATTRIBUTE));
+    CK_ULONG n = base_count;
+
+    memcpy(p_template, base, base_count * sizeof(CK_ATTRIBUTE));
+
+    for (CK_ULONG i=0; i<override_count; i++) {
+        CK_ULONG j;
+        for (j=0; j<base_count; j++) {
+            if (p_template[j].type == p_overrides[i].type) {
+                break;
+            }
+        }
+
+        if (j < base_count) {
+            p_template[j] = p_overrides[i];
+        } else {
+            p_template[n++] = p_overrides[i];
+        }
+    }
+
+    *count = n;
+    return p_template;
+}
+
+/*
+ * Returns the CK_ATTRIBUTE array of argv[n] and sets `count`. argv[n] is a
+ * template struct, a `template-obj`, or a tuple of [template overrides]
+ * where `overrides` is a struct of attributes replacing or extending those
+ * of `template`. A `template-obj` is used without any conversion.
+ */
+CK_ATTRIBUTE_PTR janet_get_p11_template(const Janet *argv, int32_t n, CK_ULONG *count)
+{
+    Janet x = argv[n];
+
+    switch (janet_type(x)) {
+        case JANET_STRUCT: {
+            JanetStruct st = janet_unwrap_struct(x);
+            *count = (CK_ULONG)janet_struct_length(st);
+            return janet_struct_to_p11_template(st);
+        }
+        case JANET_ABSTRACT: {
+            template_obj_t *obj = janet_checkabstract(x, get_template_obj_type());
+            if (obj == NULL) {
+                break;
+            }
+            *count = obj->count;
+            return obj->attributes;
+        }
+        case JANET_TUPLE: {
+            JanetTuple tup = janet_unwrap_tuple(x);
+            if (janet_tuple_length(tup) != 2) {
+                break;
+            }
+            CK_ULONG base_count;
+            CK_ATTRIBUTE_PTR base = janet_get_p11_template(tup, 0, &base_count);
+            JanetStruct overrides = janet_getstruct(tup, 1);
+            return override_template(base, base_count, overrides, count);
+        }
+        default:
+            break;
+    }
+
+    janet_panicf("bad slot #%d, expected struct, template or "
+                 "[template overrides], got %v", n, x);
+}
+
+JANET_FN(p11_template,
+         "(template template)",
+         "Converts a template struct, e.g. `{:CKA_CLASS :CKO_SECRET_KEY "
+         ":CKA_TOKEN true}`, into a `template-obj`. A `template-obj` can be "
+         "given to any function taking a template, and is used without "
+         "parsing the struct again. To change a few attributes per call, pass "
+         "`[template-obj overrides]`, where `overrides` is a struct of "
+         "attributes replacing or extending those of the template.")
+{
+    janet_fixarity(argc, 1);
+
+    JanetStruct st = janet_getstruct(argv, 0);
+    CK_ULONG count = (CK_ULONG)janet_struct_length(st);
+    int32_t capacity = janet_struct_capacity(st);
+
+    /* Size the arena first, then encode every value into it */
+    p11_attr_scalar_t scalar;
+    size_t values_len = 0;
+    for (int32_t i=0; i<capacity; i++) {
+        if (janet_checktype(st[i].key, JANET_NIL))
+            continue;
+
+        JanetByteView view = p11_attribute_value_bytes(st[i].value, &scalar);
+        values_len += ALIGN_VALUE((size_t)view.len);
+    }
+
+    template_obj_t *obj = janet_abstract(get_template_obj_type(),
+                                         sizeof(template_obj_t) +
+                                         count * sizeof(CK_ATTRIBUTE) +
+                                         values_len);
+    obj->count = count;
+
+    CK_BYTE_PTR value = (CK_BYTE_PTR)(obj->attributes + count);
+    CK_ULONG index = 0;
+    for (int32_t i=0; i<capacity; i++) {
+        if (janet_checktype(st[i].key, JANET_NIL))
+            continue;
+
+        JanetByteView view = p11_attribute_value_bytes(st[i].value, &scalar);
+        memcpy(value, view.bytes, view.len);
+
+        obj->attributes[index].type = get_type_value(janet_getkeyword(&st[i].key, 0));
+        obj->attributes[index].pValue = value;
+        obj->attributes[index].ulValueLen = (CK_ULONG)view.len;
+
+        value += ALIGN_VALUE((size_t)view.len);
+        index++;
+    }
+
+    return janet_wrap_abstract(obj);
+}
+
+void submod_template(JanetTable *env) {
+    JanetRegExt cfuns[] = {
+        JANET_REG("template", p11_template),
+        JANET_REG_END
+    };
+    janet_cfuns_ext(env, "pkcs11", cfuns);
+    janet_register_abstract_type(get_template_obj_type());
+}
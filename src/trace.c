@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2024, Janet-pkcs11 Seungki Kim
+ *
+ * Janet-pkcs11 is released under the MIT License, see the LICENSE file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "main.h"
+#include "error.h"
+#include "stats.h"
+#include "trace.h"
+
+/*
+ * Call trace
+ *
+ * Every call of a library loaded with `:trace` is stored as a fixed-size
+ * binary entry in a ring of TRACE_ENTRIES entries, overwriting the oldest
+ * one. Writers claim an entry with one atomic increment and never format
+ * or allocate anything. Each entry carries the sequence number it was
+ * written with, cleared while it is being written, so a reader skips
+ * entries that change under it.
+ *
+ * A dump file is TRACE_MAGIC, then the format version and the entry size as
+ * 32-bit numbers, then the entries from the oldest, all in the byte order
+ * of the host. `function` is the index of the function in CK_FUNCTION_LIST,
+ * not counting `version`.
+ */
+#define TRACE_ENTRIES 65536
+#define TRACE_MAGIC "P11TRACE"
+#define TRACE_VERSION 1
+
+typedef struct trace_entry {
+    uint64_t seq;
+    uint64_t session;
+    uint64_t mechanism;
+    uint64_t rv;
+    uint64_t start;     /* CLOCK_MONOTONIC, in nanoseconds */
+    uint64_t end;
+    uint32_t function;
+    uint32_t reserved;
+} trace_entry_t;
+
+static trace_entry_t *trace_ring = NULL;
+static uint64_t trace_head = 0;     /* sequence number of the last entry */
+static uint64_t trace_base = 0;     /* entries up to this one were cleared */
+
+bool p11_trace_open(void)
+{
+    trace_ring = calloc(TRACE_ENTRIES, sizeof(trace_entry_t));
+    trace_head = 0;
+    trace_base = 0;
+
+    return trace_ring != NULL;
+}
+
+void p11_trace_close(void)
+{
+    free(trace_ring);
+    trace_ring = NULL;
+}
+
+void p11_trace_push(int fn, CK_SESSION_HANDLE session, CK_MECHANISM_TYPE mechanism,
+                    CK_RV rv, uint64_t start, uint64_t end)
+{
+    uint64_t seq = __atomic_add_fetch(&trace_head, 1, __ATOMIC_RELAXED);
+    trace_entry_t *e = &trace_ring[(seq - 1) & (TRACE_ENTRIES - 1)];
+
+    __atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    e->session = session;
+    e->mechanism = mechanism;
+    e->rv = rv;
+    e->start = start;
+    e->end = end;
+    e->function = (uint32_t)fn;
+    e->reserved = 0;
+
+    __atomic_store_n(&e->seq, seq, __ATOMIC_RELEASE);
+}
+
+/* Copies the entries still in the ring, from the oldest, into scratch memory */
+static int32_t trace_snapshot(trace_entry_t **out)
+{
+    uint64_t head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+    uint64_t first = __atomic_load_n(&trace_base, __ATOMIC_RELAXED);
+    if (head - first > TRACE_ENTRIES) {
+        first = head - TRACE_ENTRIES;
+    }
+
+    trace_entry_t *entries = janet_smalloc((size_t)(head - first + 1) * sizeof(trace_entry_t));
+    int32_t count = 0;
+
+    for (uint64_t seq = first + 1; seq <= head; seq++) {
+        trace_entry_t *e = &trace_ring[(seq - 1) & (TRACE_ENTRIES - 1)];
+        if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != seq) {
+            continue;
+        }
+
+        trace_entry_t copy = *e;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq) {
+            continue;
+        }
+
+        entries[count++] = copy;
+    }
+
+    *out = entries;
+    return count;
+}
+
+static Janet trace_entry_struct(const trace_entry_t *e)
+{
+    JanetKV *st = janet_struct_begin(7);
+    janet_struct_put(st, janet_ckeywordv("function"),
+                     janet_ckeywordv(p11_stats_function_name(e->function)));
+    janet_struct_put(st, janet_ckeywordv("session"),
+                     e->session == CK_INVALID_HANDLE ?
+                     janet_wrap_nil() : janet_wrap_number((double)e->session));
+    janet_struct_put(st, janet_ckeywordv("mechanism"),
+                     e->mechanism == CK_UNAVAILABLE_INFORMATION ?
+                     janet_wrap_nil() : janet_wrap_number((double)e->mechanism));
+    janet_struct_put(st, janet_ckeywordv("rv"), janet_ckeywordv(get_pkcs11_error(e->rv)));
+    janet_struct_put(st, janet_ckeywordv("seq"), janet_wrap_number((double)e->seq));
+    janet_struct_put(st, janet_ckeywordv("start"), janet_wrap_number((double)e->start));
+    janet_struct_put(st, janet_ckeywordv("end"), janet_wrap_number((double)e->end));
+
+    return janet_wrap_struct(janet_struct_end(st));
+}
+
+static int32_t trace_write(const char *path, const trace_entry_t *entries, int32_t count)
+{
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        janet_panicf("failed to open %s", path);
+    }
+
+    uint32_t header[2] = {TRACE_VERSION, sizeof(trace_entry_t)};
+    bool ok = fwrite(TRACE_MAGIC, 1, 8, f) == 8 &&
+        fwrite(header, sizeof(header), 1, f) == 1 &&
+        (count == 0 || fwrite(entries, sizeof(trace_entry_t), count, f) == (size_t)count);
+    ok = (fclose(f) == 0) && ok;
+
+    if (!ok) {
+        janet_panicf("failed to write %s", path);
+    }
+
+    return count;
+}
+
+static p11_obj_t *get_traced_obj(const Janet *argv, int32_t n)
+{
+    p11_obj_t *obj = janet_getabstract(argv, n, get_p11_obj_type());
+    if (!obj->is_traced) {
+        janet_panic("the library was not loaded with :trace");
+    }
+
+    return obj;
+}
+
+JANET_FN(p11_trace_dump,
+         "(trace-dump p11-obj &opt path)",
+         "Returns the calls traced in a library loaded with `:trace`, from "
+         "the oldest, as an array of structs of `:function` (e.g. `:C_Sign`), "
+         "`:session`, `:mechanism`, `:rv`, `:seq`, `:start` and `:end` "
+         "(monotonic clock in nanoseconds). Only the latest 65536 calls are "
+         "kept. With `path`, the calls are written to that file in the "
+         "compact binary form of the trace instead, and their number is "
+         "returned.")
+{
+    janet_arity(argc, 1, 2);
+
+    get_traced_obj(argv, 0);
+    const char *path = argc == 2 ? janet_getcstring(argv, 1) : NULL;
+
+    trace_entry_t *entries;
+    int32_t count = trace_snapshot(&entries);
+
+    if (path != NULL) {
+        trace_write(path, entries, count);
+        janet_sfree(entries);
+        return janet_wrap_number(count);
+    }
+
+    JanetArray *ret = janet_array(count);
+    for (int32_t i=0; i<count; i++) {
+        janet_array_push(ret, trace_entry_struct(&entries[i]));
+    }
+    janet_sfree(entries);
+
+    return janet_wrap_array(ret);
+}
+
+JANET_FN(p11_trace_clear,
+         "(trace-clear p11-obj)",
+         "Drops the calls traced so far in a library loaded with `:trace`.")
+{
+    janet_fixarity(argc, 1);
+
+    get_traced_obj(argv, 0);
+
+    uint64_t head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&trace_base, head, __ATOMIC_RELAXED);
+
+    return janet_wrap_nil();
+}
+
+void submod_trace(JanetTable *env) {
+    JanetRegExt cfuns[] = {
+        JANET_REG("trace-dump", p11_trace_dump),
+        JANET_REG("trace-clear", p11_trace_clear),
+        JANET_REG_END
+    };
+    janet_cfuns_ext(env, "pkcs11", cfuns);
+}
@@ -0,0 +1,21 @@
+/*
+ * Copyright (c) 2024, Janet-pkcs11 Seungki Kim
+ *
+ * Janet-pkcs11 is released under the MIT License, see the LICENSE file.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include "main.h"
+
+/* Allocates and frees the trace ring, called with the stats lock held */
+bool p11_trace_open(void);
+void p11_trace_close(void);
+
+/* Records one call, safe to call from any thread */
+void p11_trace_push(int fn, CK_SESSION_HANDLE session, CK_MECHANISM_TYPE mechanism,
+                    CK_RV rv, uint64_t start, uint64_t end);
+
+#endif /* TRACE_H */
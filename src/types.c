@@ -7,11 +7,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include "main.h"
 #include "types.h"
 
-#define HASH_SIZE 1500
-
 typedef struct {
     const char *name;
     unsigned long value;
@@ -936,52 +935,221 @@ const TypeEntry type_table[] = {
     {NULL, 0}
 };
 
+#define TYPE_COUNT (sizeof(type_table) / sizeof(type_table[0]) - 1)
+
+/*
+ * Name lookup
+ *
+ * type_table is indexed by a perfect hash (hash and displace), built once
+ * when the module is loaded: a name is hashed into a bucket, and the
+ * displacement of the bucket places every name of it into its own slot.
+ * A lookup is one hash of the name and one probe.
+ *
+ * In front of it, each thread interns every name of type_table once, roots
+ * the keywords in one array, and indexes them by address in an open
+ * addressing table. Keywords are interned, so a keyword is resolved by
+ * comparing pointers, without hashing its name. The table is never
+ * evicted or rooted again. Setting P11_NO_KEYWORD_TABLE when the module
+ * is loaded skips it, for comparing both paths in bench/types.janet.
+ */
+
+#define PHASH_SLOTS 2048
+#define PHASH_BUCKETS 512
+#define PHASH_EMPTY 0xFFFF
+#define PHASH_MAX_DISP (1u << 20)
+
+/* A power of two, at least twice TYPE_COUNT */
+#define TYPE_KEYWORD_SLOTS 4096
+
 typedef struct {
-    const char *key;
+    JanetKeyword keyword;
     unsigned long value;
-} HashEntry;
+} TypeKeywordEntry;
+
+static uint32_t phash_disp[PHASH_BUCKETS];
+static uint16_t phash_slots[PHASH_SLOTS];
+static int phash_status = 0;
+static pthread_once_t phash_once = PTHREAD_ONCE_INIT;
+static bool type_keywords_disabled = false;
 
-static HashEntry hash_table[HASH_SIZE] = {{NULL, 0}};
+static JANET_THREAD_LOCAL TypeKeywordEntry *type_keywords;
+static JANET_THREAD_LOCAL JanetKeyword *attr_keywords;
 
-static unsigned int djb2_hash(const char *str) {
-    unsigned int hash = 5381;
+/* FNV-1a */
+static uint64_t name_hash(const char *str) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
     int c;
 
-    while ((c = *str++))
-        hash = ((hash << 5) + hash) + c;
+    while ((c = (unsigned char)*str++)) {
+        hash ^= (uint64_t)c;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
 
-    return hash % HASH_SIZE;
+static uint32_t phash_bucket(uint64_t hash) {
+    return (uint32_t)(hash >> 32) & (PHASH_BUCKETS - 1);
 }
 
-static void init_hash_table() {
-    static char init = 0;
-    if (init)
+static uint32_t phash_slot(uint64_t hash, uint32_t disp) {
+    uint64_t x = hash ^ ((uint64_t)disp * 0x9e3779b97f4a7c15ULL);
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+
+    return (uint32_t)x & (PHASH_SLOTS - 1);
+}
+
+/* Places the names of one bucket, returns 0 if successful. */
+static int place_bucket(uint32_t bucket, const uint64_t *hashes,
+                        const uint16_t *members, size_t count)
+{
+    uint32_t slots[PHASH_SLOTS / PHASH_BUCKETS * 8];
+
+    for (uint32_t disp = 0; disp < PHASH_MAX_DISP; disp++) {
+        size_t i;
+        for (i = 0; i < count; i++) {
+            uint32_t slot = phash_slot(hashes[members[i]], disp);
+            if (phash_slots[slot] != PHASH_EMPTY)
+                break;
+
+            size_t j;
+            for (j = 0; j < i; j++) {
+                if (slots[j] == slot)
+                    break;
+            }
+            if (j < i)
+                break;
+
+            slots[i] = slot;
+        }
+
+        if (i == count) {
+            for (i = 0; i < count; i++)
+                phash_slots[slots[i]] = members[i];
+            phash_disp[bucket] = disp;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static void build_perfect_hash(void) {
+    static uint64_t hashes[TYPE_COUNT];
+    static uint16_t bucket_size[PHASH_BUCKETS];
+    uint16_t members[PHASH_SLOTS / PHASH_BUCKETS * 8];
+    uint16_t max_size = 0;
+
+    memset(phash_slots, 0xFF, sizeof(phash_slots));
+    type_keywords_disabled = getenv("P11_NO_KEYWORD_TABLE") != NULL;
+
+    for (size_t i = 0; i < TYPE_COUNT; i++) {
+        hashes[i] = name_hash(type_table[i].name);
+        uint16_t size = ++bucket_size[phash_bucket(hashes[i])];
+        if (size > max_size)
+            max_size = size;
+    }
+
+    if (max_size > sizeof(members) / sizeof(members[0])) {
+        phash_status = -1;
         return;
+    }
+
+    /* Largest buckets first, while most slots are still free */
+    for (uint16_t size = max_size; size > 0; size--) {
+        for (uint32_t bucket = 0; bucket < PHASH_BUCKETS; bucket++) {
+            if (bucket_size[bucket] != size)
+                continue;
+
+            size_t count = 0;
+            for (size_t i = 0; i < TYPE_COUNT; i++) {
+                if (phash_bucket(hashes[i]) == bucket)
+                    members[count++] = (uint16_t)i;
+            }
+
+            if (place_bucket(bucket, hashes, members, count)) {
+                phash_status = -1;
+                return;
+            }
+        }
+    }
+}
 
-    for (int i = 0; type_table[i].name != NULL; i++) {
-        unsigned int index = djb2_hash(type_table[i].name);
-        while (hash_table[index].key != NULL)
-            index = (index + 1) % HASH_SIZE;
-        hash_table[index].key = type_table[i].name;
-        hash_table[index].value = type_table[i].value;
+void init_type_table(void) {
+    pthread_once(&phash_once, build_perfect_hash);
+    if (phash_status) {
+        janet_panic("Failed to build the type table");
     }
 
-    init = 1;
+    /* The tables hold keywords of the previous VM of this thread, if any */
+    free(type_keywords);
+    type_keywords = NULL;
+    free(attr_keywords);
+    attr_keywords = NULL;
 }
 
-unsigned long get_type_value(const unsigned char *type_name) {
-    init_hash_table();
+static uint32_t keyword_slot(JanetKeyword keyword) {
+    uint64_t x = (uint64_t)(uintptr_t)keyword * 0x9e3779b97f4a7c15ULL;
+
+    return (uint32_t)(x >> 40) & (TYPE_KEYWORD_SLOTS - 1);
+}
+
+static void init_type_keywords(void) {
+    TypeKeywordEntry *table = calloc(TYPE_KEYWORD_SLOTS, sizeof(TypeKeywordEntry));
+    if (table == NULL) {
+        janet_panic("Out of memory");
+    }
 
-    unsigned int index = djb2_hash((const char *)type_name);
-    while (hash_table[index].key != NULL) {
-        if (strcmp(hash_table[index].key, (const char *)type_name) == 0) {
-            return hash_table[index].value;
+    JanetArray *roots = janet_array(TYPE_COUNT);
+
+    for (size_t i = 0; i < TYPE_COUNT; i++) {
+        JanetKeyword keyword = janet_ckeyword(type_table[i].name);
+        uint32_t slot = keyword_slot(keyword);
+
+        while (table[slot].keyword != NULL && table[slot].keyword != keyword)
+            slot = (slot + 1) & (TYPE_KEYWORD_SLOTS - 1);
+
+        if (table[slot].keyword == NULL) {
+            table[slot].keyword = keyword;
+            table[slot].value = type_table[i].value;
+            janet_array_push(roots, janet_wrap_keyword(keyword));
         }
-        index = (index + 1) % HASH_SIZE;
     }
 
-    janet_panicf("%s type is not found", type_name);
-    return -1;
+    janet_gcroot(janet_wrap_array(roots));
+    type_keywords = table;
+}
+
+static unsigned long lookup_type_name(const unsigned char *type_name) {
+    uint64_t hash = name_hash((const char *)type_name);
+    uint16_t index = phash_slots[phash_slot(hash, phash_disp[phash_bucket(hash)])];
+
+    if (index == PHASH_EMPTY ||
+        strcmp(type_table[index].name, (const char *)type_name) != 0) {
+        janet_panicf("%s type is not found", type_name);
+    }
+
+    return type_table[index].value;
+}
+
+unsigned long get_type_value(const unsigned char *type_name) {
+    if (type_keywords == NULL) {
+        if (type_keywords_disabled)
+            return lookup_type_name(type_name);
+        init_type_keywords();
+    }
+
+    uint32_t slot = keyword_slot(type_name);
+    while (type_keywords[slot].keyword != NULL) {
+        if (type_keywords[slot].keyword == type_name)
+            return type_keywords[slot].value;
+        slot = (slot + 1) & (TYPE_KEYWORD_SLOTS - 1);
+    }
+
+    /* Every known name is in the table, this reports the unknown one */
+    return lookup_type_name(type_name);
 }
 
 
@@ -1113,7 +1281,7 @@ p11_attr_type_t get_attribute_type(CK_ATTRIBUTE_TYPE type) {
     return P11_ATTR_STRING;
 }
 
-const char *p11_attr_type_to_string(CK_ATTRIBUTE_TYPE type) {
+static const char *attr_type_name(CK_ATTRIBUTE_TYPE type) {
     switch(type) {
         case CKA_AC_ISSUER: return "CKA_AC_ISSUER";
         case CKA_ALLOWED_MECHANISMS: return "CKA_ALLOWED_MECHANISMS";
@@ -1221,6 +1389,117 @@ const char *p11_attr_type_to_string(CK_ATTRIBUTE_TYPE type) {
         case CKA_WRAP_TEMPLATE: return "CKA_WRAP_TEMPLATE";
         case CKA_WRAP_WITH_TRUSTED: return "CKA_WRAP_WITH_TRUSTED";
         default:
-            janet_panicf("0x%lx type is not found.", type);
+            return NULL;
     }
 }
+
+const char *p11_attr_type_to_string(CK_ATTRIBUTE_TYPE type) {
+    const char *name = attr_type_name(type);
+    if (name == NULL) {
+        janet_panicf("0x%lx type is not found.", type);
+    }
+
+    return name;
+}
+
+/*
+ * Attribute keywords
+ *
+ * The keyword of every attribute type is interned once per thread and kept
+ * in a table indexed by the attribute type, so results are built without
+ * looking up or interning names. Types above ATTR_KEYWORD_INDEX_SIZE
+ * (array attributes, CKA_VENDOR_DEFINED) are kept in a short list.
+ */
+
+#define ATTR_KEYWORD_INDEX_SIZE 0x1000
+#define ATTR_KEYWORD_EXTRA_SIZE 16
+
+typedef struct {
+    CK_ATTRIBUTE_TYPE type;
+    JanetKeyword keyword;
+} AttrKeywordEntry;
+
+static JANET_THREAD_LOCAL AttrKeywordEntry attr_keywords_extra[ATTR_KEYWORD_EXTRA_SIZE];
+static JANET_THREAD_LOCAL int attr_keywords_extra_count = 0;
+static JANET_THREAD_LOCAL JanetKeyword date_keywords[3];
+
+static void init_attr_keywords(void) {
+    JanetKeyword *keywords = calloc(ATTR_KEYWORD_INDEX_SIZE, sizeof(JanetKeyword));
+    if (keywords == NULL) {
+        janet_panic("Out of memory");
+    }
+
+    JanetArray *roots = janet_array(TYPE_COUNT);
+    attr_keywords_extra_count = 0;
+
+    for (size_t i = 0; i < TYPE_COUNT; i++) {
+        if (strncmp(type_table[i].name, "CKA_", 4) != 0)
+            continue;
+
+        CK_ATTRIBUTE_TYPE type = type_table[i].value;
+        const char *name = attr_type_name(type);
+        if (name == NULL)
+            continue;
+
+        JanetKeyword keyword = janet_ckeyword(name);
+        if (type < ATTR_KEYWORD_INDEX_SIZE) {
+            keywords[type] = keyword;
+        } else {
+            int j;
+            for (j = 0; j < attr_keywords_extra_count; j++) {
+                if (attr_keywords_extra[j].type == type)
+                    break;
+            }
+            if (j == attr_keywords_extra_count && j < ATTR_KEYWORD_EXTRA_SIZE) {
+                attr_keywords_extra[j].type = type;
+                attr_keywords_extra[j].keyword = keyword;
+                attr_keywords_extra_count++;
+            }
+        }
+        janet_array_push(roots, janet_wrap_keyword(keyword));
+    }
+
+    date_keywords[0] = janet_ckeyword("year");
+    date_keywords[1] = janet_ckeyword("month");
+    date_keywords[2] = janet_ckeyword("day");
+    for (int i = 0; i < 3; i++) {
+        janet_array_push(roots, janet_wrap_keyword(date_keywords[i]));
+    }
+
+    janet_gcroot(janet_wrap_array(roots));
+    attr_keywords = keywords;
+}
+
+/* Returns the keyword of an attribute type, e.g. :CKA_LABEL for CKA_LABEL. */
+Janet p11_attr_type_keyword(CK_ATTRIBUTE_TYPE type) {
+    if (attr_keywords == NULL) {
+        init_attr_keywords();
+    }
+
+    JanetKeyword keyword = NULL;
+    if (type < ATTR_KEYWORD_INDEX_SIZE) {
+        keyword = attr_keywords[type];
+    } else {
+        for (int i = 0; i < attr_keywords_extra_count; i++) {
+            if (attr_keywords_extra[i].type == type) {
+                keyword = attr_keywords_extra[i].keyword;
+                break;
+            }
+        }
+    }
+
+    if (keyword == NULL) {
+        janet_panicf("0x%lx type is not found.", type);
+    }
+
+    return janet_wrap_keyword(keyword);
+}
+
+/* Returns the :year, :month and :day keywords of a CK_DATE struct. */
+const JanetKeyword *p11_date_keywords(void) {
+    if (attr_keywords == NULL) {
+        init_attr_keywords();
+    }
+
+    return date_keywords;
+}
@@ -15,8 +15,11 @@ typedef enum p11_attr_type {
     P11_ATTR_STRING
 } p11_attr_type_t;
 
+void init_type_table(void);
 unsigned long get_type_value(const unsigned char *type_name);
 p11_attr_type_t get_attribute_type(CK_ATTRIBUTE_TYPE type);
 const char *p11_attr_type_to_string(unsigned long type);
+Janet p11_attr_type_keyword(CK_ATTRIBUTE_TYPE type);
+const JanetKeyword *p11_date_keywords(void);
 
 #endif /* PKCS11_TYPES_H */
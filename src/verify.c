@@ -7,6 +7,9 @@
 #include "main.h"
 #include "error.h"
 #include "attribute.h"
+#include "output.h"
+#include "mapped_file.h"
+#include "utils.h"
 
 JANET_FN(p11_verify_init,
          "(verify-init session-obj mechanism key-handle)",
@@ -16,10 +19,9 @@ JANET_FN(p11_verify_init,
     janet_fixarity(argc, 3);
 
     session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
-    JanetStruct mechanism = janet_getstruct(argv, 1);
     CK_OBJECT_HANDLE key_handle = janet_getnumber(argv, 2);
 
-    CK_MECHANISM_PTR p_mechanism = janet_struct_to_p11_mechanism(mechanism);
+    CK_MECHANISM_PTR p_mechanism = janet_get_p11_mechanism(argv, 1);
 
     CK_RV rv;
     rv = obj->func_list->C_VerifyInit(obj->session, p_mechanism, key_handle);
@@ -55,14 +57,188 @@ JANET_FN(p11_verify,
     return janet_wrap_boolean(ret);
 }
 
+JANET_FN(p11_verify_once,
+         "(verify-once session-obj mechanism key-handle data signature)",
+         "Verifies a signature of single-part data with `key-handle`, running "
+         "`verify-init` and `verify` in one call. `mechanism` is a struct or "
+         "a `mechanism-obj`. Returns a boolean, if successful.")
+{
+    janet_fixarity(argc, 5);
+
+    session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
+    CK_MECHANISM_PTR p_mechanism = janet_get_p11_mechanism(argv, 1);
+    CK_OBJECT_HANDLE key_handle = janet_getnumber(argv, 2);
+    JanetByteView data = janet_getbytes(argv, 3);
+    JanetByteView sig = janet_getbytes(argv, 4);
+
+    CK_RV rv;
+    rv = obj->func_list->C_VerifyInit(obj->session, p_mechanism, key_handle);
+    PKCS11_ASSERT(rv, "C_VerifyInit");
+
+    bool ret = false;
+    rv = obj->func_list->C_Verify(obj->session,
+                                  (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len,
+                                  (CK_BYTE_PTR)sig.bytes, (CK_ULONG)sig.len);
+    if (rv == CKR_OK) {
+        ret = true;
+    } else if (rv == CKR_SIGNATURE_INVALID) {
+        ret = false;
+    } else {
+        PKCS11_ASSERT(rv, "C_Verify");
+    }
+
+    return janet_wrap_boolean(ret);
+}
+
+JANET_FN(p11_verify_batch,
+         "(verify-batch session-obj mechanism key-handle pairs & options)",
+         "Verifies every `[data signature]` pair of `pairs` with `key-handle` "
+         "in a single call, running `verify-init` and `verify` for each pair. "
+         "Returns a tuple of booleans in the order of `pairs`, false where the "
+         "signature is invalid. Errors other than an invalid signature abort "
+         "the batch. `options` are keywords:\n\n"
+         "* :bitmap - return a buffer of bits instead, bit `i % 8` of byte "
+         "`i / 8` is set if the signature of pair `i` is valid.\n\n"
+         "* :fail-fast - stop at the first invalid signature. The result "
+         "then only covers the pairs verified so far.")
+{
+    janet_arity(argc, 4, -1);
+
+    session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
+    CK_OBJECT_HANDLE key_handle = janet_getnumber(argv, 2);
+    JanetView pairs = janet_getindexed(argv, 3);
+
+    bool bitmap = false;
+    bool fail_fast = false;
+    for (int32_t i=4; i<argc; i++) {
+        if (IS_ARG_KEYWORD(i, "bitmap")) {
+            bitmap = true;
+        } else if (IS_ARG_KEYWORD(i, "fail-fast")) {
+            fail_fast = true;
+        } else {
+            janet_panicf("expected :bitmap or :fail-fast, got %v", argv[i]);
+        }
+    }
+
+    CK_MECHANISM_PTR p_mechanism = janet_get_p11_mechanism(argv, 1);
+
+    JanetBuffer *bits = NULL;
+    Janet *tup = NULL;
+    if (bitmap) {
+        bits = janet_buffer((pairs.len + 7) / 8);
+        memset(bits->data, 0, (pairs.len + 7) / 8);
+    } else {
+        tup = janet_tuple_begin(pairs.len);
+    }
+
+    int32_t count = 0;
+    while (count < pairs.len) {
+        const Janet *pair;
+        int32_t pair_len;
+        if (!janet_indexed_view(pairs.items[count], &pair, &pair_len) || pair_len != 2) {
+            janet_panicf("bad pair #%d, expected [data signature], got %v",
+                         count, pairs.items[count]);
+        }
+
+        JanetByteView data = janet_getbytes(pair, 0);
+        JanetByteView sig = janet_getbytes(pair, 1);
+
+        CK_RV rv;
+        rv = obj->func_list->C_VerifyInit(obj->session, p_mechanism, key_handle);
+        if (rv != CKR_OK) {
+            janet_panicf("C_VerifyInit, pair #%d, rv:%s", count, get_pkcs11_error(rv));
+        }
+
+        rv = obj->func_list->C_Verify(obj->session,
+                                      (CK_BYTE_PTR)data.bytes, (CK_ULONG)data.len,
+                                      (CK_BYTE_PTR)sig.bytes, (CK_ULONG)sig.len);
+        if (rv != CKR_OK && rv != CKR_SIGNATURE_INVALID) {
+            janet_panicf("C_Verify, pair #%d, rv:%s", count, get_pkcs11_error(rv));
+        }
+
+        bool valid = (rv == CKR_OK);
+        if (bitmap) {
+            bits->data[count / 8] |= (uint8_t)(valid << (count % 8));
+        } else {
+            tup[count] = janet_wrap_boolean(valid);
+        }
+
+        count++;
+        if (!valid && fail_fast) {
+            break;
+        }
+    }
+
+    if (bitmap) {
+        bits->count = (count + 7) / 8;
+        return janet_wrap_buffer(bits);
+    }
+
+    if (count < pairs.len) {
+        /* Stopped early, return the verified part only */
+        return janet_wrap_tuple(janet_tuple_n(tup, count));
+    }
+
+    return janet_wrap_tuple(janet_tuple_end(tup));
+}
+
+JANET_FN(p11_verify_file,
+         "(verify-file session-obj mechanism key-handle path signature)",
+         "Verifies a signature or MAC of the file at `path`. The file is "
+         "mapped into memory and fed to `C_VerifyUpdate` in large chunks, "
+         "without being read into Janet buffers. Returns a boolean, if "
+         "successful.")
+{
+    janet_fixarity(argc, 5);
+
+    session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
+    CK_MECHANISM_PTR p_mechanism = janet_get_p11_mechanism(argv, 1);
+    CK_OBJECT_HANDLE key_handle = janet_getnumber(argv, 2);
+    JanetByteView sig = janet_getbytes(argv, 4);
+
+    mapped_file_t file;
+    p11_mapped_file_open(&file, argv, 3);
+
+    const char *desc = "C_VerifyInit";
+    CK_RV rv;
+    rv = obj->func_list->C_VerifyInit(obj->session, p_mechanism, key_handle);
+    if (rv == CKR_OK) {
+        desc = "C_VerifyUpdate";
+        rv = p11_mapped_file_feed(&file, obj->session, obj->func_list->C_VerifyUpdate);
+    }
+    p11_mapped_file_close(&file);
+    PKCS11_ASSERT(rv, desc);
+
+    bool ret = false;
+    rv = obj->func_list->C_VerifyFinal(obj->session,
+                                       (CK_BYTE_PTR)sig.bytes, (CK_ULONG)sig.len);
+    if (rv == CKR_OK) {
+        ret = true;
+    } else if (rv == CKR_SIGNATURE_INVALID) {
+        ret = false;
+    } else {
+        PKCS11_ASSERT(rv, "C_VerifyFinal");
+    }
+
+    return janet_wrap_boolean(ret);
+}
+
 JANET_FN(p11_verify_update,
          "(verify-update session-obj data)",
-         "Continues a multiple-part verification operation, processing another "
-         "`data` part. Returns a `session-obj`, if successful.")
+         "Continues a multiple-part verification operation, processing "
+         "another `data` part. `data` may also be an array or tuple of parts, "
+         "e.g. `[header body trailer]`, processed in order in one call. "
+         "Returns a `session-obj`, if successful.")
 {
     janet_fixarity(argc, 2);
 
     session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
+
+    if (janet_checktypes(argv[1], JANET_TFLAG_INDEXED)) {
+        p11_update_data(obj, argv, 1, obj->func_list->C_VerifyUpdate, "C_VerifyUpdate");
+        return janet_wrap_abstract(obj);
+    }
+
     JanetByteView data = janet_getbytes(argv, 1);
 
     CK_RV rv;
@@ -106,48 +282,38 @@ JANET_FN(p11_verify_recover_init,
     janet_fixarity(argc, 3);
 
     session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
-    JanetStruct mechanism = janet_getstruct(argv, 1);
     CK_OBJECT_HANDLE key_handle = janet_getnumber(argv, 2);
 
-    CK_MECHANISM_PTR p_mechanism = janet_struct_to_p11_mechanism(mechanism);
+    CK_MECHANISM_PTR p_mechanism = janet_get_p11_mechanism(argv, 1);
 
     CK_RV rv;
     rv = obj->func_list->C_VerifyRecoverInit(obj->session, p_mechanism, key_handle);
     PKCS11_ASSERT(rv, "C_VerifyRecoverInit");
 
+    p11_output_hint_init(obj, P11_OUTPUT_VERIFY_RECOVER, p_mechanism->mechanism, key_handle);
+
     return janet_wrap_abstract(obj);
 }
 
 JANET_FN(p11_verify_recover,
-         "(verify-recover session-obj signature)",
+         "(verify-recover session-obj signature &opt buffer mode)",
          "Verifies a signature in a single-part operation, where the data is "
          "recovered from the signature. If successful, resturns tuple of "
-         "[boolean string], where string is a recovered data.")
+         "[boolean string], where string is a recovered data. "
+         "With `buffer`, the output is appended to it, or replaces its "
+         "content if `mode` is `:overwrite`, and `buffer` is returned.")
 {
-    janet_fixarity(argc, 2);
+    janet_arity(argc, 2, 4);
 
     session_obj_t *obj = janet_getabstract(argv, 0, get_session_obj_type());
     JanetByteView sig = janet_getbytes(argv, 1);
 
-    CK_BYTE_PTR recover_data = NULL_PTR;
-    CK_ULONG recover_data_len = 0;
+    p11_output_t out = p11_output_buffer(argc, argv, 2);
 
     bool ret;
     CK_RV rv;
-    rv = obj->func_list->C_VerifyRecover(obj->session,
-                                         (CK_BYTE_PTR)sig.bytes, (CK_ULONG)sig.len,
-                                         recover_data, &recover_data_len);
-    PKCS11_ASSERT(rv, "C_VerifyRecover");
-
-    /*
-     * NOTE: Even if the signature is invalid, C_VerifyRecover must return
-     * CKR_OK when recover_data_len is 0.
-     */
-
-    recover_data = janet_smalloc(recover_data_len);
-    rv = obj->func_list->C_VerifyRecover(obj->session,
-                                         (CK_BYTE_PTR)sig.bytes, (CK_ULONG)sig.len,
-                                         recover_data, &recover_data_len);
+    rv = p11_output_data(obj, P11_OUTPUT_VERIFY_RECOVER, obj->func_list->C_VerifyRecover,
+                         (CK_BYTE_PTR)sig.bytes, (CK_ULONG)sig.len, &out);
     if (rv == CKR_OK) {
         ret = true;
     } else if (rv == CKR_SIGNATURE_INVALID) {
@@ -158,7 +324,7 @@ JANET_FN(p11_verify_recover,
 
     Janet *tup = janet_tuple_begin(2);
     tup[0] = janet_wrap_boolean(ret);
-    tup[1] = janet_wrap_string(janet_string(recover_data, recover_data_len));
+    tup[1] = p11_output_wrap(argc, argv, 2, &out);
 
     return janet_wrap_tuple(janet_tuple_end(tup));
 }
@@ -167,6 +333,9 @@ void submod_verify(JanetTable *env) {
     JanetRegExt cfuns[] = {
         JANET_REG("verify-init", p11_verify_init),
         JANET_REG("verify", p11_verify),
+        JANET_REG("verify-once", p11_verify_once),
+        JANET_REG("verify-batch", p11_verify_batch),
+        JANET_REG("verify-file", p11_verify_file),
         JANET_REG("verify-update", p11_verify_update),
         JANET_REG("verify-final", p11_verify_final),
         JANET_REG("verify-recover-init", p11_verify_recover_init),